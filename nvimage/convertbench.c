@@ -0,0 +1,182 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Benchmark of the BGRx to NV12/I420 kernels of the XShm capture path
+ * against GstVideoConverter, which is what videoconvert runs, with the
+ * videoconvert defaults and one thread.
+ *
+ *   ./convertbench [width height [frames]]
+ *
+ * Besides full frames the kernels convert a typical damage of a desktop,
+ * CONVERTBENCH_RECTS rectangles of 256x128. videoconvert always converts
+ * the full frame. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "nvimageconvert.h"
+
+#define CONVERTBENCH_RECTS 16
+
+static gdouble
+convertbench_kernel (NVimageConvertImpl impl, GstVideoFrame * in, GstVideoFrame * out,
+                     gint frames, gboolean damage)
+{
+        gint width = GST_VIDEO_FRAME_WIDTH (in);
+        gint height = GST_VIDEO_FRAME_HEIGHT (in);
+        guint8 *planes[GST_VIDEO_MAX_PLANES];
+        gint64 start;
+
+        for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES (out); i++)
+                planes[i] = GST_VIDEO_FRAME_PLANE_DATA (out, i);
+
+        start = g_get_monotonic_time ();
+        for (gint f = 0; f < frames; f++) {
+                if (!damage) {
+                        nvimageconvert_rect (impl, GST_VIDEO_FRAME_PLANE_DATA (in, 0),
+                                             GST_VIDEO_FRAME_PLANE_STRIDE (in, 0), GST_VIDEO_FRAME_FORMAT (out),
+                                             planes, out->info.stride, width, height, 0, 0, width, height);
+                        continue;
+                }
+                for (gint r = 0; r < CONVERTBENCH_RECTS; r++)
+                        nvimageconvert_rect (impl, GST_VIDEO_FRAME_PLANE_DATA (in, 0),
+                                             GST_VIDEO_FRAME_PLANE_STRIDE (in, 0), GST_VIDEO_FRAME_FORMAT (out),
+                                             planes, out->info.stride, width, height,
+                                             (r * 239 + f) % MAX (width - 256, 1), (r * 131 + f) % MAX (height - 128, 1),
+                                             256, 128);
+        }
+
+        return (g_get_monotonic_time () - start) / 1000.0 / frames;
+}
+
+static gdouble
+convertbench_videoconvert (GstVideoConverter * convert, GstVideoFrame * in, GstVideoFrame * out, gint frames)
+{
+        gint64 start = g_get_monotonic_time ();
+
+        for (gint f = 0; f < frames; f++)
+                gst_video_converter_frame (convert, in, out);
+
+        return (g_get_monotonic_time () - start) / 1000.0 / frames;
+}
+
+/* Largest difference of the luma planes, the chroma is sited and
+ * filtered differently */
+static gint
+convertbench_luma_diff (GstVideoFrame * a, GstVideoFrame * b)
+{
+        gint diff = 0;
+
+        for (gint y = 0; y < GST_VIDEO_FRAME_HEIGHT (a); y++) {
+                const guint8 *pa = (const guint8 *) GST_VIDEO_FRAME_PLANE_DATA (a, 0) + y * GST_VIDEO_FRAME_PLANE_STRIDE (a, 0);
+                const guint8 *pb = (const guint8 *) GST_VIDEO_FRAME_PLANE_DATA (b, 0) + y * GST_VIDEO_FRAME_PLANE_STRIDE (b, 0);
+
+                for (gint x = 0; x < GST_VIDEO_FRAME_WIDTH (a); x++)
+                        diff = MAX (diff, ABS (pa[x] - pb[x]));
+        }
+
+        return diff;
+}
+
+static void
+convertbench_format (GstVideoFormat format, GstVideoFrame * in, gint frames)
+{
+        GstVideoInfo info;
+        GstVideoConverter *convert;
+        GstBuffer *ref_buf, *out_buf;
+        GstVideoFrame ref, out;
+
+        gst_video_info_set_format (&info, format, GST_VIDEO_FRAME_WIDTH (in), GST_VIDEO_FRAME_HEIGHT (in));
+        ref_buf = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (&info), NULL);
+        out_buf = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (&info), NULL);
+        gst_video_frame_map (&ref, &info, ref_buf, GST_MAP_READWRITE);
+        gst_video_frame_map (&out, &info, out_buf, GST_MAP_READWRITE);
+
+        convert = gst_video_converter_new (&in->info, &info,
+                                           gst_structure_new ("GstVideoConverter",
+                                                              GST_VIDEO_CONVERTER_OPT_THREADS, G_TYPE_UINT, 1,
+                                                              NULL));
+
+        g_print ("%dx%d BGRx -> %s, %d frames, ms per frame\n", GST_VIDEO_FRAME_WIDTH (in),
+                 GST_VIDEO_FRAME_HEIGHT (in), gst_video_format_to_string (format), frames);
+        g_print ("  %-12s %8.2f\n", "videoconvert", convertbench_videoconvert (convert, in, &ref, frames));
+
+        for (NVimageConvertImpl impl = NVIMAGE_CONVERT_C; impl <= NVIMAGE_CONVERT_AVX2; impl++) {
+                gdouble full, damage;
+
+                if (!nvimageconvert_impl_supported (impl))
+                        continue;
+
+                full = convertbench_kernel (impl, in, &out, frames, FALSE);
+                g_print ("  %-12s %8.2f  luma differs by up to %d\n", nvimageconvert_impl_name (impl), full,
+                         convertbench_luma_diff (&ref, &out));
+                damage = convertbench_kernel (impl, in, &out, frames, TRUE);
+                g_print ("  %-12s %8.2f  %d damaged 256x128 rectangles\n", nvimageconvert_impl_name (impl), damage,
+                         CONVERTBENCH_RECTS);
+        }
+
+        gst_video_converter_free (convert);
+        gst_video_frame_unmap (&out);
+        gst_video_frame_unmap (&ref);
+        gst_buffer_unref (out_buf);
+        gst_buffer_unref (ref_buf);
+}
+
+int
+main (int argc, char **argv)
+{
+        gint width = argc > 2 ? atoi (argv[1]) : 3840;
+        gint height = argc > 2 ? atoi (argv[2]) : 2160;
+        gint frames = argc > 3 ? atoi (argv[3]) : 60;
+        GstVideoInfo info;
+        GstBuffer *buf;
+        GstVideoFrame in;
+        GRand *rand;
+
+        gst_init (&argc, &argv);
+
+        if (width < 2 || height < 2 || frames < 1) {
+                g_printerr ("usage: %s [width height [frames]]\n", argv[0]);
+                return 1;
+        }
+
+        /* Random pixels, the kernels have no shortcut for flat areas anyway */
+        gst_video_info_set_format (&info, GST_VIDEO_FORMAT_BGRx, width, height);
+        buf = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (&info), NULL);
+        gst_video_frame_map (&in, &info, buf, GST_MAP_READWRITE);
+        rand = g_rand_new_with_seed (1);
+        for (gint y = 0; y < height; y++) {
+                guint32 *p = (guint32 *) ((guint8 *) GST_VIDEO_FRAME_PLANE_DATA (&in, 0) +
+                                          y * GST_VIDEO_FRAME_PLANE_STRIDE (&in, 0));
+
+                for (gint x = 0; x < width; x++)
+                        p[x] = g_rand_int (rand);
+        }
+        g_rand_free (rand);
+
+        convertbench_format (GST_VIDEO_FORMAT_NV12, &in, frames);
+        convertbench_format (GST_VIDEO_FORMAT_I420, &in, frames);
+
+        gst_video_frame_unmap (&in);
+        gst_buffer_unref (buf);
+
+        return 0;
+}
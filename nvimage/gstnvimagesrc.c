@@ -63,7 +63,11 @@ GST_STATIC_PAD_TEMPLATE ("src", GST_PAD_SRC, GST_PAD_ALWAYS,
         "width = (int) [ 145, 4096 ], " "height = (int) [ 49, 4095 ], "
 	"stream-format = (string) byte-stream, "
 	"alignment = (string) au, "
-	"profile = (string) { main, high, high-4:4:4, baseline }"));
+	"profile = (string) { main, high, high-4:4:4, baseline }; "
+        "video/x-raw, "
+        "format = (string) { NV12, I420, BGRx }, "
+        "framerate = (fraction) [ 0, MAX ], "
+        "width = (int) [ 145, 4096 ], " "height = (int) [ 49, 4095 ]"));
 
 enum
 {
@@ -72,37 +76,215 @@ enum
         PROP_SHOW_POINTER,
         PROP_BITRATE,
         PROP_FPS,
+        PROP_STATS,
+        PROP_KEYFRAME_MIN_INTERVAL,
+        PROP_KEYFRAME_MERGE_WINDOW,
+        PROP_MAX_FRAME_SIZE,
+        PROP_SLICE_SIZE,
+        PROP_MAX_QP,
+        PROP_MAX_ENCODER_SESSIONS,
+        PROP_ENCODER_LEASE_TIME,
+        PROP_GPU,
+        PROP_CURRENT_GPU,
+        PROP_CAPTURE_MODE,
+        PROP_DIFF_MAP_BLOCK_SIZE,
+        PROP_UNCHANGED_FRAME_INTERVAL,
+        PROP_REFINE_QP,
+        PROP_REFINE_DELAY,
+        PROP_CONTENT_ADAPTIVE,
+        PROP_TEXT_FPS,
+        PROP_IDLE,
+        PROP_IDLE_FPS,
+        PROP_HIGH_REFRESH,
+        PROP_SCHED_POLICY,
+        PROP_SCHED_PRIORITY,
+        PROP_CPU_AFFINITY,
+        PROP_NUMA_LOCAL,
 };
 
+#define DEFAULT_KEYFRAME_MIN_INTERVAL (500 * GST_MSECOND)
+#define DEFAULT_KEYFRAME_MERGE_WINDOW (50 * GST_MSECOND)
+#define DEFAULT_ENCODER_LEASE_TIME 2000
+#define DEFAULT_GPU -1
+#define DEFAULT_CAPTURE_MODE NVIMAGE_CAPTURE_AUTO
+#define DEFAULT_REFINE_DELAY 500
+#define DEFAULT_IDLE_FPS 1
+#define DEFAULT_SCHED_POLICY NVIMAGE_SCHED_OTHER
+#define DEFAULT_SCHED_PRIORITY 10
+/* Time without screen changes before an idle source drops to idle-fps */
+#define IDLE_STATIC_TIME GST_SECOND
+
+#define GST_TYPE_NVIMAGE_CAPTURE_MODE (gst_nvimage_capture_mode_get_type ())
+static GType
+gst_nvimage_capture_mode_get_type (void)
+{
+        static GType type = 0;
+        static const GEnumValue modes[] = {
+                {NVIMAGE_CAPTURE_GL, "Capture to OpenGL textures", "gl"},
+                {NVIMAGE_CAPTURE_CUDA, "Capture to CUDA memory, no GLX context", "cuda"},
+                {NVIMAGE_CAPTURE_XSHM, "Capture damaged areas through XShm, no GPU, raw video only", "xshm"},
+                {NVIMAGE_CAPTURE_AUTO, "gl if the NVIDIA libraries are there and capture starts, xshm otherwise", "auto"},
+                {0, NULL, NULL},
+        };
+
+        if (!type)
+                type = g_enum_register_static ("GstNVimageCaptureMode", modes);
+        return type;
+}
+
+#define GST_TYPE_NVIMAGE_SCHED_POLICY (gst_nvimage_sched_policy_get_type ())
+static GType
+gst_nvimage_sched_policy_get_type (void)
+{
+        static GType type = 0;
+        static const GEnumValue policies[] = {
+                {NVIMAGE_SCHED_OTHER, "Default time sharing", "other"},
+                {NVIMAGE_SCHED_FIFO, "Real-time first in, first out", "fifo"},
+                {NVIMAGE_SCHED_RR, "Real-time round robin", "rr"},
+                {0, NULL, NULL},
+        };
+
+        if (!type)
+                type = g_enum_register_static ("GstNVimageSchedPolicy", policies);
+        return type;
+}
+
 #define gst_nvimage_src_parent_class parent_class
 G_DEFINE_TYPE (GstNVimageSrc, gst_nvimage_src, GST_TYPE_PUSH_SRC);
 
 static GstCaps *gst_nvimage_src_fixate (GstBaseSrc * bsrc, GstCaps * caps);
+static void gst_nvimage_src_reset_sched (GstNVimageSrc * s);
 
 static gboolean
 gst_nvimage_src_open_display (GstNVimageSrc * s, const gchar * name)
 {
+        GstXContext *xcontext;
+
         g_return_val_if_fail (GST_IS_NVIMAGE_SRC (s), FALSE);
 
         if (s->xcontext != NULL)
                 return TRUE;
 
-        s->xcontext = nvimageutil_xcontext_get_r (GST_ELEMENT (s), name);
-        if (s->xcontext == NULL) {
+        xcontext = nvimageutil_xcontext_get_r (GST_ELEMENT (s), name, s->gpu, s->capture_mode,
+                                               s->enc_config.max_sessions);
+        if (xcontext == NULL) {
                 GST_ELEMENT_ERROR (s, RESOURCE, OPEN_READ,
                                    ("Could not open X display for reading"),
                                    ("NULL returned from getting xcontext"));
                 return FALSE;
         }
-        s->width = s->xcontext->width;
-        s->height = s->xcontext->height;
 
-        if (s->xcontext == NULL)
-                return FALSE;
+        GST_OBJECT_LOCK (s);
+        s->xcontext = xcontext;
+        s->current_gpu = xcontext->gpu;
+        s->worker_tid = xcontext->worker_sys_tid;
+        GST_OBJECT_UNLOCK (s);
+        s->width = xcontext->width;
+        s->height = xcontext->height;
 
         return TRUE;
 }
 
+static GstStructure *
+gst_nvimage_src_create_stats (GstNVimageSrc * s)
+{
+        GstNVimageSrcStats *st = &s->stats;
+
+        return gst_structure_new ("application/x-nvimagesrc-stats",
+                "frames", G_TYPE_UINT64, st->frames,
+                "keyframes", G_TYPE_UINT64, st->keyframes,
+                "bytes", G_TYPE_UINT64, st->bytes,
+                "avg-qp", G_TYPE_DOUBLE, st->frames ? ((gdouble) st->qp_sum) / st->frames : 0.0,
+                "last-qp", G_TYPE_UINT, st->last_qp,
+                "last-size", G_TYPE_UINT, st->last_size,
+                "max-size", G_TYPE_UINT, st->max_size,
+                "max-keyframe-size", G_TYPE_UINT, st->max_keyframe_size,
+                "last-slices", G_TYPE_UINT, st->last_slices,
+                "last-picture-type", G_TYPE_STRING, gst_nvimageutil_picture_type_name (st->last_picture_type),
+                "keyframe-requests", G_TYPE_UINT64, st->keyframe_requests,
+                "keyframe-requests-merged", G_TYPE_UINT64, st->keyframe_requests_merged,
+                "keyframes-forced", G_TYPE_UINT64, st->keyframes_forced,
+                "capped-frames", G_TYPE_UINT64, st->capped_frames,
+                "oversize-frames", G_TYPE_UINT64, st->oversize_frames,
+                "unchanged-frames", G_TYPE_UINT64, st->unchanged_frames,
+                "refine-frames", G_TYPE_UINT64, st->refine_frames,
+                "refine-bytes", G_TYPE_UINT64, st->refine_bytes,
+                "motion-frames", G_TYPE_UINT64, st->motion_frames,
+                "content", G_TYPE_STRING, st->last_content == NVIMAGE_CONTENT_MOTION ? "motion" : "text",
+                "idle-skipped-frames", G_TYPE_UINT64, st->idle_skipped,
+                "encode-time", G_TYPE_UINT64, st->encode_time,
+                "last-encode-time", G_TYPE_UINT, st->last_encode_time,
+                "late-frames", G_TYPE_UINT64, st->late_frames,
+                "encoder-wait-frames", G_TYPE_UINT64, st->encoder_wait_frames,
+                "target-fps", G_TYPE_DOUBLE, ((gdouble) s->fps_n) / s->fps_d,
+                "achieved-fps", G_TYPE_DOUBLE, st->achieved_fps,
+                "worker-wakeup-time", G_TYPE_UINT64, st->wakeup_time,
+                "max-worker-wakeup-time", G_TYPE_UINT, st->max_wakeup_time,
+                "clock-waits", G_TYPE_UINT64, st->clock_waits,
+                "clock-overshoot", G_TYPE_UINT64, st->clock_overshoot,
+                "max-clock-overshoot", G_TYPE_UINT, st->max_clock_overshoot,
+                "worker-run-delay", G_TYPE_UINT64,
+                nvimagesched_run_delay (s->worker_tid),
+                "streaming-run-delay", G_TYPE_UINT64, nvimagesched_run_delay (s->streaming_tid),
+                NULL);
+}
+
+/* Flags the buffer from its frame meta and accounts it in the element stats */
+static void
+gst_nvimage_src_account_frame (GstNVimageSrc * s, GstBuffer * buf)
+{
+        GstMetaNVimageFrame *fmeta = GST_META_NVIMAGE_FRAME_GET (buf);
+        GstNVimageSrcStats *st = &s->stats;
+
+        if (!fmeta)
+                return;
+
+        if (fmeta->keyframe)
+                GST_BUFFER_FLAG_UNSET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+        else
+                GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+
+        GST_OBJECT_LOCK (s);
+        st->frames++;
+        st->bytes += fmeta->size;
+        st->qp_sum += fmeta->avg_qp;
+        st->last_qp = fmeta->avg_qp;
+        st->last_size = fmeta->size;
+        st->last_slices = fmeta->num_slices;
+        st->last_picture_type = fmeta->picture_type;
+        st->max_size = MAX (st->max_size, fmeta->size);
+        if (fmeta->keyframe) {
+                st->keyframes++;
+                st->max_keyframe_size = MAX (st->max_keyframe_size, fmeta->size);
+        }
+        if (fmeta->refine) {
+                st->refine_frames++;
+                st->refine_bytes += fmeta->size;
+        }
+        if (fmeta->content == NVIMAGE_CONTENT_MOTION)
+                st->motion_frames++;
+        st->last_content = fmeta->content;
+        st->encode_time += fmeta->encode_time;
+        st->last_encode_time = fmeta->encode_time;
+        /* A frame within 1/8 of the bound had its size decided by the cap
+         * rather than by the content, one above it could not be held even
+         * at the highest allowed QP */
+        if (s->enc_config.max_frame_size) {
+                if (fmeta->size > s->enc_config.max_frame_size) {
+                        st->oversize_frames++;
+                        GST_DEBUG_OBJECT (s, "frame %u of %" G_GSIZE_FORMAT " bytes exceeds the bound of %u",
+                                        fmeta->frame_idx, fmeta->size, s->enc_config.max_frame_size);
+                } else if (fmeta->size >= s->enc_config.max_frame_size - s->enc_config.max_frame_size / 8) {
+                        st->capped_frames++;
+                }
+        }
+        GST_OBJECT_UNLOCK (s);
+
+        GST_LOG_OBJECT (s, "frame %u type %s size %" G_GSIZE_FORMAT " qp %u slices %u",
+                        fmeta->frame_idx, gst_nvimageutil_picture_type_name (fmeta->picture_type),
+                        fmeta->size, fmeta->avg_qp, fmeta->num_slices);
+}
+
 static gboolean
 gst_nvimage_src_start (GstBaseSrc * basesrc)
 {
@@ -110,6 +292,17 @@ gst_nvimage_src_start (GstBaseSrc * basesrc)
 
         s->last_frame_no = -1;
         s->frame = 0;
+        GST_OBJECT_LOCK (s);
+        memset (&s->stats, 0, sizeof (s->stats));
+        s->last_keyframe_ts = GST_CLOCK_TIME_NONE;
+        s->last_push_ts = GST_CLOCK_TIME_NONE;
+        s->last_change_ts = GST_CLOCK_TIME_NONE;
+        s->rate_window_ts = GST_CLOCK_TIME_NONE;
+        s->streaming_tid = 0;
+        /* The worker thread of the new context starts with the defaults */
+        if (s->sched_policy != NVIMAGE_SCHED_OTHER || (s->cpu_affinity && *s->cpu_affinity) || s->numa_local)
+                s->sched_dirty = TRUE;
+        GST_OBJECT_UNLOCK (s);
         return gst_nvimage_src_open_display (s, s->display_name);
 }
 
@@ -117,10 +310,19 @@ static gboolean
 gst_nvimage_src_stop (GstBaseSrc * basesrc)
 {
         GstNVimageSrc *src = GST_NVIMAGE_SRC (basesrc);
+        GstXContext *xcontext;
 
         src->frame = 0;
-        nvimageutil_xcontext_clear_r (src->xcontext);
+        GST_OBJECT_LOCK (src);
+        /* The task ended without a flush, e.g. after EOS or an error */
+        gst_nvimage_src_reset_sched (src);
+        xcontext = src->xcontext;
         src->xcontext = NULL;
+        src->current_gpu = -1;
+        src->worker_tid = 0;
+        GST_OBJECT_UNLOCK (src);
+        if (xcontext)
+                nvimageutil_xcontext_clear_r (xcontext);
         return TRUE;
 }
 
@@ -140,16 +342,228 @@ gst_nvimage_src_unlock (GstBaseSrc * basesrc)
         return TRUE;
 }
 
+/* Decides whether the frame captured at @ts has to be an IDR. A pending
+ * request waits for the merge window (unless it asked for all headers) so
+ * that requests from several consumers result in a single IDR, and no IDR
+ * is forced sooner than keyframe-min-interval after the previous one.
+ * Must be called with the object lock held. */
+static gboolean
+gst_nvimage_src_schedule_keyframe (GstNVimageSrc * s, GstClockTime ts)
+{
+        if (!s->keyframe)
+                return FALSE;
+
+        if (!GST_CLOCK_TIME_IS_VALID (s->keyframe_pending_ts))
+                s->keyframe_pending_ts = ts;
+
+        if (!s->keyframe_all_headers && ts < s->keyframe_pending_ts + s->keyframe_merge_window)
+                return FALSE;
+
+        if (GST_CLOCK_TIME_IS_VALID (s->last_keyframe_ts) &&
+                        ts < s->last_keyframe_ts + s->keyframe_min_interval) {
+                GST_LOG_OBJECT (s, "Deferring keyframe, last one at %" GST_TIME_FORMAT,
+                                GST_TIME_ARGS (s->last_keyframe_ts));
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Called with the object lock held once an encoded picture captured at @ts
+ * is returned. In pipelined mode it is the one submitted by the previous
+ * call, so the forced flag comes from its meta. */
+static void
+gst_nvimage_src_keyframe_done (GstNVimageSrc * s, GstBuffer * buf, GstClockTime ts)
+{
+        GstMetaNVimageFrame *fmeta = GST_META_NVIMAGE_FRAME_GET (buf);
+        gboolean forced = fmeta && fmeta->forced;
+
+        if (forced)
+                s->stats.keyframes_forced++;
+
+        if (!forced && !(fmeta && fmeta->keyframe))
+                return;
+
+        s->last_keyframe_ts = ts;
+
+        /* Requests seen before this capture are satisfied by it, also when the
+         * encoder emitted the IDR on its own (e.g. after a reconfiguration) */
+        if (GST_CLOCK_TIME_IS_VALID (s->keyframe_pending_ts) && s->keyframe_pending_ts <= ts) {
+                GST_DEBUG_OBJECT (s, "Keyframe at %" GST_TIME_FORMAT " satisfies request from %" GST_TIME_FORMAT,
+                                GST_TIME_ARGS (ts), GST_TIME_ARGS (s->keyframe_pending_ts));
+                s->keyframe = FALSE;
+                s->keyframe_all_headers = FALSE;
+                s->keyframe_pending_ts = GST_CLOCK_TIME_NONE;
+        }
+}
+
+/* Called with the object lock held. TRUE if the diff map or the damage of
+ * the raw frame captured at @ts shows no change and the last pushed frame
+ * is recent enough, downstream encoders then have nothing to do. */
+static gboolean
+gst_nvimage_src_skip_unchanged (GstNVimageSrc * s, GstBuffer * buf, GstClockTime ts)
+{
+        GstMetaNVimage *meta = GST_META_NVIMAGE_GET (buf);
+
+        if (!s->unchanged_frame_interval || !meta || meta->changed_blocks != 0)
+                return FALSE;
+        if (!GST_CLOCK_TIME_IS_VALID (s->last_push_ts) ||
+                        ts >= s->last_push_ts + s->unchanged_frame_interval)
+                return FALSE;
+
+        s->stats.unchanged_frames++;
+        return TRUE;
+}
+
+/* Remembers when the screen last changed. Raw frames without a diff map
+   or damage count as changed. Called with the object lock. */
+static void
+gst_nvimage_src_track_change (GstNVimageSrc * s, GstBuffer * buf, GstClockTime ts)
+{
+        GstMetaNVimageFrame *fmeta = GST_META_NVIMAGE_FRAME_GET (buf);
+        GstMetaNVimage *meta = GST_META_NVIMAGE_GET (buf);
+
+        if (fmeta ? fmeta->changed : (!meta || meta->changed_blocks != 0))
+                s->last_change_ts = ts;
+}
+
+/* Applies the scheduling properties to the streaming thread, which calls
+   this, and to the worker thread capturing and encoding for it. Failures,
+   e.g. a real-time policy without CAP_SYS_NICE, are only logged. */
+static void
+gst_nvimage_src_apply_sched (GstNVimageSrc * s)
+{
+        const gchar *names[] = { "streaming", "worker" };
+        pthread_t threads[] = { pthread_self (), s->xcontext->worker_tid };
+        NVimageSchedPolicy policy;
+        guint priority;
+        gboolean numa_local;
+        gchar *cpus, *local_cpus = NULL;
+        gint err;
+
+        GST_OBJECT_LOCK (s);
+        policy = s->sched_policy;
+        priority = s->sched_priority;
+        cpus = g_strdup (s->cpu_affinity);
+        numa_local = s->numa_local;
+        s->sched_dirty = FALSE;
+        GST_OBJECT_UNLOCK (s);
+
+        if (numa_local) {
+                local_cpus = nvimagesched_gpu_cpus (s->xcontext->gpu);
+                if (local_cpus)
+                        GST_INFO_OBJECT (s, "GPU %d is local to CPUs %s", s->xcontext->gpu, local_cpus);
+                else
+                        GST_WARNING_OBJECT (s, "Cannot find the CPUs local to GPU %d", s->xcontext->gpu);
+        }
+
+        for (guint i = 0; i < G_N_ELEMENTS (threads); i++) {
+                err = nvimagesched_set_policy (threads[i], policy, priority);
+                if (err)
+                        GST_WARNING_OBJECT (s, "Cannot set the scheduling policy of the %s thread: %s",
+                                            names[i], g_strerror (err));
+                err = nvimagesched_set_cpus (threads[i], cpus, local_cpus);
+                if (err)
+                        GST_WARNING_OBJECT (s, "Cannot set the CPU affinity of the %s thread to \"%s\"%s: %s",
+                                            names[i], cpus ? cpus : "", local_cpus ? " on the GPU's node" : "",
+                                            g_strerror (err));
+        }
+
+        GST_OBJECT_LOCK (s);
+        s->streaming_sched = policy != NVIMAGE_SCHED_OTHER || (cpus && *cpus) || local_cpus;
+        GST_OBJECT_UNLOCK (s);
+
+        g_free (local_cpus);
+        g_free (cpus);
+}
+
+/* The streaming thread belongs to the pool of GstTask and goes on to run
+   other tasks, audio or webrtcbin ones, once ours ends. It gets the
+   defaults back first, a new task applies the properties again. Called
+   with the object lock. */
+static void
+gst_nvimage_src_reset_sched (GstNVimageSrc * s)
+{
+        gint err;
+
+        if (!s->streaming_sched)
+                return;
+
+        err = nvimagesched_reset (s->streaming_tid);
+        if (err)
+                GST_WARNING_OBJECT (s, "Cannot reset the scheduling of the streaming thread: %s",
+                                    g_strerror (err));
+        s->streaming_sched = FALSE;
+        s->sched_dirty = TRUE;
+}
+
+/* Updates the achieved frame rate once a second from the frames pushed
+   since the last update. Called with the object lock. */
+static void
+gst_nvimage_src_account_rate (GstNVimageSrc * s, GstClockTime ts)
+{
+        if (!GST_CLOCK_TIME_IS_VALID (s->rate_window_ts) || ts < s->rate_window_ts) {
+                s->rate_window_ts = ts;
+                s->rate_window_frames = 0;
+                return;
+        }
+
+        s->rate_window_frames++;
+        if (ts < s->rate_window_ts + GST_SECOND)
+                return;
+
+        s->stats.achieved_fps = ((gdouble) s->rate_window_frames) * GST_SECOND / (ts - s->rate_window_ts);
+        s->rate_window_ts = ts;
+        s->rate_window_frames = 0;
+}
+
+/* Slots of the frame rate grid are skipped to capture at a lower rate:
+   at idle-fps while the application reports an idle user and the screen
+   is static, and with content-adaptive at text-fps while it sees text.
+   A pending keyframe is never held back. Called with the object lock. */
+static gboolean
+gst_nvimage_src_skip_slot (GstNVimageSrc * s, gint64 frame_no, GstClockTime ts)
+{
+        gboolean encode = s->enc_config.raw_format == GST_VIDEO_FORMAT_UNKNOWN;
+        gboolean idle;
+        guint fps = 0;
+        guint divider;
+
+        if (encode && s->keyframe)
+                return FALSE;
+
+        idle = s->idle && s->idle_fps && GST_CLOCK_TIME_IS_VALID (s->last_change_ts) &&
+                        ts >= s->last_change_ts + IDLE_STATIC_TIME;
+        if (idle)
+                fps = s->idle_fps;
+        else if (encode && s->enc_config.content_adaptive &&
+                        s->stats.last_content == NVIMAGE_CONTENT_TEXT)
+                fps = s->enc_config.text_fps;
+        if (!fps)
+                return FALSE;
+
+        divider = MAX (s->fps_n / (s->fps_d * fps), 1);
+        if (frame_no % divider == 0)
+                return FALSE;
+
+        if (idle)
+                s->stats.idle_skipped++;
+        return TRUE;
+}
+
 static GstFlowReturn
 gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
 {
         GstNVimageSrc *s = GST_NVIMAGE_SRC (bs);
         GstBuffer *image;
         GstClockTime base_time;
-        GstClockTime next_capture_ts, pts;
+        GstClockTime next_capture_ts, capture_ts, pts;
+        GstMetaNVimageFrame *fmeta;
         GstClockTime dur;
+        GstClockTimeDiff jitter;
         gint64 next_frame_no;
-	gint32 _keyframe;
+	gint32 _keyframe = FALSE;
+        GstNVimageEncConfig enc_config;
 
         if (s->fps_n <= 0 || s->fps_d <= 0)
                 return GST_FLOW_NOT_NEGOTIATED;     /* FPS must be > 0 */
@@ -158,6 +572,7 @@ gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
                 sleep(5);
         }
 
+again:
         /* Now, we might need to wait for the next multiple of the fps
          * before capturing */
 
@@ -169,6 +584,22 @@ gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
                 return GST_FLOW_ERROR;
         }
 
+        if (!s->streaming_tid)
+                s->streaming_tid = nvimagesched_gettid ();
+        if (s->sched_dirty) {
+                GST_OBJECT_UNLOCK (s);
+                gst_nvimage_src_apply_sched (s);
+                goto again;
+        }
+
+        /* Frame numbers of another rate mean nothing on the current grid,
+         * one of a higher rate would keep the source from ever waiting */
+        if (s->fps_n != s->last_fps_n || s->fps_d != s->last_fps_d) {
+                s->last_frame_no = -1;
+                s->last_fps_n = s->fps_n;
+                s->last_fps_d = s->fps_d;
+        }
+
         base_time = GST_ELEMENT_CAST (s)->base_time;
         pts = next_capture_ts = gst_clock_get_time (GST_ELEMENT_CLOCK (s));
         next_capture_ts -= base_time;
@@ -194,13 +625,24 @@ gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
                 GST_OBJECT_UNLOCK (s);
 
                 GST_DEBUG_OBJECT (s, "Waiting for next frame time %" G_GUINT64_FORMAT, next_capture_ts);
-                ret = gst_clock_id_wait (id, NULL);
+                ret = gst_clock_id_wait (id, &jitter);
                 GST_OBJECT_LOCK (s);
 
+                /* How late the streaming thread got to run after the wait */
+                if (ret == GST_CLOCK_OK) {
+                        guint overshoot = MAX (jitter, 0) / GST_USECOND;
+
+                        s->stats.clock_waits++;
+                        s->stats.clock_overshoot += overshoot;
+                        s->stats.max_clock_overshoot = MAX (s->stats.max_clock_overshoot, overshoot);
+                }
+
                 gst_clock_id_unref (id);
                 s->clock_id = NULL;
                 if (ret == GST_CLOCK_UNSCHEDULED) {
-                        /* Got woken up by the unlock function */
+                        /* Got woken up by the unlock function, the task
+                         * pauses or stops */
+                        gst_nvimage_src_reset_sched (s);
                         GST_OBJECT_UNLOCK (s);
                         return GST_FLOW_FLUSHING;
                 }
@@ -215,29 +657,76 @@ gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
                 next_frame_ts = gst_util_uint64_scale (next_frame_no + 1, s->fps_d * GST_SECOND, s->fps_n);
                 /* Frame duration is from now until the next expected capture time */
                 dur = next_frame_ts - next_capture_ts;
+                /* Slots passed while the previous frame was captured and
+                 * encoded, the source is falling behind its frame rate */
+                if (s->last_frame_no >= 0 && next_frame_no > s->last_frame_no + 1)
+                        s->stats.late_frames += next_frame_no - s->last_frame_no - 1;
         }
         //dur = gst_util_uint64_scale_int (GST_SECOND, s->fps_d, s->fps_n);
         s->last_frame_no = next_frame_no;
+        if (gst_nvimage_src_skip_slot (s, next_frame_no, next_capture_ts)) {
+                GST_OBJECT_UNLOCK (s);
+                goto again;
+        }
+        enc_config = s->enc_config;
+        /* Raw frames leave the keyframe requests to the encoder downstream */
+        if (enc_config.raw_format == GST_VIDEO_FORMAT_UNKNOWN)
+                _keyframe = gst_nvimage_src_schedule_keyframe (s, next_capture_ts);
         GST_OBJECT_UNLOCK (s);
 
-	_keyframe = s->keyframe;
-
         image = gst_nvimageutil_nvimage_new_r(s->xcontext, GST_ELEMENT(s), 
                                             s->fps_n, s->fps_d, s->bitrate, s->show_pointer, _keyframe, 
-                                            next_frame_no, next_capture_ts);
+                                            next_frame_no, next_capture_ts, &enc_config);
 
-        if(_keyframe) {
-                s->keyframe = 0;
+        if (!image && s->xcontext->ticket) {
+                /* Queued for an encoder session. Downstream keeps showing the
+                 * last picture, and the next frame slot asks the broker again. */
+                GST_LOG_OBJECT (s, "Waiting for an encoder session");
+                GST_OBJECT_LOCK (s);
+                s->stats.encoder_wait_frames++;
+                GST_OBJECT_UNLOCK (s);
+                if (s->frame > 0)
+                        gst_pad_push_event (GST_BASE_SRC_PAD (s), gst_event_new_gap (next_capture_ts, dur));
+                goto again;
         }
-
-        if (!image)
+        if (!image) {
+                GST_ELEMENT_ERROR (s, RESOURCE, FAILED,
+                                        (_("Cannot capture or encode the screen")), (NULL));
                 return GST_FLOW_ERROR;
+        }
+
+        /* Pipelined encoding returns the picture of the previous call, it
+         * is stamped with its own capture time and lasts until the end of
+         * this slot. The first two pictures of a session are captured
+         * in the same call, the second keeps this call's time. */
+        fmeta = GST_META_NVIMAGE_FRAME_GET (image);
+        capture_ts = next_capture_ts;
+        GST_OBJECT_LOCK (s);
+        if (fmeta && GST_CLOCK_TIME_IS_VALID (fmeta->capture_ts) && fmeta->capture_ts < next_capture_ts &&
+            (!GST_CLOCK_TIME_IS_VALID (s->last_push_ts) || fmeta->capture_ts > s->last_push_ts)) {
+                capture_ts = fmeta->capture_ts;
+                dur += next_capture_ts - capture_ts;
+        }
+        gst_nvimage_src_track_change (s, image, capture_ts);
+        if (gst_nvimage_src_skip_unchanged (s, image, capture_ts)) {
+                GST_OBJECT_UNLOCK (s);
+                gst_buffer_unref (image);
+                goto again;
+        }
+        s->last_push_ts = capture_ts;
+        s->stats.wakeup_time += s->xcontext->wakeupDelay;
+        s->stats.max_wakeup_time = MAX (s->stats.max_wakeup_time, s->xcontext->wakeupDelay);
+        gst_nvimage_src_account_rate (s, capture_ts);
+        gst_nvimage_src_keyframe_done (s, image, capture_ts);
+        GST_OBJECT_UNLOCK (s);
 
         *buf = image;
         GST_BUFFER_DTS (*buf) = GST_CLOCK_TIME_NONE; //pts+s->last_frame_no;
-        GST_BUFFER_PTS (*buf) = next_capture_ts; //pts+s->last_frame_no; // next_capture_ts;
+        GST_BUFFER_PTS (*buf) = capture_ts; //pts+s->last_frame_no; // next_capture_ts;
         GST_BUFFER_DURATION (*buf) = dur;
 
+        gst_nvimage_src_account_frame (s, *buf);
+
         GST_DEBUG_OBJECT (s, "Sending frame time %"
                         GST_TIME_FORMAT " duration %ld next frame = %" G_GINT64_FORMAT " prev = %"
                         G_GINT64_FORMAT, GST_TIME_ARGS(pts+s->last_frame_no), dur, next_frame_no, s->last_frame_no);
@@ -264,8 +753,120 @@ gst_nvimage_src_set_property (GObject * object, guint prop_id, const GValue * va
                 case PROP_BITRATE:
                         src->bitrate = g_value_get_uint (value);
                         break;
+                case PROP_MAX_FRAME_SIZE:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.max_frame_size = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_SLICE_SIZE:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.slice_size = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_MAX_QP:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.max_qp = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_MAX_ENCODER_SESSIONS:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.max_sessions = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_ENCODER_LEASE_TIME:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.lease_time = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_GPU:
+                        src->gpu = g_value_get_int (value);
+                        break;
+                case PROP_CAPTURE_MODE:
+                        src->capture_mode = g_value_get_enum (value);
+                        break;
+                case PROP_DIFF_MAP_BLOCK_SIZE:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.diff_map_block = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_UNCHANGED_FRAME_INTERVAL:
+                        GST_OBJECT_LOCK (src);
+                        src->unchanged_frame_interval = g_value_get_uint (value) * GST_MSECOND;
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_REFINE_QP:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.refine_qp = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_REFINE_DELAY:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.refine_delay = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_CONTENT_ADAPTIVE:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.content_adaptive = g_value_get_boolean (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_TEXT_FPS:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.text_fps = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_IDLE:
+                        GST_OBJECT_LOCK (src);
+                        src->idle = g_value_get_boolean (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_IDLE_FPS:
+                        GST_OBJECT_LOCK (src);
+                        src->idle_fps = g_value_get_uint (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_HIGH_REFRESH:
+                        GST_OBJECT_LOCK (src);
+                        src->enc_config.high_refresh = g_value_get_boolean (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_SCHED_POLICY:
+                        GST_OBJECT_LOCK (src);
+                        src->sched_policy = g_value_get_enum (value);
+                        src->sched_dirty = TRUE;
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_SCHED_PRIORITY:
+                        GST_OBJECT_LOCK (src);
+                        src->sched_priority = g_value_get_uint (value);
+                        src->sched_dirty = TRUE;
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_CPU_AFFINITY:
+                        GST_OBJECT_LOCK (src);
+                        g_free (src->cpu_affinity);
+                        src->cpu_affinity = g_value_dup_string (value);
+                        src->sched_dirty = TRUE;
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_NUMA_LOCAL:
+                        GST_OBJECT_LOCK (src);
+                        src->numa_local = g_value_get_boolean (value);
+                        src->sched_dirty = TRUE;
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_KEYFRAME_MIN_INTERVAL:
+                        GST_OBJECT_LOCK (src);
+                        src->keyframe_min_interval = g_value_get_uint64 (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_KEYFRAME_MERGE_WINDOW:
+                        GST_OBJECT_LOCK (src);
+                        src->keyframe_merge_window = g_value_get_uint64 (value);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
                 case PROP_FPS:
                         fps = g_value_get_double(value);
+                        GST_OBJECT_LOCK (src);
                         if (fps == (guint)fps) {
                                 src->fps_n = (guint)fps;
                                 src->fps_d = 1;
@@ -273,6 +874,7 @@ gst_nvimage_src_set_property (GObject * object, guint prop_id, const GValue * va
                                 src->fps_n = fps*1000;
                                 src->fps_d = 1000;
                         }
+                        GST_OBJECT_UNLOCK (src);
                         break;
                 default:
                         g_warning("Unknown property %d", prop_id);
@@ -287,10 +889,12 @@ gst_nvimage_src_get_property (GObject * object, guint prop_id, GValue * value, G
 
         switch (prop_id) {
                 case PROP_DISPLAY_NAME:
+                        GST_OBJECT_LOCK (src);
                         if (src->xcontext)
                                 g_value_set_string (value, DisplayString (src->xcontext->disp));
                         else
                                 g_value_set_string (value, src->display_name);
+                        GST_OBJECT_UNLOCK (src);
 
                         break;
                 case PROP_SHOW_POINTER:
@@ -302,6 +906,84 @@ gst_nvimage_src_get_property (GObject * object, guint prop_id, GValue * value, G
                 case PROP_FPS:
                         g_value_set_double(value, ((double)src->fps_n) / src->fps_d);
                         break;
+                case PROP_STATS:
+                        GST_OBJECT_LOCK (src);
+                        g_value_take_boxed (value, gst_nvimage_src_create_stats (src));
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_MAX_FRAME_SIZE:
+                        g_value_set_uint (value, src->enc_config.max_frame_size);
+                        break;
+                case PROP_SLICE_SIZE:
+                        g_value_set_uint (value, src->enc_config.slice_size);
+                        break;
+                case PROP_MAX_QP:
+                        g_value_set_uint (value, src->enc_config.max_qp);
+                        break;
+                case PROP_MAX_ENCODER_SESSIONS:
+                        g_value_set_uint (value, src->enc_config.max_sessions);
+                        break;
+                case PROP_ENCODER_LEASE_TIME:
+                        g_value_set_uint (value, src->enc_config.lease_time);
+                        break;
+                case PROP_GPU:
+                        g_value_set_int (value, src->gpu);
+                        break;
+                case PROP_CAPTURE_MODE:
+                        g_value_set_enum (value, src->capture_mode);
+                        break;
+                case PROP_DIFF_MAP_BLOCK_SIZE:
+                        g_value_set_uint (value, src->enc_config.diff_map_block);
+                        break;
+                case PROP_UNCHANGED_FRAME_INTERVAL:
+                        g_value_set_uint (value, src->unchanged_frame_interval / GST_MSECOND);
+                        break;
+                case PROP_REFINE_QP:
+                        g_value_set_uint (value, src->enc_config.refine_qp);
+                        break;
+                case PROP_REFINE_DELAY:
+                        g_value_set_uint (value, src->enc_config.refine_delay);
+                        break;
+                case PROP_CONTENT_ADAPTIVE:
+                        g_value_set_boolean (value, src->enc_config.content_adaptive);
+                        break;
+                case PROP_TEXT_FPS:
+                        g_value_set_uint (value, src->enc_config.text_fps);
+                        break;
+                case PROP_IDLE:
+                        g_value_set_boolean (value, src->idle);
+                        break;
+                case PROP_IDLE_FPS:
+                        g_value_set_uint (value, src->idle_fps);
+                        break;
+                case PROP_HIGH_REFRESH:
+                        g_value_set_boolean (value, src->enc_config.high_refresh);
+                        break;
+                case PROP_SCHED_POLICY:
+                        g_value_set_enum (value, src->sched_policy);
+                        break;
+                case PROP_SCHED_PRIORITY:
+                        g_value_set_uint (value, src->sched_priority);
+                        break;
+                case PROP_CPU_AFFINITY:
+                        GST_OBJECT_LOCK (src);
+                        g_value_set_string (value, src->cpu_affinity);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_NUMA_LOCAL:
+                        g_value_set_boolean (value, src->numa_local);
+                        break;
+                case PROP_CURRENT_GPU:
+                        GST_OBJECT_LOCK (src);
+                        g_value_set_int (value, src->current_gpu);
+                        GST_OBJECT_UNLOCK (src);
+                        break;
+                case PROP_KEYFRAME_MIN_INTERVAL:
+                        g_value_set_uint64 (value, src->keyframe_min_interval);
+                        break;
+                case PROP_KEYFRAME_MERGE_WINDOW:
+                        g_value_set_uint64 (value, src->keyframe_merge_window);
+                        break;
                 default:
                         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
                         break;
@@ -322,6 +1004,8 @@ gst_nvimage_src_finalize (GObject * object)
         if (src->xcontext)
                 nvimageutil_xcontext_clear_r (src->xcontext);
 
+        g_free (src->cpu_affinity);
+
         G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -329,6 +1013,7 @@ static GstCaps *
 gst_nvimage_src_get_caps (GstBaseSrc * bs, GstCaps * filter)
 {
         GstNVimageSrc *s = GST_NVIMAGE_SRC (bs);
+        GstCaps *caps, *raw;
         gint width, height;
 
         if ((!s->xcontext) || (!gst_nvimage_src_open_display (s, s->display_name)))
@@ -339,7 +1024,21 @@ gst_nvimage_src_get_caps (GstBaseSrc * bs, GstCaps * filter)
 
         GST_DEBUG ("width = %d, height=%d", width, height);
 
-        return gst_caps_new_simple ("video/x-h264",
+        /* Without a GPU there is no encoder, the damaged areas are
+         * converted on the CPU */
+        if (s->xcontext->mode == NVIMAGE_CAPTURE_XSHM) {
+                caps = gst_caps_from_string ("video/x-raw, format = (string) { NV12, I420 }, "
+                                             "colorimetry = (string) bt709; "
+                                             "video/x-raw, format = (string) BGRx");
+                gst_caps_set_simple (caps,
+                        "width", G_TYPE_INT, width,
+                        "height", G_TYPE_INT, height,
+                        "framerate", GST_TYPE_FRACTION_RANGE, 1, G_MAXINT, G_MAXINT, 1,
+                        NULL);
+                goto filter;
+        }
+
+        caps = gst_caps_new_simple ("video/x-h264",
                 "width", G_TYPE_INT, width,
                 "height", G_TYPE_INT, height,
                 "framerate", GST_TYPE_FRACTION_RANGE, 1, G_MAXINT, G_MAXINT, 1,
@@ -347,6 +1046,34 @@ gst_nvimage_src_get_caps (GstBaseSrc * bs, GstCaps * filter)
                 "alignment", G_TYPE_STRING, "au",
                 "profile", G_TYPE_STRING, "high",
                 NULL);
+
+        /* After 4:2:0 so that it is only picked when downstream asks for it */
+        if (s->xcontext->yuv444_supported) {
+                GstStructure *yuv444 = gst_structure_copy (gst_caps_get_structure (caps, 0));
+
+                gst_structure_set (yuv444, "profile", G_TYPE_STRING, "high-4:4:4", NULL);
+                gst_caps_append_structure (caps, yuv444);
+        }
+
+        /* Unencoded frames for software encoders, captured and converted
+         * on the GPU */
+        raw = gst_caps_from_string ("video/x-raw, format = (string) { NV12, BGRx }");
+        gst_caps_set_simple (raw,
+                "width", G_TYPE_INT, width,
+                "height", G_TYPE_INT, height,
+                "framerate", GST_TYPE_FRACTION_RANGE, 1, G_MAXINT, G_MAXINT, 1,
+                NULL);
+        gst_caps_append (caps, raw);
+
+filter:
+        if (filter) {
+                GstCaps *tmp = gst_caps_intersect_full (filter, caps, GST_CAPS_INTERSECT_FIRST);
+
+                gst_caps_unref (caps);
+                caps = tmp;
+        }
+
+        return caps;
 }
 
 static gboolean
@@ -355,17 +1082,40 @@ gst_nvimage_src_set_caps (GstBaseSrc * bs, GstCaps * caps)
         GstNVimageSrc *s = GST_NVIMAGE_SRC (bs);
         GstStructure *structure;
         const GValue *new_fps;
+        GstVideoFormat raw_format = GST_VIDEO_FORMAT_UNKNOWN;
+        gboolean yuv444 = FALSE;
 
         /* If not yet opened, disallow setcaps until later */
         if (!s->xcontext)
                 return FALSE;
 
-        /* The only thing that can change is the framerate downstream wants */
+        /* The only things that can change are the framerate downstream
+         * wants, whether it wants the frames encoded and in which chroma
+         * format */
         structure = gst_caps_get_structure (caps, 0);
         new_fps = gst_structure_get_value (structure, "framerate");
         if (!new_fps)
                 return FALSE;
 
+        if (gst_structure_has_name (structure, "video/x-raw")) {
+                GstVideoInfo info;
+
+                if (!gst_video_info_from_caps (&info, caps))
+                        return FALSE;
+                raw_format = GST_VIDEO_INFO_FORMAT (&info);
+        } else {
+                yuv444 = !g_strcmp0 (gst_structure_get_string (structure, "profile"), "high-4:4:4");
+                if (yuv444 && !s->xcontext->yuv444_supported) {
+                        GST_ERROR_OBJECT (s, "GPU %d cannot encode 4:4:4", s->xcontext->gpu);
+                        return FALSE;
+                }
+        }
+
+        GST_OBJECT_LOCK (s);
+        s->enc_config.raw_format = raw_format;
+        s->enc_config.yuv444 = yuv444;
+        GST_OBJECT_UNLOCK (s);
+
         /* Store this FPS for use when generating buffers */
         s->fps_n = gst_value_get_fraction_numerator (new_fps);
         s->fps_d = gst_value_get_fraction_denominator (new_fps);
@@ -395,23 +1145,31 @@ gst_nvimage_src_fixate (GstBaseSrc * bsrc, GstCaps * caps)
 
 static gboolean
 gst_nvimage_src_event (GstBaseSrc * bsrc, GstEvent * event) {
-        if(event) {
-                const GstStructure *s = gst_event_get_structure(event);
-                GstNVimageSrc *nvs = GST_NVIMAGE_SRC (bsrc);
-                if(s && s->name) {
-                        const char *p = g_quark_to_string(s->name);
-                        if(p) {
-                                g_warning("got event: %d, subtype: %s", event->type, g_quark_to_string(s->name));
-
-                                if (event->type == GST_EVENT_CUSTOM_UPSTREAM) {
-                                        if (gst_structure_has_name (s, "GstForceKeyUnit") && nvs) {
-                                                g_warning("Forcing keyframe");
-                                                nvs->keyframe = 1;
-                                        }
-                                }
-                        }
+        GstNVimageSrc *nvs = GST_NVIMAGE_SRC (bsrc);
+        gboolean all_headers = FALSE;
+
+        if (!event)
+                return TRUE;
+
+        GST_DEBUG_OBJECT (nvs, "got event: %" GST_PTR_FORMAT, event);
+
+        if (gst_video_event_is_force_key_unit (event) && GST_EVENT_TYPE (event) == GST_EVENT_CUSTOM_UPSTREAM) {
+                gst_video_event_parse_upstream_force_key_unit (event, NULL, &all_headers, NULL);
+
+                GST_OBJECT_LOCK (nvs);
+                nvs->stats.keyframe_requests++;
+                if (nvs->keyframe) {
+                        nvs->stats.keyframe_requests_merged++;
+                        GST_DEBUG_OBJECT (nvs, "Keyframe already pending, merging request");
+                } else {
+                        GST_INFO_OBJECT (nvs, "Keyframe requested, all-headers %d", all_headers);
+                        nvs->keyframe = TRUE;
+                        nvs->keyframe_pending_ts = GST_CLOCK_TIME_NONE;
                 }
+                nvs->keyframe_all_headers |= all_headers;
+                GST_OBJECT_UNLOCK (nvs);
         }
+
         return TRUE;
 }
 
@@ -445,6 +1203,142 @@ gst_nvimage_src_class_init (GstNVimageSrcClass * klass)
                                                 g_param_spec_double ("fps", "fps", "Desired grabbing fps",
                                                 0, 1000, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+        g_object_class_install_property (gc, PROP_STATS,
+                                                g_param_spec_boxed ("stats", "Statistics", "Encoder output statistics",
+                                                GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MAX_FRAME_SIZE,
+                                                g_param_spec_uint ("max-frame-size", "Maximum frame size",
+                                                "Upper bound of a single encoded frame in bytes, enforced through the VBV size (0 = unbounded)",
+                                                0, G_MAXUINT / 8, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_SLICE_SIZE,
+                                                g_param_spec_uint ("slice-size", "Slice size",
+                                                "Maximum slice size in bytes (0 = one slice per picture)",
+                                                0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MAX_QP,
+                                                g_param_spec_uint ("max-qp", "Maximum QP",
+                                                "Highest QP the rate control may use to meet max-frame-size (0 = no clamp)",
+                                                0, 51, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MAX_ENCODER_SESSIONS,
+                                                g_param_spec_uint ("max-encoder-sessions", "Maximum encoder sessions",
+                                                "NVENC sessions shared by all sources on the host through the session broker, "
+                                                "must be the same for all of them (0 = no broker)",
+                                                0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_ENCODER_LEASE_TIME,
+                                                g_param_spec_uint ("encoder-lease-time", "Encoder lease time",
+                                                "Milliseconds a brokered encoder session is kept before it is handed to a waiting source (0 = forever), capped by the lease time of the tenant quota of the host",
+                                                0, G_MAXUINT, DEFAULT_ENCODER_LEASE_TIME, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_GPU,
+                                                g_param_spec_int ("gpu", "GPU",
+                                                "GPU to capture and encode on, it drives the X screen of the same number. "
+                                                "Applied when the display is opened (-1 = in opengl mode on a display with a screen "
+                                                "per GPU the one with the lowest NVENC utilization, otherwise the default screen)",
+                                                -1, G_MAXINT, DEFAULT_GPU, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_CURRENT_GPU,
+                                                g_param_spec_int ("current-gpu", "Current GPU",
+                                                "GPU the source was placed on (-1 = display not open)",
+                                                -1, G_MAXINT, -1, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_CAPTURE_MODE,
+                                                g_param_spec_enum ("capture-mode", "Capture mode",
+                                                "How frames are captured and get to the encoder, applied when the display is opened",
+                                                GST_TYPE_NVIMAGE_CAPTURE_MODE, DEFAULT_CAPTURE_MODE,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_DIFF_MAP_BLOCK_SIZE,
+                                                g_param_spec_uint ("diff-map-block-size", "Diff map block size",
+                                                "Attach the blocks of this many pixels that changed since the previous frame "
+                                                "as \"changed\" region of interest metas to raw BGRx frames of capture-mode gl (0 = off)",
+                                                0, 256, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_UNCHANGED_FRAME_INTERVAL,
+                                                g_param_spec_uint ("unchanged-frame-interval", "Unchanged frame interval",
+                                                "Drop raw frames the diff map or XDamage shows no change in, but still push one every "
+                                                "this many milliseconds (0 = push every frame)",
+                                                0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_REFINE_QP,
+                                                g_param_spec_uint ("refine-qp", "Refine QP",
+                                                "Once the screen stops changing, re-encode it in steps of lower QP down to this one "
+                                                "with the bandwidth the unchanged frames leave unused (0 = off)",
+                                                0, 51, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_REFINE_DELAY,
+                                                g_param_spec_uint ("refine-delay", "Refine delay",
+                                                "Milliseconds the screen has to be unchanged before it is refined",
+                                                0, G_MAXUINT, DEFAULT_REFINE_DELAY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_CONTENT_ADAPTIVE,
+                                                g_param_spec_boolean ("content-adaptive", "Content adaptive",
+                                                "Classify the screen as text or motion from the damage area, change rate and "
+                                                "frame sizes and switch rate control, AQ and frame rate without a new session",
+                                                FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_TEXT_FPS,
+                                                g_param_spec_uint ("text-fps", "Text fps",
+                                                "Frame rate while content-adaptive sees text (0 = the negotiated one)",
+                                                0, 240, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_IDLE,
+                                                g_param_spec_boolean ("idle", "Idle",
+                                                "Set by the application while the user sends no input, a static screen "
+                                                "is then captured at idle-fps until it changes or this is cleared",
+                                                FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_IDLE_FPS,
+                                                g_param_spec_uint ("idle-fps", "Idle fps",
+                                                "Keep-alive frame rate of a static screen while idle (0 = the negotiated one)",
+                                                0, 240, DEFAULT_IDLE_FPS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_HIGH_REFRESH,
+                                                g_param_spec_boolean ("high-refresh", "High refresh",
+                                                "Capture frames as applications present them instead of at the 60 Hz "
+                                                "NvFBC samples the screen with, for 90 fps and more. In GL capture mode "
+                                                "without refine-qp and content-adaptive a frame is encoded while the next "
+                                                "one is grabbed, which adds a frame of latency",
+                                                FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_SCHED_POLICY,
+                                                g_param_spec_enum ("sched-policy", "Scheduling policy",
+                                                "Scheduling policy of the streaming and the capture worker thread, "
+                                                "the real-time ones need CAP_SYS_NICE or an RLIMIT_RTPRIO",
+                                                GST_TYPE_NVIMAGE_SCHED_POLICY, DEFAULT_SCHED_POLICY,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_SCHED_PRIORITY,
+                                                g_param_spec_uint ("sched-priority", "Scheduling priority",
+                                                "Real-time priority of the fifo and rr sched-policy",
+                                                1, 99, DEFAULT_SCHED_PRIORITY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_CPU_AFFINITY,
+                                                g_param_spec_string ("cpu-affinity", "CPU affinity",
+                                                "CPUs the streaming and the capture worker thread run on as a list "
+                                                "like \"2-5,8\" (NULL = all CPUs of the process)",
+                                                NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_NUMA_LOCAL,
+                                                g_param_spec_boolean ("numa-local", "NUMA local",
+                                                "Keep the streaming and the capture worker thread on the CPUs of the "
+                                                "NUMA node the GPU is attached to, within cpu-affinity",
+                                                FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_KEYFRAME_MIN_INTERVAL,
+                                                g_param_spec_uint64 ("keyframe-min-interval", "Keyframe minimum interval",
+                                                "Minimum time between two forced keyframes in nanoseconds",
+                                                0, G_MAXUINT64, DEFAULT_KEYFRAME_MIN_INTERVAL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_KEYFRAME_MERGE_WINDOW,
+                                                g_param_spec_uint64 ("keyframe-merge-window", "Keyframe merge window",
+                                                "Time in nanoseconds a keyframe request waits for further requests to merge with, "
+                                                "requests for all headers are not delayed",
+                                                0, G_MAXUINT64, DEFAULT_KEYFRAME_MERGE_WINDOW, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
         gst_element_class_set_static_metadata (ec, "NVimage video source",
                                               "Source/Video",
                                               "Creates a screenshot video stream to h264",
@@ -470,6 +1364,18 @@ gst_nvimage_src_init (GstNVimageSrc * nvimagesrc)
         nvimagesrc->show_pointer = TRUE;
         nvimagesrc->bitrate = 2000000;
         nvimagesrc->keyframe = TRUE;
+        nvimagesrc->keyframe_pending_ts = GST_CLOCK_TIME_NONE;
+        nvimagesrc->last_keyframe_ts = GST_CLOCK_TIME_NONE;
+        nvimagesrc->keyframe_min_interval = DEFAULT_KEYFRAME_MIN_INTERVAL;
+        nvimagesrc->keyframe_merge_window = DEFAULT_KEYFRAME_MERGE_WINDOW;
+        nvimagesrc->enc_config.lease_time = DEFAULT_ENCODER_LEASE_TIME;
+        nvimagesrc->enc_config.refine_delay = DEFAULT_REFINE_DELAY;
+        nvimagesrc->idle_fps = DEFAULT_IDLE_FPS;
+        nvimagesrc->sched_policy = DEFAULT_SCHED_POLICY;
+        nvimagesrc->sched_priority = DEFAULT_SCHED_PRIORITY;
+        nvimagesrc->gpu = DEFAULT_GPU;
+        nvimagesrc->capture_mode = DEFAULT_CAPTURE_MODE;
+        nvimagesrc->current_gpu = -1;
         nvimagesrc->frame = 0;
 }
 
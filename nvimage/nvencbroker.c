@@ -0,0 +1,558 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Host wide broker of NVENC sessions.
+ *
+ * GPUs cap the number of concurrent encode sessions. Every nvimagesrc
+ * that is configured with max-encoder-sessions holds a lease on one of
+ * that many slots while its encoder is open. A source that cannot get a
+ * slot queues up as a waiter and polls again with every frame, waiters are
+ * served in arrival order, and a lease holder that sees waiters gives its
+ * slot up once its lease time is over. So with more desktops than sessions
+ * every desktop gets encode time in turn, and idle or lightly used seats do
+ * not pin a session.
+ *
+ * Tenants are the users the sources run as. The host administrator limits
+ * the slots a tenant holds at once and its lease time in
+ * NVENCBROKER_QUOTA_FILE, a key file with a [default] group and optional
+ * [user <name>] groups:
+ *
+ *   [default]
+ *   max-sessions=1
+ *   lease-time=2000
+ *
+ * A tenant at its limit leaves the queue, so it neither holds back the
+ * waiters behind it nor makes lease holders yield. The broker is
+ * cooperative: every source using it honours the limits, but a process of
+ * the tenant can lock files of its own, point NVIMAGE_NVENC_BROKER_DIR
+ * elsewhere or open NVENC without the broker. Hard limits need the driver
+ * or the container runtime.
+ *
+ * Every source also registers the GPU it runs on. New sources without an
+ * explicit GPU are placed on the one with the lowest NVENC utilization as
+ * NVML reports it, the same signal the streamer places nvh264enc by. The
+ * registered sessions break ties, since the utilization is an average that
+ * does not show sessions started a moment ago yet. Without NVML only the
+ * sessions count.
+ *
+ * Slots, waiters, tenants and sessions are flock()ed files in a directory
+ * shared by all processes, the kernel drops the locks of processes that
+ * die. Sources only ever write to files they created themselves, the
+ * shared slot files are opened read only for their locks. The directory
+ * has to be sticky and owned by root or by us, otherwise another user
+ * could plant links in it, and the broker stays off. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "nvencbroker.h"
+
+/* Place of a source in the waiter queue of a GPU. @fd is -1 while the
+ * tenant is at its quota and stays out of the queue, @name keeps the
+ * arrival time for when it queues again. @polled is the monotonic time
+ * of the last poll. */
+struct _NvEncBrokerTicket {
+  guint gpu;
+  gchar *name;
+  gint fd;
+  gint64 polled;
+};
+
+typedef struct {
+  guint max_sessions;
+  guint lease_time;
+} NvEncBrokerQuota;
+
+/* The few NVML entry points we need, the library is opened at run time */
+static struct {
+        gboolean ok;
+        gint (*deviceGetHandleByIndex) (guint index, gpointer * device);
+        gint (*deviceGetEncoderUtilization) (gpointer device, guint * utilization, guint * samplingPeriodUs);
+} nvml;
+
+/* A directory we may share with others: no link, sticky so that nobody
+ * removes or replaces the files of others, and owned by root or by us */
+static gboolean
+nvencbroker_dir_ok (const gchar * dir)
+{
+        struct stat st;
+
+        if (lstat (dir, &st) != 0 || !S_ISDIR (st.st_mode))
+                return FALSE;
+        if (st.st_uid != 0 && st.st_uid != getuid ()) {
+                g_warning ("NVENC broker directory %s belongs to uid %u", dir, (guint) st.st_uid);
+                return FALSE;
+        }
+        if (!(st.st_mode & S_ISVTX)) {
+                g_warning ("NVENC broker directory %s is not sticky", dir);
+                return FALSE;
+        }
+        return TRUE;
+}
+
+/* The broker directory, NULL if there is no safe one and the broker is off */
+static const gchar *
+nvencbroker_dir (void)
+{
+        static gsize initialized = 0;
+        static const gchar *dir = NULL;
+
+        if (g_once_init_enter (&initialized)) {
+                const gchar *env = g_getenv ("NVIMAGE_NVENC_BROKER_DIR");
+                const gchar *dirs[] = { NVENCBROKER_DEFAULT_DIR, NVENCBROKER_FALLBACK_DIR };
+                guint n_dirs = G_N_ELEMENTS (dirs);
+
+                if (env && *env) {
+                        dirs[0] = env;
+                        n_dirs = 1;
+                }
+                for (guint i = 0; i < n_dirs && !dir; i++) {
+                        /* Shared by the sessions of all users, like /tmp. Only
+                         * a directory we just made is ours to chmod. */
+                        if (mkdir (dirs[i], 0700) == 0)
+                                chmod (dirs[i], 01777);
+                        if (nvencbroker_dir_ok (dirs[i]))
+                                dir = dirs[i];
+                }
+                if (!dir)
+                        g_warning ("No NVENC broker directory, sessions are not brokered");
+                g_once_init_leave (&initialized, 1);
+        }
+
+        return dir;
+}
+
+/* Limits of the tenant this process runs as, read once */
+static const NvEncBrokerQuota *
+nvencbroker_quota (void)
+{
+        static gsize initialized = 0;
+        static NvEncBrokerQuota quota;
+
+        if (g_once_init_enter (&initialized)) {
+                GKeyFile *file = g_key_file_new ();
+                gchar *group = g_strdup_printf ("user %s", g_get_user_name ());
+
+                if (g_key_file_load_from_file (file, NVENCBROKER_QUOTA_FILE, G_KEY_FILE_NONE, NULL)) {
+                        const gchar *groups[] = { "default", group };
+
+                        /* The user group overrides the defaults key by key */
+                        for (guint i = 0; i < G_N_ELEMENTS (groups); i++) {
+                                if (g_key_file_has_key (file, groups[i], "max-sessions", NULL))
+                                        quota.max_sessions = g_key_file_get_integer (file, groups[i], "max-sessions", NULL);
+                                if (g_key_file_has_key (file, groups[i], "lease-time", NULL))
+                                        quota.lease_time = g_key_file_get_integer (file, groups[i], "lease-time", NULL);
+                        }
+                }
+                g_free (group);
+                g_key_file_free (file);
+                g_once_init_leave (&initialized, 1);
+        }
+
+        return &quota;
+}
+
+/* Opens @path read only for its lock, creating it if @create. Links and
+ * anything but regular files are refused. */
+static gint
+nvencbroker_open (const gchar * path, gboolean create)
+{
+        gint fd = open (path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        struct stat st;
+
+        if (fd >= 0 && (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode))) {
+                close (fd);
+                fd = -1;
+        }
+        return fd;
+}
+
+/* Counts the files starting with @prefix that sort before @before (all
+ * of them when @before is NULL) and are locked by a live owner, stopping
+ * at @limit. Files of dead owners are removed on the way. */
+static guint
+nvencbroker_scan (const gchar * prefix, const gchar * before, guint limit)
+{
+        const gchar *dir = nvencbroker_dir ();
+        guint found = 0;
+        const gchar *name;
+        GDir *d;
+
+        d = dir ? g_dir_open (dir, 0, NULL) : NULL;
+        if (!d)
+                return 0;
+
+        while (found < limit && (name = g_dir_read_name (d))) {
+                gchar *path;
+                gint fd;
+
+                if (!g_str_has_prefix (name, prefix))
+                        continue;
+                if (before && strcmp (name, before) >= 0)
+                        continue;
+
+                path = g_build_filename (dir, name, NULL);
+                fd = nvencbroker_open (path, FALSE);
+                if (fd >= 0) {
+                        if (flock (fd, LOCK_EX | LOCK_NB) == 0) {
+                                /* Nobody holds it, the owner is gone */
+                                g_unlink (path);
+                        } else if (errno == EWOULDBLOCK) {
+                                found++;
+                        }
+                        close (fd);
+                }
+                g_free (path);
+        }
+
+        g_dir_close (d);
+        return found;
+}
+
+/* Returns TRUE if a waiter of @gpu that queued before @before (or any
+ * waiter when @before is NULL) is still alive */
+static gboolean
+nvencbroker_scan_waiters (guint gpu, const gchar * before)
+{
+        gchar *prefix = g_strdup_printf ("wait-%u-", gpu);
+        gboolean found = nvencbroker_scan (prefix, before, 1) > 0;
+
+        g_free (prefix);
+        return found;
+}
+
+/* Creates a file named @name locked by us. It is locked under a temporary
+ * name first, otherwise a scan could take it for a dead one. Returns the
+ * fd or -1. */
+static gint
+nvencbroker_create_locked (const gchar * path, gpointer tag)
+{
+        const gchar *dir = nvencbroker_dir ();
+        gchar *tmp;
+        gint fd;
+
+        if (!dir)
+                return -1;
+
+        /* A new file of ours, never one planted under the name */
+        tmp = g_strdup_printf ("%s/tmp-%d-%p", dir, (gint) getpid (), tag);
+        fd = open (tmp, O_RDONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+        if (fd < 0 || flock (fd, LOCK_EX) != 0 || g_rename (tmp, path) != 0) {
+                g_warning ("Cannot create %s: %s", path, g_strerror (errno));
+                if (fd >= 0)
+                        close (fd);
+                g_unlink (tmp);
+                fd = -1;
+        }
+        g_free (tmp);
+
+        return fd;
+}
+
+/* Counts the slots on all GPUs held by sources of our tenant. Next to the
+ * slot it locked, a holder keeps a tenant file of its own locked. */
+static guint
+nvencbroker_tenant_slots (void)
+{
+        gchar *prefix = g_strdup_printf ("tenant-%u-", (guint) getuid ());
+        guint n = nvencbroker_scan (prefix, NULL, G_MAXUINT);
+
+        g_free (prefix);
+        return n;
+}
+
+static gboolean
+nvencbroker_try_slot (guint gpu, guint max_sessions, NvEncBrokerLease * lease)
+{
+        static gint seq = 0;
+        const gchar *dir = nvencbroker_dir ();
+
+        for (guint slot = 0; slot < max_sessions; slot++) {
+                gchar *path = g_strdup_printf ("%s/slot-%u-%u", dir, gpu, slot);
+                gint fd = nvencbroker_open (path, TRUE);
+
+                g_free (path);
+                if (fd < 0)
+                        continue;
+
+                if (flock (fd, LOCK_EX | LOCK_NB) == 0) {
+                        lease->gpu = gpu;
+                        lease->slot = slot;
+                        lease->fd = fd;
+                        lease->acquired = g_get_monotonic_time ();
+                        /* Tells the other sources of our tenant */
+                        lease->path = g_strdup_printf ("%s/tenant-%u-%u-%u-%d-%d", dir, (guint) getuid (), gpu, slot,
+                                                       (gint) getpid (), g_atomic_int_add (&seq, 1));
+                        lease->tenant_fd = nvencbroker_create_locked (lease->path, lease);
+                        return TRUE;
+                }
+                close (fd);
+        }
+
+        return FALSE;
+}
+
+static void
+nvencbroker_dequeue (NvEncBrokerTicket * ticket)
+{
+        gchar *path;
+
+        if (ticket->fd < 0)
+                return;
+
+        path = g_build_filename (nvencbroker_dir (), ticket->name, NULL);
+        g_unlink (path);
+        close (ticket->fd);
+        ticket->fd = -1;
+        g_free (path);
+}
+
+/* Tries to get one of the @max_sessions slots of @gpu without blocking.
+ * Returns the lease, or NULL if the source has to wait, it is then queued
+ * with *@ticket and polls again later with the same ticket. The ticket is
+ * freed once the lease is granted. The directory is looked at once per
+ * NVENCBROKER_POLL_INTERVAL at most, polls in between just return NULL,
+ * so a source polling with every frame costs no syscalls most of the
+ * time. */
+NvEncBrokerLease *
+nvencbroker_poll (guint gpu, guint max_sessions, NvEncBrokerTicket ** ticket)
+{
+        static gint seq = 0;
+        const NvEncBrokerQuota *quota = nvencbroker_quota ();
+        NvEncBrokerTicket *t = *ticket;
+        NvEncBrokerLease *lease;
+
+        /* Without a safe directory every source gets its session */
+        if (!nvencbroker_dir ()) {
+                lease = g_new0 (NvEncBrokerLease, 1);
+                lease->gpu = gpu;
+                lease->slot = G_MAXUINT;
+                lease->fd = lease->tenant_fd = -1;
+                lease->acquired = g_get_monotonic_time ();
+                return lease;
+        }
+
+        if (t && g_get_monotonic_time () - t->polled < NVENCBROKER_POLL_INTERVAL)
+                return NULL;
+
+        if (!t) {
+                /* The monotonic clock is host wide, so the names sort in
+                 * arrival order */
+                t = *ticket = g_new0 (NvEncBrokerTicket, 1);
+                t->gpu = gpu;
+                t->fd = -1;
+                t->name = g_strdup_printf ("wait-%u-%016" G_GINT64_MODIFIER "x-%d-%d", gpu,
+                                           g_get_monotonic_time (), (gint) getpid (), g_atomic_int_add (&seq, 1));
+        }
+
+        t->polled = g_get_monotonic_time ();
+
+        if (quota->max_sessions && nvencbroker_tenant_slots () >= quota->max_sessions) {
+                nvencbroker_dequeue (t);
+                return NULL;
+        }
+
+        if (t->fd < 0) {
+                gchar *path = g_build_filename (nvencbroker_dir (), t->name, NULL);
+
+                t->fd = nvencbroker_create_locked (path, t);
+                g_free (path);
+        }
+
+        /* Only the oldest waiter may take a slot */
+        lease = g_new0 (NvEncBrokerLease, 1);
+        if ((t->fd < 0 || !nvencbroker_scan_waiters (gpu, t->name)) &&
+            nvencbroker_try_slot (gpu, max_sessions, lease)) {
+                nvencbroker_ticket_free (t);
+                *ticket = NULL;
+                return lease;
+        }
+
+        g_free (lease);
+        return NULL;
+}
+
+/* Leaves the queue */
+void
+nvencbroker_ticket_free (NvEncBrokerTicket * ticket)
+{
+        if (!ticket)
+                return;
+
+        nvencbroker_dequeue (ticket);
+        g_free (ticket->name);
+        g_free (ticket);
+}
+
+/* The time a lease is kept while others wait, @lease_time of the element
+ * capped by the quota of the tenant. 0 = forever. */
+guint
+nvencbroker_lease_time (guint lease_time)
+{
+        const NvEncBrokerQuota *quota = nvencbroker_quota ();
+
+        if (!quota->lease_time)
+                return lease_time;
+        return lease_time ? MIN (lease_time, quota->lease_time) : quota->lease_time;
+}
+
+void
+nvencbroker_release (NvEncBrokerLease * lease)
+{
+        if (!lease)
+                return;
+
+        if (lease->tenant_fd >= 0) {
+                g_unlink (lease->path);
+                close (lease->tenant_fd);
+        }
+        if (lease->fd >= 0) {
+                flock (lease->fd, LOCK_UN);
+                close (lease->fd);
+        }
+        g_free (lease->path);
+        g_free (lease);
+}
+
+/* TRUE if another source waits for a slot of the GPU of @lease. Looks
+ * once per NVENCBROKER_WAITERS_INTERVAL at most, FALSE in between. */
+gboolean
+nvencbroker_has_waiters (NvEncBrokerLease * lease)
+{
+        gint64 now = g_get_monotonic_time ();
+
+        if (now - lease->checked < NVENCBROKER_WAITERS_INTERVAL)
+                return FALSE;
+        lease->checked = now;
+
+        return nvencbroker_scan_waiters (lease->gpu, NULL);
+}
+
+/* Number of live sessions registered on @gpu */
+guint
+nvencbroker_count_sessions (guint gpu)
+{
+        gchar *prefix = g_strdup_printf ("session-%u-", gpu);
+        guint n = nvencbroker_scan (prefix, NULL, G_MAXUINT);
+
+        g_free (prefix);
+        return n;
+}
+
+static gpointer
+nvencbroker_nvml_open (gpointer data)
+{
+        void *lib = dlopen ("libnvidia-ml.so.1", RTLD_NOW);
+        gint (*init) (void);
+
+        if (!lib)
+                return NULL;
+
+        init = dlsym (lib, "nvmlInit_v2");
+        nvml.deviceGetHandleByIndex = dlsym (lib, "nvmlDeviceGetHandleByIndex_v2");
+        nvml.deviceGetEncoderUtilization = dlsym (lib, "nvmlDeviceGetEncoderUtilization");
+        nvml.ok = init && nvml.deviceGetHandleByIndex && nvml.deviceGetEncoderUtilization && init () == 0;
+
+        return NULL;
+}
+
+/* NVENC utilization of @gpu in percent, 0 without NVML. NVML numbers the
+ * GPUs in PCI bus order like the X driver its screens. */
+static guint
+nvencbroker_encoder_load (guint gpu)
+{
+        static GOnce once = G_ONCE_INIT;
+        gpointer device;
+        guint load, period;
+
+        g_once (&once, nvencbroker_nvml_open, NULL);
+
+        if (!nvml.ok || nvml.deviceGetHandleByIndex (gpu, &device) != 0 ||
+            nvml.deviceGetEncoderUtilization (device, &load, &period) != 0)
+                return 0;
+        return load;
+}
+
+/* The GPU out of @n_gpus with the lowest NVENC utilization, then the
+ * fewest sessions, the lowest index wins a tie */
+guint
+nvencbroker_least_loaded (guint n_gpus)
+{
+        guint best = 0, best_load = G_MAXUINT, best_sessions = G_MAXUINT;
+
+        for (guint gpu = 0; gpu < n_gpus; gpu++) {
+                guint load = nvencbroker_encoder_load (gpu);
+                guint sessions = nvencbroker_count_sessions (gpu);
+
+                if (load < best_load || (load == best_load && sessions < best_sessions)) {
+                        best = gpu;
+                        best_load = load;
+                        best_sessions = sessions;
+                }
+        }
+
+        return best;
+}
+
+/* Registers a session running on @gpu until nvencbroker_unregister() */
+NvEncBrokerLease *
+nvencbroker_register (guint gpu)
+{
+        static gint seq = 0;
+        NvEncBrokerLease *reg = g_new0 (NvEncBrokerLease, 1);
+        const gchar *dir = nvencbroker_dir ();
+
+        reg->gpu = gpu;
+        reg->slot = G_MAXUINT;
+        reg->acquired = g_get_monotonic_time ();
+        reg->fd = reg->tenant_fd = -1;
+        if (dir) {
+                reg->path = g_strdup_printf ("%s/session-%u-%d-%d", dir, gpu,
+                                             (gint) getpid (), g_atomic_int_add (&seq, 1));
+                reg->fd = nvencbroker_create_locked (reg->path, reg);
+        }
+
+        return reg;
+}
+
+void
+nvencbroker_unregister (NvEncBrokerLease * reg)
+{
+        if (!reg)
+                return;
+
+        if (reg->fd >= 0) {
+                g_unlink (reg->path);
+                close (reg->fd);
+        }
+        g_free (reg->path);
+        g_free (reg);
+}
@@ -0,0 +1,82 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __NVENCBROKER_H__
+#define __NVENCBROKER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Directory holding the slot, waiter and session lock files, shared by all
+ * processes on the host. Provisioned by root for hosts with several users,
+ * e.g. with the tmpfiles.d line "d /run/nvimage-nvenc 1777 root root".
+ * Without it the first user creates the fallback and only that user's
+ * sources share it. Overridden by NVIMAGE_NVENC_BROKER_DIR. */
+#define NVENCBROKER_DEFAULT_DIR "/run/nvimage-nvenc"
+#define NVENCBROKER_FALLBACK_DIR "/tmp/nvimage-nvenc"
+/* Microseconds between two looks at the broker directory of a waiting
+ * source, and of a lease holder past its lease time looking for waiters */
+#define NVENCBROKER_POLL_INTERVAL (G_USEC_PER_SEC / 4)
+#define NVENCBROKER_WAITERS_INTERVAL G_USEC_PER_SEC
+/* Per-tenant limits set by the host administrator */
+#define NVENCBROKER_QUOTA_FILE "/etc/nvimage/nvenc-quota.conf"
+
+typedef struct _NvEncBrokerLease NvEncBrokerLease;
+typedef struct _NvEncBrokerTicket NvEncBrokerTicket;
+
+/**
+ * NvEncBrokerLease:
+ * @gpu: the GPU the slot belongs to
+ * @slot: index of the held slot
+ * @fd: the locked slot file, the lock is the lease, -1 without a broker
+ * directory
+ * @acquired: monotonic time in microseconds the lease was granted
+ * @checked: monotonic time of the last look for waiters
+ * @path: the session file of a registration, the tenant file of a slot
+ * @tenant_fd: the locked tenant file of a slot, it counts the slot against
+ * the quota of our user
+ *
+ * One of the max_sessions NVENC session slots of a GPU, or the
+ * registration of a session on a GPU. Both are flock()ed files, so they
+ * are released by the kernel when a process crashes.
+ */
+struct _NvEncBrokerLease {
+  guint gpu;
+  guint slot;
+  gint fd;
+  gint64 acquired;
+  gint64 checked;
+  gchar *path;
+  gint tenant_fd;
+};
+
+NvEncBrokerLease * nvencbroker_poll (guint gpu, guint max_sessions, NvEncBrokerTicket ** ticket);
+void nvencbroker_ticket_free (NvEncBrokerTicket * ticket);
+void nvencbroker_release (NvEncBrokerLease * lease);
+gboolean nvencbroker_has_waiters (NvEncBrokerLease * lease);
+guint nvencbroker_lease_time (guint lease_time);
+
+NvEncBrokerLease * nvencbroker_register (guint gpu);
+void nvencbroker_unregister (NvEncBrokerLease * reg);
+guint nvencbroker_count_sessions (guint gpu);
+guint nvencbroker_least_loaded (guint n_gpus);
+
+G_END_DECLS
+
+#endif /* __NVENCBROKER_H__ */
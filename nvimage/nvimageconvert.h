@@ -0,0 +1,55 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __NVIMAGECONVERT_H__
+#define __NVIMAGECONVERT_H__
+
+#include <glib.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+/**
+ * NVimageConvertImpl:
+ * @NVIMAGE_CONVERT_AUTO: the fastest kernel the CPU runs
+ * @NVIMAGE_CONVERT_C: portable C
+ * @NVIMAGE_CONVERT_SSE2: SSE2, 16 pixels per step
+ * @NVIMAGE_CONVERT_AVX2: AVX2, 32 pixels per step
+ *
+ * Kernel of the BGRx to YUV conversion. All of them produce the same
+ * output.
+ */
+typedef enum {
+  NVIMAGE_CONVERT_AUTO,
+  NVIMAGE_CONVERT_C,
+  NVIMAGE_CONVERT_SSE2,
+  NVIMAGE_CONVERT_AVX2,
+} NVimageConvertImpl;
+
+NVimageConvertImpl nvimageconvert_best_impl (void);
+gboolean nvimageconvert_impl_supported (NVimageConvertImpl impl);
+const gchar * nvimageconvert_impl_name (NVimageConvertImpl impl);
+gboolean nvimageconvert_supports (GstVideoFormat format);
+
+void nvimageconvert_rect (NVimageConvertImpl impl, const guint8 * src, gint src_stride,
+                          GstVideoFormat format, guint8 * const dst[], const gint dst_stride[],
+                          gint width, gint height, gint x, gint y, gint w, gint h);
+
+G_END_DECLS
+
+#endif /* __NVIMAGECONVERT_H__ */
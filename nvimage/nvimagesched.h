@@ -0,0 +1,53 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __NVIMAGESCHED_H__
+#define __NVIMAGESCHED_H__
+
+#include <glib.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+G_BEGIN_DECLS
+
+/**
+ * NVimageSchedPolicy:
+ * @NVIMAGE_SCHED_OTHER: the default time sharing scheduler
+ * @NVIMAGE_SCHED_FIFO: SCHED_FIFO, runs until it blocks or a higher
+ * priority thread wakes up
+ * @NVIMAGE_SCHED_RR: SCHED_RR, like FIFO but with a time slice among
+ * threads of the same priority
+ *
+ * Scheduling policy of the capture threads.
+ */
+typedef enum {
+  NVIMAGE_SCHED_OTHER,
+  NVIMAGE_SCHED_FIFO,
+  NVIMAGE_SCHED_RR,
+} NVimageSchedPolicy;
+
+pid_t nvimagesched_gettid (void);
+gint nvimagesched_set_policy (pthread_t thread, NVimageSchedPolicy policy, guint priority);
+gint nvimagesched_set_cpus (pthread_t thread, const gchar * cpus, const gchar * local_cpus);
+gint nvimagesched_reset (pid_t tid);
+gchar * nvimagesched_gpu_cpus (gint gpu);
+guint64 nvimagesched_run_delay (pid_t tid);
+
+G_END_DECLS
+
+#endif /* __NVIMAGESCHED_H__ */
@@ -33,35 +33,125 @@ G_BEGIN_DECLS
 
 typedef struct _GstNVimageSrcHEVC GstNVimageSrcHEVC;
 typedef struct _GstNVimageSrcHEVCClass GstNVimageSrcHEVCClass;
+typedef struct _GstNVimageSrcStats GstNVimageSrcStats;
 
 GType gst_nvimage_src_get_type (void) G_GNUC_CONST;
 
+/* Aggregated encoder output, exposed through the "stats" property */
+struct _GstNVimageSrcStats
+{
+  guint64 frames;
+  guint64 keyframes;
+  guint64 bytes;
+  guint64 qp_sum;
+  guint last_size;
+  guint max_size;
+  guint max_keyframe_size;
+  guint last_qp;
+  guint last_slices;
+  guint last_picture_type;
+  guint64 keyframe_requests;
+  guint64 keyframe_requests_merged;
+  guint64 keyframes_forced;
+  guint64 capped_frames;
+  guint64 oversize_frames;
+  guint64 unchanged_frames;
+  guint64 refine_frames;
+  guint64 refine_bytes;
+  guint64 motion_frames;
+  guint last_content;
+  guint64 idle_skipped;
+  guint64 encode_time;
+  guint last_encode_time;
+  guint64 late_frames;
+  guint64 encoder_wait_frames;
+  gdouble achieved_fps;
+  guint64 wakeup_time;
+  guint max_wakeup_time;
+  guint64 clock_waits;
+  guint64 clock_overshoot;
+  guint max_clock_overshoot;
+};
+
 struct _GstNVimageSrcHEVC
 {
   GstPushSrc parent;
 
-  /* Information on display */
+  /* Information on display. @xcontext is set and cleared under the object
+   * lock, other threads only look at it with the lock held. @current_gpu
+   * and @worker_tid copy its GPU and the kernel thread ID of its worker
+   * for them, -1 and 0 without a context. */
   GstXContext *xcontext;
+  gint current_gpu;
+  pid_t worker_tid;
   gint x;
   gint y;
   gint width;
   gint height;
 
   gchar *display_name;
+  /* requested GPU, -1 = least loaded */
+  gint gpu;
+  GstNVimageCaptureMode capture_mode;
 
   /* Desired output framerate */
   gint fps_n;
   gint fps_d;
 
-  /* for framerate sync */
+  /* for framerate sync, @last_frame_no counts frames of
+   * @last_fps_n/@last_fps_d */
   GstClockID clock_id;
   gint64 last_frame_no;
+  gint last_fps_n;
+  gint last_fps_d;
   gint64 frame;
 
   gboolean show_pointer;
 
   guint bitrate;
+  /* Encoder settings copied to the worker thread with every frame,
+   * protected by the object lock */
+  GstNVimageEncConfig enc_config;
+  /* Keyframe scheduler, protected by the object lock. @keyframe is set while
+   * a request is pending, @keyframe_pending_ts is the capture time at which
+   * the pending request was first seen. */
   gboolean keyframe;
+  gboolean keyframe_all_headers;
+  GstClockTime keyframe_pending_ts;
+  GstClockTime last_keyframe_ts;
+  GstClockTime keyframe_min_interval;
+  GstClockTime keyframe_merge_window;
+
+  /* protected by the object lock */
+  GstNVimageSrcStats stats;
+
+  /* Raw frames without changes are dropped, but one is pushed every
+   * @unchanged_frame_interval, protected by the object lock */
+  GstClockTime unchanged_frame_interval;
+  GstClockTime last_push_ts;
+
+  /* Keep-alive rate while @idle is set by the application and the screen
+   * has not changed since @last_change_ts, protected by the object lock */
+  gboolean idle;
+  guint idle_fps;
+  GstClockTime last_change_ts;
+
+  /* Frames pushed since @rate_window_ts for the achieved frame rate,
+   * protected by the object lock */
+  GstClockTime rate_window_ts;
+  guint rate_window_frames;
+
+  /* Scheduling of the streaming and the worker thread, applied by the
+   * streaming thread while @sched_dirty is set, protected by the object
+   * lock. @streaming_tid is the kernel thread ID of the streaming thread,
+   * @streaming_sched is set while it runs with other than the defaults. */
+  NVimageSchedPolicy sched_policy;
+  guint sched_priority;
+  gchar *cpu_affinity;
+  gboolean numa_local;
+  gboolean sched_dirty;
+  pid_t streaming_tid;
+  gboolean streaming_sched;
 };
 
 struct _GstNVimageSrcHEVCClass
@@ -0,0 +1,401 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* BGRx to NV12 and I420 conversion of the XShm capture path.
+ *
+ * Only the damaged rectangles of the screen are converted, into a frame
+ * that is kept between grabs. The conversion is BT.709 limited range,
+ * what GStreamer assumes for raw video of HD and larger sizes, with the
+ * chroma of every 2x2 block averaged. The kernels work on pairs of rows
+ * and 16 bit fixed point arithmetic, with the same rounding in every
+ * variant, so they produce identical output.
+ *
+ * Set NVIMAGE_CONVERT to c, sse2 or avx2 to pick a kernel instead of the
+ * fastest one the CPU runs. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NVIMAGECONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#include "nvimageconvert.h"
+
+/* Y  = ( 47 R + 157 G +  16 B) / 256 + 16
+ * Cb = (-26 R -  86 G + 112 B) / 256 + 128
+ * Cr = (112 R - 102 G -  10 B) / 256 + 128 */
+#define Y_R 47
+#define Y_G 157
+#define Y_B 16
+#define U_R 26
+#define U_G 86
+#define U_B 112
+#define V_R 112
+#define V_G 102
+#define V_B 10
+
+/* Converts @n pixels of the rows @s0 and @s1. @u is the UV plane of NV12
+ * when @v is NULL. An odd @n repeats the last pixel for the chroma. */
+typedef void (*NVimageConvertRowsFunc) (const guint8 * s0, const guint8 * s1, guint8 * y0, guint8 * y1,
+                                        guint8 * u, guint8 * v, gint n);
+
+static inline guint8
+nvimageconvert_luma (const guint8 * p)
+{
+        return ((Y_B * p[0] + Y_G * p[1] + Y_R * p[2] + 128) >> 8) + 16;
+}
+
+static void
+nvimageconvert_rows_c (const guint8 * s0, const guint8 * s1, guint8 * y0, guint8 * y1,
+                       guint8 * u, guint8 * v, gint n)
+{
+        for (gint i = 0; i < n; i += 2) {
+                gint j = MIN (i + 1, n - 1);
+                const guint8 *a = s0 + i * 4, *b = s0 + j * 4;
+                const guint8 *c = s1 + i * 4, *d = s1 + j * 4;
+                gint bl = (a[0] + b[0] + c[0] + d[0] + 2) >> 2;
+                gint gr = (a[1] + b[1] + c[1] + d[1] + 2) >> 2;
+                gint rd = (a[2] + b[2] + c[2] + d[2] + 2) >> 2;
+                guint8 cb = ((U_B * bl - U_G * gr - U_R * rd + 128) >> 8) + 128;
+                guint8 cr = ((V_R * rd - V_G * gr - V_B * bl + 128) >> 8) + 128;
+
+                y0[i] = nvimageconvert_luma (a);
+                y0[j] = nvimageconvert_luma (b);
+                y1[i] = nvimageconvert_luma (c);
+                y1[j] = nvimageconvert_luma (d);
+
+                if (v) {
+                        u[i / 2] = cb;
+                        v[i / 2] = cr;
+                } else {
+                        u[i] = cb;
+                        u[i + 1] = cr;
+                }
+        }
+}
+
+#ifdef NVIMAGECONVERT_X86
+/* 8 pixels as 16 bit B, G and R */
+static inline void
+nvimageconvert_planes_sse2 (const guint8 * s, __m128i * b, __m128i * g, __m128i * r)
+{
+        const __m128i m = _mm_set1_epi32 (0xff);
+        __m128i p0 = _mm_loadu_si128 ((const __m128i *) s);
+        __m128i p1 = _mm_loadu_si128 ((const __m128i *) (s + 16));
+
+        *b = _mm_packs_epi32 (_mm_and_si128 (p0, m), _mm_and_si128 (p1, m));
+        *g = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (p0, 8), m),
+                              _mm_and_si128 (_mm_srli_epi32 (p1, 8), m));
+        *r = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (p0, 16), m),
+                              _mm_and_si128 (_mm_srli_epi32 (p1, 16), m));
+}
+
+/* The sum stays below 65536, so unsigned 16 bit arithmetic is exact */
+static inline __m128i
+nvimageconvert_luma_sse2 (__m128i b, __m128i g, __m128i r)
+{
+        __m128i t = _mm_add_epi16 (_mm_add_epi16 (_mm_mullo_epi16 (b, _mm_set1_epi16 (Y_B)),
+                                                  _mm_mullo_epi16 (g, _mm_set1_epi16 (Y_G))),
+                                   _mm_add_epi16 (_mm_mullo_epi16 (r, _mm_set1_epi16 (Y_R)),
+                                                  _mm_set1_epi16 (128)));
+
+        return _mm_add_epi16 (_mm_srli_epi16 (t, 8), _mm_set1_epi16 (16));
+}
+
+/* Averages of the 2x2 blocks of 8 pixels wide rows, as 16 bit */
+static inline __m128i
+nvimageconvert_average_sse2 (__m128i a0, __m128i a1, __m128i b0, __m128i b1)
+{
+        const __m128i one = _mm_set1_epi16 (1);
+        __m128i sa = _mm_madd_epi16 (_mm_add_epi16 (a0, a1), one);
+        __m128i sb = _mm_madd_epi16 (_mm_add_epi16 (b0, b1), one);
+
+        return _mm_srli_epi16 (_mm_add_epi16 (_mm_packs_epi32 (sa, sb), _mm_set1_epi16 (2)), 2);
+}
+
+/* Signed, but within +-28688 */
+static inline __m128i
+nvimageconvert_chroma_sse2 (__m128i p, __m128i q, __m128i s, gint kp, gint kq, gint ks)
+{
+        __m128i t = _mm_sub_epi16 (_mm_mullo_epi16 (p, _mm_set1_epi16 (kp)),
+                                   _mm_add_epi16 (_mm_mullo_epi16 (q, _mm_set1_epi16 (kq)),
+                                                  _mm_mullo_epi16 (s, _mm_set1_epi16 (ks))));
+
+        t = _mm_srai_epi16 (_mm_add_epi16 (t, _mm_set1_epi16 (128)), 8);
+        return _mm_add_epi16 (t, _mm_set1_epi16 (128));
+}
+
+static void
+nvimageconvert_rows_sse2 (const guint8 * s0, const guint8 * s1, guint8 * y0, guint8 * y1,
+                          guint8 * u, guint8 * v, gint n)
+{
+        gint i;
+
+        for (i = 0; i + 16 <= n; i += 16) {
+                __m128i b0a, g0a, r0a, b0b, g0b, r0b, b1a, g1a, r1a, b1b, g1b, r1b;
+                __m128i bl, gr, rd, cb, cr;
+
+                nvimageconvert_planes_sse2 (s0 + i * 4, &b0a, &g0a, &r0a);
+                nvimageconvert_planes_sse2 (s0 + i * 4 + 32, &b0b, &g0b, &r0b);
+                nvimageconvert_planes_sse2 (s1 + i * 4, &b1a, &g1a, &r1a);
+                nvimageconvert_planes_sse2 (s1 + i * 4 + 32, &b1b, &g1b, &r1b);
+
+                _mm_storeu_si128 ((__m128i *) (y0 + i),
+                                  _mm_packus_epi16 (nvimageconvert_luma_sse2 (b0a, g0a, r0a),
+                                                    nvimageconvert_luma_sse2 (b0b, g0b, r0b)));
+                _mm_storeu_si128 ((__m128i *) (y1 + i),
+                                  _mm_packus_epi16 (nvimageconvert_luma_sse2 (b1a, g1a, r1a),
+                                                    nvimageconvert_luma_sse2 (b1b, g1b, r1b)));
+
+                bl = nvimageconvert_average_sse2 (b0a, b1a, b0b, b1b);
+                gr = nvimageconvert_average_sse2 (g0a, g1a, g0b, g1b);
+                rd = nvimageconvert_average_sse2 (r0a, r1a, r0b, r1b);
+                cb = nvimageconvert_chroma_sse2 (bl, gr, rd, U_B, U_G, U_R);
+                cr = nvimageconvert_chroma_sse2 (rd, gr, bl, V_R, V_G, V_B);
+                cb = _mm_packus_epi16 (cb, cb);
+                cr = _mm_packus_epi16 (cr, cr);
+
+                if (v) {
+                        _mm_storel_epi64 ((__m128i *) (u + i / 2), cb);
+                        _mm_storel_epi64 ((__m128i *) (v + i / 2), cr);
+                } else {
+                        _mm_storeu_si128 ((__m128i *) (u + i), _mm_unpacklo_epi8 (cb, cr));
+                }
+        }
+
+        if (i < n)
+                nvimageconvert_rows_c (s0 + i * 4, s1 + i * 4, y0 + i, y1 + i,
+                                       v ? u + i / 2 : u + i, v ? v + i / 2 : NULL, n - i);
+}
+
+/* The AVX2 packs work per 128 bit lane, the permutes restore the order */
+#define NVIMAGECONVERT_ORDER(x) _mm256_permute4x64_epi64 ((x), 0xd8)
+
+__attribute__ ((target ("avx2"))) static inline void
+nvimageconvert_planes_avx2 (const guint8 * s, __m256i * b, __m256i * g, __m256i * r)
+{
+        const __m256i m = _mm256_set1_epi32 (0xff);
+        __m256i p0 = _mm256_loadu_si256 ((const __m256i *) s);
+        __m256i p1 = _mm256_loadu_si256 ((const __m256i *) (s + 32));
+
+        *b = NVIMAGECONVERT_ORDER (_mm256_packs_epi32 (_mm256_and_si256 (p0, m), _mm256_and_si256 (p1, m)));
+        *g = NVIMAGECONVERT_ORDER (_mm256_packs_epi32 (_mm256_and_si256 (_mm256_srli_epi32 (p0, 8), m),
+                                                       _mm256_and_si256 (_mm256_srli_epi32 (p1, 8), m)));
+        *r = NVIMAGECONVERT_ORDER (_mm256_packs_epi32 (_mm256_and_si256 (_mm256_srli_epi32 (p0, 16), m),
+                                                       _mm256_and_si256 (_mm256_srli_epi32 (p1, 16), m)));
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+nvimageconvert_luma_avx2 (__m256i b, __m256i g, __m256i r)
+{
+        __m256i t = _mm256_add_epi16 (_mm256_add_epi16 (_mm256_mullo_epi16 (b, _mm256_set1_epi16 (Y_B)),
+                                                        _mm256_mullo_epi16 (g, _mm256_set1_epi16 (Y_G))),
+                                      _mm256_add_epi16 (_mm256_mullo_epi16 (r, _mm256_set1_epi16 (Y_R)),
+                                                        _mm256_set1_epi16 (128)));
+
+        return _mm256_add_epi16 (_mm256_srli_epi16 (t, 8), _mm256_set1_epi16 (16));
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+nvimageconvert_average_avx2 (__m256i a0, __m256i a1, __m256i b0, __m256i b1)
+{
+        const __m256i one = _mm256_set1_epi16 (1);
+        __m256i sa = _mm256_madd_epi16 (_mm256_add_epi16 (a0, a1), one);
+        __m256i sb = _mm256_madd_epi16 (_mm256_add_epi16 (b0, b1), one);
+        __m256i s = NVIMAGECONVERT_ORDER (_mm256_packs_epi32 (sa, sb));
+
+        return _mm256_srli_epi16 (_mm256_add_epi16 (s, _mm256_set1_epi16 (2)), 2);
+}
+
+__attribute__ ((target ("avx2"))) static inline __m128i
+nvimageconvert_chroma_avx2 (__m256i p, __m256i q, __m256i s, gint kp, gint kq, gint ks)
+{
+        __m256i t = _mm256_sub_epi16 (_mm256_mullo_epi16 (p, _mm256_set1_epi16 (kp)),
+                                      _mm256_add_epi16 (_mm256_mullo_epi16 (q, _mm256_set1_epi16 (kq)),
+                                                        _mm256_mullo_epi16 (s, _mm256_set1_epi16 (ks))));
+
+        t = _mm256_srai_epi16 (_mm256_add_epi16 (t, _mm256_set1_epi16 (128)), 8);
+        t = _mm256_add_epi16 (t, _mm256_set1_epi16 (128));
+        return _mm256_castsi256_si128 (NVIMAGECONVERT_ORDER (_mm256_packus_epi16 (t, t)));
+}
+
+__attribute__ ((target ("avx2"))) static void
+nvimageconvert_rows_avx2 (const guint8 * s0, const guint8 * s1, guint8 * y0, guint8 * y1,
+                          guint8 * u, guint8 * v, gint n)
+{
+        gint i;
+
+        for (i = 0; i + 32 <= n; i += 32) {
+                __m256i b0a, g0a, r0a, b0b, g0b, r0b, b1a, g1a, r1a, b1b, g1b, r1b;
+                __m256i bl, gr, rd;
+                __m128i cb, cr;
+
+                nvimageconvert_planes_avx2 (s0 + i * 4, &b0a, &g0a, &r0a);
+                nvimageconvert_planes_avx2 (s0 + i * 4 + 64, &b0b, &g0b, &r0b);
+                nvimageconvert_planes_avx2 (s1 + i * 4, &b1a, &g1a, &r1a);
+                nvimageconvert_planes_avx2 (s1 + i * 4 + 64, &b1b, &g1b, &r1b);
+
+                _mm256_storeu_si256 ((__m256i *) (y0 + i),
+                                     NVIMAGECONVERT_ORDER (_mm256_packus_epi16 (nvimageconvert_luma_avx2 (b0a, g0a, r0a),
+                                                                                nvimageconvert_luma_avx2 (b0b, g0b, r0b))));
+                _mm256_storeu_si256 ((__m256i *) (y1 + i),
+                                     NVIMAGECONVERT_ORDER (_mm256_packus_epi16 (nvimageconvert_luma_avx2 (b1a, g1a, r1a),
+                                                                                nvimageconvert_luma_avx2 (b1b, g1b, r1b))));
+
+                bl = nvimageconvert_average_avx2 (b0a, b1a, b0b, b1b);
+                gr = nvimageconvert_average_avx2 (g0a, g1a, g0b, g1b);
+                rd = nvimageconvert_average_avx2 (r0a, r1a, r0b, r1b);
+                cb = nvimageconvert_chroma_avx2 (bl, gr, rd, U_B, U_G, U_R);
+                cr = nvimageconvert_chroma_avx2 (rd, gr, bl, V_R, V_G, V_B);
+
+                if (v) {
+                        _mm_storeu_si128 ((__m128i *) (u + i / 2), cb);
+                        _mm_storeu_si128 ((__m128i *) (v + i / 2), cr);
+                } else {
+                        _mm_storeu_si128 ((__m128i *) (u + i), _mm_unpacklo_epi8 (cb, cr));
+                        _mm_storeu_si128 ((__m128i *) (u + i + 16), _mm_unpackhi_epi8 (cb, cr));
+                }
+        }
+
+        if (i < n)
+                nvimageconvert_rows_sse2 (s0 + i * 4, s1 + i * 4, y0 + i, y1 + i,
+                                          v ? u + i / 2 : u + i, v ? v + i / 2 : NULL, n - i);
+}
+#endif
+
+/* TRUE if the CPU runs @impl */
+gboolean
+nvimageconvert_impl_supported (NVimageConvertImpl impl)
+{
+        switch (impl) {
+                case NVIMAGE_CONVERT_C:
+                        return TRUE;
+#ifdef NVIMAGECONVERT_X86
+                case NVIMAGE_CONVERT_SSE2:
+                        return __builtin_cpu_supports ("sse2");
+                case NVIMAGE_CONVERT_AVX2:
+                        return __builtin_cpu_supports ("avx2");
+#endif
+                default:
+                        return FALSE;
+        }
+}
+
+const gchar *
+nvimageconvert_impl_name (NVimageConvertImpl impl)
+{
+        switch (impl) {
+                case NVIMAGE_CONVERT_C:
+                        return "c";
+                case NVIMAGE_CONVERT_SSE2:
+                        return "sse2";
+                case NVIMAGE_CONVERT_AVX2:
+                        return "avx2";
+                default:
+                        return "auto";
+        }
+}
+
+/* The fastest kernel the CPU runs, or the one NVIMAGE_CONVERT names */
+NVimageConvertImpl
+nvimageconvert_best_impl (void)
+{
+        static gsize best = 0;
+
+        if (g_once_init_enter (&best)) {
+                const gchar *env = g_getenv ("NVIMAGE_CONVERT");
+                NVimageConvertImpl impl = NVIMAGE_CONVERT_C;
+
+                if (nvimageconvert_impl_supported (NVIMAGE_CONVERT_AVX2))
+                        impl = NVIMAGE_CONVERT_AVX2;
+                else if (nvimageconvert_impl_supported (NVIMAGE_CONVERT_SSE2))
+                        impl = NVIMAGE_CONVERT_SSE2;
+
+                for (NVimageConvertImpl i = NVIMAGE_CONVERT_C; env && i <= NVIMAGE_CONVERT_AVX2; i++) {
+                        if (!g_ascii_strcasecmp (env, nvimageconvert_impl_name (i)) &&
+                            nvimageconvert_impl_supported (i))
+                                impl = i;
+                }
+
+                GST_INFO ("BGRx to YUV conversion through %s", nvimageconvert_impl_name (impl));
+                g_once_init_leave (&best, impl);
+        }
+
+        return best;
+}
+
+/* TRUE if @format is a target of nvimageconvert_rect() */
+gboolean
+nvimageconvert_supports (GstVideoFormat format)
+{
+        return format == GST_VIDEO_FORMAT_NV12 || format == GST_VIDEO_FORMAT_I420;
+}
+
+/* Converts the rectangle @x, @y, @w, @h of the BGRx frame @src to the same
+ * rectangle of the NV12 or I420 frame @dst, @width by @height pixels. The
+ * rectangle is extended to even coordinates since the chroma is shared by
+ * 2x2 blocks. */
+void
+nvimageconvert_rect (NVimageConvertImpl impl, const guint8 * src, gint src_stride,
+                     GstVideoFormat format, guint8 * const dst[], const gint dst_stride[],
+                     gint width, gint height, gint x, gint y, gint w, gint h)
+{
+        NVimageConvertRowsFunc rows;
+        gboolean nv12 = format == GST_VIDEO_FORMAT_NV12;
+        gint x0 = MAX (x, 0) & ~1;
+        gint y0 = MAX (y, 0) & ~1;
+        gint x1 = MIN (x + w, width);
+        gint y1 = MIN (y + h, height);
+
+        g_return_if_fail (nvimageconvert_supports (format));
+
+        if (impl == NVIMAGE_CONVERT_AUTO || !nvimageconvert_impl_supported (impl))
+                impl = nvimageconvert_best_impl ();
+        switch (impl) {
+#ifdef NVIMAGECONVERT_X86
+                case NVIMAGE_CONVERT_AVX2:
+                        rows = nvimageconvert_rows_avx2;
+                        break;
+                case NVIMAGE_CONVERT_SSE2:
+                        rows = nvimageconvert_rows_sse2;
+                        break;
+#endif
+                default:
+                        rows = nvimageconvert_rows_c;
+                        break;
+        }
+
+        /* Up to the next block, unless the frame ends first */
+        x1 = MIN ((x1 + 1) & ~1, width);
+
+        for (gint r = y0; r < y1; r += 2) {
+                /* An odd last row pairs with itself */
+                gint r1 = MIN (r + 1, height - 1);
+                guint8 *u = dst[1] + (r / 2) * dst_stride[1] + (nv12 ? x0 : x0 / 2);
+                guint8 *v = nv12 ? NULL : dst[2] + (r / 2) * dst_stride[2] + x0 / 2;
+
+                rows (src + r * src_stride + x0 * 4, src + r1 * src_stride + x0 * 4,
+                      dst[0] + r * dst_stride[0] + x0, dst[0] + r1 * dst_stride[0] + x0,
+                      u, v, x1 - x0);
+        }
+}
@@ -0,0 +1,258 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Scheduling of the capture threads.
+ *
+ * With many sessions on a host the streaming thread of nvimagesrc and the
+ * worker thread that captures and encodes for it compete with everything
+ * else for the CPUs, and a preempted thread shows up as frame time jitter.
+ * They can be given a real-time policy and be kept on a set of CPUs, e.g.
+ * the ones of the NUMA node the GPU hangs off. The kernel scheduler
+ * statistics tell how long a thread waited for a CPU. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "nvimagesched.h"
+
+#define NVIMAGESCHED_PCI_DEVICES "/sys/bus/pci/devices"
+#define NVIMAGESCHED_NVIDIA_VENDOR 0x10de
+/* Base class of display controllers, leaves out the audio functions */
+#define NVIMAGESCHED_DISPLAY_CLASS 0x03
+
+pid_t
+nvimagesched_gettid (void)
+{
+        return (pid_t) syscall (SYS_gettid);
+}
+
+/* Returns 0 or the error of pthread_setschedparam(), EPERM without
+   CAP_SYS_NICE or an RLIMIT_RTPRIO for real-time policies */
+gint
+nvimagesched_set_policy (pthread_t thread, NVimageSchedPolicy policy, guint priority)
+{
+        struct sched_param param;
+        gint sched_policy;
+
+        switch (policy) {
+                case NVIMAGE_SCHED_FIFO:
+                        sched_policy = SCHED_FIFO;
+                        break;
+                case NVIMAGE_SCHED_RR:
+                        sched_policy = SCHED_RR;
+                        break;
+                default:
+                        sched_policy = SCHED_OTHER;
+                        break;
+        }
+
+        memset (&param, 0, sizeof (param));
+        if (sched_policy != SCHED_OTHER)
+                param.sched_priority = CLAMP ((gint) priority, sched_get_priority_min (sched_policy),
+                                              sched_get_priority_max (sched_policy));
+
+        return pthread_setschedparam (thread, sched_policy, &param);
+}
+
+/* Parses a kernel CPU list such as "0-3,8,10-11" */
+static gboolean
+nvimagesched_parse_cpus (const gchar * list, cpu_set_t * set)
+{
+        gchar **ranges = g_strsplit (list, ",", -1);
+        gboolean ok = TRUE;
+
+        CPU_ZERO (set);
+        for (gint i = 0; ok && ranges[i]; i++) {
+                gchar *range = g_strstrip (ranges[i]);
+                gchar *end, *next;
+                guint64 first, last;
+
+                if (!*range)
+                        continue;
+
+                first = last = g_ascii_strtoull (range, &end, 10);
+                ok = end != range;
+                if (ok && *end == '-') {
+                        next = end + 1;
+                        last = g_ascii_strtoull (next, &end, 10);
+                        ok = end != next;
+                }
+                ok = ok && !*end && first <= last && last < CPU_SETSIZE;
+
+                for (guint64 cpu = first; ok && cpu <= last; cpu++)
+                        CPU_SET (cpu, set);
+        }
+        g_strfreev (ranges);
+
+        return ok;
+}
+
+/* Keeps @thread on the CPUs of the list @cpus that are also in the list
+   @local_cpus and in the mask the process was started with, either list
+   may be NULL or empty. Returns 0 or an errno, EINVAL for a list that
+   cannot be parsed or leaves no CPU. */
+gint
+nvimagesched_set_cpus (pthread_t thread, const gchar * cpus, const gchar * local_cpus)
+{
+        cpu_set_t set, list;
+
+        /* The main thread still has the mask of the process */
+        if (sched_getaffinity (getpid (), sizeof (set), &set) != 0)
+                return errno;
+
+        if (cpus && *cpus) {
+                if (!nvimagesched_parse_cpus (cpus, &list))
+                        return EINVAL;
+                CPU_AND (&set, &set, &list);
+        }
+        if (local_cpus && *local_cpus) {
+                if (!nvimagesched_parse_cpus (local_cpus, &list))
+                        return EINVAL;
+                CPU_AND (&set, &set, &list);
+        }
+        if (CPU_COUNT (&set) == 0)
+                return EINVAL;
+
+        return pthread_setaffinity_np (thread, sizeof (set), &set);
+}
+
+/* Gives the thread of kernel thread ID @tid back the time sharing policy
+   and the mask the process was started with, e.g. a pool thread before
+   other tasks get it. Returns 0 or an errno. */
+gint
+nvimagesched_reset (pid_t tid)
+{
+        struct sched_param param;
+        cpu_set_t set;
+
+        memset (&param, 0, sizeof (param));
+        if (sched_setscheduler (tid, SCHED_OTHER, &param) != 0)
+                return errno;
+        if (sched_getaffinity (getpid (), sizeof (set), &set) != 0)
+                return errno;
+        if (sched_setaffinity (tid, sizeof (set), &set) != 0)
+                return errno;
+
+        return 0;
+}
+
+static gchar *
+nvimagesched_read_device (const gchar * device, const gchar * file)
+{
+        gchar *path = g_build_filename (NVIMAGESCHED_PCI_DEVICES, device, file, NULL);
+        gchar *contents = NULL;
+
+        if (g_file_get_contents (path, &contents, NULL, NULL))
+                g_strstrip (contents);
+        g_free (path);
+
+        return contents;
+}
+
+static gboolean
+nvimagesched_is_gpu (const gchar * device)
+{
+        gchar *vendor = nvimagesched_read_device (device, "vendor");
+        gchar *class = nvimagesched_read_device (device, "class");
+        gboolean gpu;
+
+        gpu = vendor && class &&
+                g_ascii_strtoull (vendor, NULL, 16) == NVIMAGESCHED_NVIDIA_VENDOR &&
+                (g_ascii_strtoull (class, NULL, 16) >> 16) == NVIMAGESCHED_DISPLAY_CLASS;
+
+        g_free (vendor);
+        g_free (class);
+        return gpu;
+}
+
+static gint
+nvimagesched_compare_devices (gconstpointer a, gconstpointer b)
+{
+        return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Returns the list of the CPUs of the NUMA node @gpu is attached to, NULL
+   if it is not found. GPUs are numbered in PCI bus order like the NVIDIA
+   X driver numbers its screens and NVML its devices. */
+gchar *
+nvimagesched_gpu_cpus (gint gpu)
+{
+        GDir *dir;
+        GPtrArray *gpus;
+        const gchar *name;
+        gchar *cpus = NULL;
+
+        if (gpu < 0)
+                return NULL;
+
+        dir = g_dir_open (NVIMAGESCHED_PCI_DEVICES, 0, NULL);
+        if (!dir)
+                return NULL;
+
+        gpus = g_ptr_array_new_with_free_func (g_free);
+        while ((name = g_dir_read_name (dir))) {
+                if (nvimagesched_is_gpu (name))
+                        g_ptr_array_add (gpus, g_strdup (name));
+        }
+        g_dir_close (dir);
+
+        /* Fixed width domain:bus:device.function names sort in bus order */
+        g_ptr_array_sort (gpus, nvimagesched_compare_devices);
+        if ((guint) gpu < gpus->len)
+                cpus = nvimagesched_read_device (g_ptr_array_index (gpus, gpu), "local_cpulist");
+        g_ptr_array_unref (gpus);
+
+        return cpus;
+}
+
+/* Microseconds thread @tid of this process was runnable but waited for a
+   CPU since it started, 0 without scheduler statistics */
+guint64
+nvimagesched_run_delay (pid_t tid)
+{
+        gchar *path, *contents = NULL;
+        gchar **fields;
+        guint64 delay = 0;
+
+        if (tid <= 0)
+                return 0;
+
+        /* run time, wait time, time slices, in nanoseconds */
+        path = g_strdup_printf ("/proc/self/task/%d/schedstat", (gint) tid);
+        if (g_file_get_contents (path, &contents, NULL, NULL)) {
+                fields = g_strsplit (contents, " ", 3);
+                if (g_strv_length (fields) >= 2)
+                        delay = g_ascii_strtoull (fields[1], NULL, 10) / 1000;
+                g_strfreev (fields);
+        }
+        g_free (contents);
+        g_free (path);
+
+        return delay;
+}
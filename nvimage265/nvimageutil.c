@@ -22,15 +22,26 @@
 #endif
 
 #include "nvimageutil.h"
+#include <dlfcn.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <unistd.h>
 
 static gboolean nvimageutil_fbccontext_get(GstXContext *xcontext);
 static gboolean nvimageutil_fbccontext_clear(GstXContext *xcontext);
-static gboolean nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gchar * display_name);
+static gboolean nvimageutil_capture_get(GstXContext *xcontext);
+static gboolean nvimageutil_capture_clear(GstXContext *xcontext);
+static gboolean nvimageutil_encoder_get(GstXContext *xcontext);
+static gboolean nvimageutil_encoder_probe_yuv444(GstXContext *xcontext, guint max_sessions);
+static gboolean nvimageutil_encoder_clear(GstXContext *xcontext);
+static gboolean nvimageutil_encoder_set_rate(GstXContext *xcontext, guint bitrate, guint fps_n, guint fps_d);
+static gboolean nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gchar * display_name, gint gpu, GstNVimageCaptureMode mode, guint max_sessions);
 static void nvimageutil_xcontext_clear (GstXContext * xcontext);
-static GstBuffer * gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts);
+static GstBuffer * gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts, const GstNVimageEncConfig * config);
 
 GType
 gst_meta_nvimage_api_get_type (void)
@@ -54,6 +65,7 @@ gst_meta_nvimage_init (GstMeta * meta, gpointer params, GstBuffer * buffer)
         emeta->height = 0;
         emeta->size = 0;
         emeta->data = 0;
+        emeta->changed_blocks = -1;
 
         return TRUE;
 }
@@ -73,11 +85,114 @@ gst_meta_nvimage_get_info (void)
         return meta_nvimage_info;
 }
 
+GType
+gst_meta_nvimage_frame_api_get_type (void)
+{
+        static volatile GType type;
+        static const gchar *tags[] = { NULL };
+
+        if (g_once_init_enter (&type)) {
+                GType _type = gst_meta_api_type_register ("GstMetaNVimageFrameAPI", tags);
+                g_once_init_leave (&type, _type);
+        }
+        return type;
+}
+
+static gboolean
+gst_meta_nvimage_frame_init (GstMeta * meta, gpointer params, GstBuffer * buffer)
+{
+        GstMetaNVimageFrame *fmeta = (GstMetaNVimageFrame *) meta;
+
+        fmeta->frame_idx = 0;
+        fmeta->picture_type = NV_ENC_PIC_TYPE_UNKNOWN;
+        fmeta->avg_qp = 0;
+        fmeta->num_slices = 0;
+        fmeta->size = 0;
+        fmeta->keyframe = FALSE;
+        fmeta->refine = FALSE;
+        fmeta->content = NVIMAGE_CONTENT_TEXT;
+        fmeta->changed = TRUE;
+        fmeta->encode_time = 0;
+        fmeta->forced = FALSE;
+        fmeta->capture_ts = GST_CLOCK_TIME_NONE;
+
+        return TRUE;
+}
+
+static gboolean
+gst_meta_nvimage_frame_transform (GstBuffer * dest, GstMeta * meta, GstBuffer * buffer, GQuark type, gpointer data)
+{
+        GstMetaNVimageFrame *smeta = (GstMetaNVimageFrame *) meta;
+        GstMetaNVimageFrame *dmeta;
+
+        /* Only plain copies keep the meta, anything else changes the frame */
+        if (!GST_META_TRANSFORM_IS_COPY (type))
+                return FALSE;
+
+        dmeta = GST_META_NVIMAGE_FRAME_ADD (dest);
+        if (!dmeta)
+                return FALSE;
+
+        dmeta->frame_idx = smeta->frame_idx;
+        dmeta->picture_type = smeta->picture_type;
+        dmeta->avg_qp = smeta->avg_qp;
+        dmeta->num_slices = smeta->num_slices;
+        dmeta->size = smeta->size;
+        dmeta->keyframe = smeta->keyframe;
+        dmeta->refine = smeta->refine;
+        dmeta->content = smeta->content;
+        dmeta->changed = smeta->changed;
+        dmeta->encode_time = smeta->encode_time;
+        dmeta->forced = smeta->forced;
+        dmeta->capture_ts = smeta->capture_ts;
+
+        return TRUE;
+}
+
+const GstMetaInfo *
+gst_meta_nvimage_frame_get_info (void)
+{
+        static const GstMetaInfo *meta_nvimage_frame_info = NULL;
+
+        if (g_once_init_enter (&meta_nvimage_frame_info)) {
+                const GstMetaInfo *meta =
+                        gst_meta_register (gst_meta_nvimage_frame_api_get_type (), "GstMetaNVimageFrame",
+                                sizeof (GstMetaNVimageFrame), (GstMetaInitFunction) gst_meta_nvimage_frame_init,
+                                (GstMetaFreeFunction) NULL, (GstMetaTransformFunction) gst_meta_nvimage_frame_transform);
+                g_once_init_leave (&meta_nvimage_frame_info, meta);
+        }
+        return meta_nvimage_frame_info;
+}
+
+const gchar *
+gst_nvimageutil_picture_type_name (guint picture_type)
+{
+        switch (picture_type) {
+                case NV_ENC_PIC_TYPE_P:
+                        return "P";
+                case NV_ENC_PIC_TYPE_B:
+                        return "B";
+                case NV_ENC_PIC_TYPE_I:
+                        return "I";
+                case NV_ENC_PIC_TYPE_IDR:
+                        return "IDR";
+                case NV_ENC_PIC_TYPE_BI:
+                        return "BI";
+                case NV_ENC_PIC_TYPE_SKIPPED:
+                        return "skipped";
+                case NV_ENC_PIC_TYPE_INTRA_REFRESH:
+                        return "intra-refresh";
+                default:
+                        return "unknown";
+        }
+}
+
 static void*
 worker_thread(void *arg) {
         GstXContext *xcontext = (GstXContext *)(arg);
         gboolean retb;
         GstBuffer *buf;
+        xcontext->worker_sys_tid = nvimagesched_gettid();
         while(!xcontext->finish) {
                 pthread_mutex_lock(&xcontext->mutex_in);
                 if(! xcontext->funcdata.inputvalid) {
@@ -91,7 +206,10 @@ worker_thread(void *arg) {
                 switch(xcontext->funcdata.function) {
                         case 1:
                                 retb = nvimageutil_xcontext_get(xcontext, xcontext->funcdata.args[0].parent, 
-                                                                        xcontext->funcdata.args[1].display_name);
+                                                                        xcontext->funcdata.args[1].display_name,
+                                                                        xcontext->funcdata.args[2].gpu,
+                                                                        xcontext->funcdata.args[3].mode,
+                                                                        xcontext->funcdata.args[4].max_sessions);
                                 xcontext->funcdata.retval.b = retb;
                                 xcontext->funcdata.retvalid = 1;
                                 pthread_mutex_lock(&xcontext->mutex_out);
@@ -107,12 +225,14 @@ worker_thread(void *arg) {
                                 pthread_mutex_unlock(&xcontext->mutex_in);
                                 return NULL;
                         case 3:
+                                xcontext->wakeupDelay = g_get_monotonic_time() - xcontext->funcdata.signalled;
                                 buf = gst_nvimageutil_nvimage_new(xcontext, xcontext->funcdata.args[0].parent,
                                                                         xcontext->funcdata.args[1].fps_n, xcontext->funcdata.args[2].fps_d,
                                                                         xcontext->funcdata.args[3].bitrate, xcontext->funcdata.args[4].show_pointer,
                                                                         xcontext->funcdata.args[5].forcekeyframe,
                                                                         xcontext->funcdata.args[6].frame,
-                                                                        xcontext->funcdata.args[7].ts);
+                                                                        xcontext->funcdata.args[7].ts,
+                                                                        xcontext->funcdata.args[8].config);
                                 pthread_mutex_lock(&xcontext->mutex_out);
                                 xcontext->funcdata.retvalid = 1;
                                 xcontext->funcdata.retval.buf = buf;                                
@@ -137,7 +257,7 @@ worker_init(GstXContext *xcontext) {
 
 
 GstXContext *
-nvimageutil_xcontext_get_r(GstElement * parent, const gchar * display_name)
+nvimageutil_xcontext_get_r(GstElement * parent, const gchar * display_name, gint gpu, GstNVimageCaptureMode mode, guint max_sessions)
 {
         gboolean ret;
         GstXContext * xcontext = g_new0 (GstXContext, 1);
@@ -147,6 +267,9 @@ nvimageutil_xcontext_get_r(GstElement * parent, const gchar * display_name)
         xcontext->funcdata.function = 1;
         xcontext->funcdata.args[0].parent = parent;
         xcontext->funcdata.args[1].display_name = display_name;
+        xcontext->funcdata.args[2].gpu = gpu;
+        xcontext->funcdata.args[3].mode = mode;
+        xcontext->funcdata.args[4].max_sessions = max_sessions;
         xcontext->funcdata.retvalid = 0;
         xcontext->funcdata.inputvalid = 1;
         pthread_cond_signal(&xcontext->cond_in);
@@ -163,6 +286,7 @@ nvimageutil_xcontext_get_r(GstElement * parent, const gchar * display_name)
                 xcontext->finish = 1;
                 pthread_cond_signal(&xcontext->cond_in);
                 pthread_join(xcontext->worker_tid, NULL);
+                g_free(xcontext);
                 return NULL;
         }
         return xcontext;
@@ -186,7 +310,7 @@ nvimageutil_xcontext_clear_r (GstXContext * xcontext)
 }
 
 GstBuffer *
-gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts) {
+gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts, const GstNVimageEncConfig * config) {
         GstBuffer *ret;
         memset(&xcontext->funcdata, 0, sizeof(GstXThreadCall));
         pthread_mutex_lock(&xcontext->mutex_in);
@@ -199,8 +323,10 @@ gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guin
         xcontext->funcdata.args[5].forcekeyframe = forcekeyframe;
         xcontext->funcdata.args[6].frame = frame;
         xcontext->funcdata.args[7].ts = ts;
+        xcontext->funcdata.args[8].config = config;
         xcontext->funcdata.retvalid = 0;
         xcontext->funcdata.inputvalid = 1;
+        xcontext->funcdata.signalled = g_get_monotonic_time();
         pthread_mutex_unlock(&xcontext->mutex_in);
         pthread_cond_signal(&xcontext->cond_in);
         pthread_mutex_lock(&xcontext->mutex_out);
@@ -212,12 +338,63 @@ gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guin
         return ret;
 }
 
-/* This function gets the X Display and global info about it. Everything is
-   stored in our object and will be cleaned when the object is disposed. Note
-   here that caps for supported format are generated without any window or
-   image creation */
+/* The NVIDIA libraries are opened at run time, so the element also loads
+   on hosts without a GPU and captures through XShm there */
+static struct {
+        PNVFBCCREATEINSTANCE fbcCreateInstance;
+        NVENCSTATUS (NVENCAPI *encCreateInstance) (NV_ENCODE_API_FUNCTION_LIST *functionList);
+        CUresult (*init) (unsigned int flags);
+        CUresult (*deviceGet) (CUdevice *device, int ordinal);
+        CUresult (*ctxCreate) (CUcontext *pctx, unsigned int flags, CUdevice dev);
+        CUresult (*ctxDestroy) (CUcontext ctx);
+        CUresult (*memcpyDtoH) (void *dstHost, CUdeviceptr srcDevice, size_t byteCount);
+} nvidia;
+
+static gpointer
+nvimageutil_nvidia_open (gpointer data)
+{
+        void *fbc = dlopen ("libnvidia-fbc.so.1", RTLD_NOW);
+        void *enc = dlopen ("libnvidia-encode.so.1", RTLD_NOW);
+        void *cuda = dlopen ("libcuda.so.1", RTLD_NOW);
+
+        if (fbc)
+                nvidia.fbcCreateInstance = dlsym (fbc, "NvFBCCreateInstance");
+        if (enc)
+                nvidia.encCreateInstance = dlsym (enc, "NvEncodeAPICreateInstance");
+        if (cuda) {
+                nvidia.init = dlsym (cuda, "cuInit");
+                nvidia.deviceGet = dlsym (cuda, "cuDeviceGet");
+                nvidia.ctxCreate = dlsym (cuda, "cuCtxCreate_v2");
+                nvidia.ctxDestroy = dlsym (cuda, "cuCtxDestroy_v2");
+                nvidia.memcpyDtoH = dlsym (cuda, "cuMemcpyDtoH_v2");
+        }
+
+        if (!nvidia.fbcCreateInstance || !nvidia.encCreateInstance)
+                GST_INFO ("NVIDIA capture and encode libraries not found: %s", dlerror ());
+
+        return NULL;
+}
+
+/* TRUE if everything capture @mode needs from the NVIDIA libraries is there */
 static gboolean
-nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gchar * display_name)
+nvimageutil_nvidia_get (GstNVimageCaptureMode mode)
+{
+        static GOnce once = G_ONCE_INIT;
+
+        g_once (&once, nvimageutil_nvidia_open, NULL);
+
+        if (!nvidia.fbcCreateInstance || !nvidia.encCreateInstance)
+                return FALSE;
+        if (mode == NVIMAGE_CAPTURE_CUDA)
+                return nvidia.init && nvidia.deviceGet && nvidia.ctxCreate &&
+                        nvidia.ctxDestroy && nvidia.memcpyDtoH;
+        return TRUE;
+}
+
+/* Creates the GLX context NvFBC captures into and NVENC reads from, made
+   current on the worker thread */
+static gboolean
+nvimageutil_gl_get (GstXContext *xcontext, gint screen)
 {
         gint n;
         GLXFBConfig *fbconfigs;
@@ -230,24 +407,11 @@ nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gcha
                 None
         };
 
-
-        xcontext->disp = XOpenDisplay (display_name);
-        GST_DEBUG_OBJECT (parent, "opened display %p", xcontext->disp);
-        if (!xcontext->disp) {
-                g_free (xcontext);
-                g_error ("Cannot open display");
-                return FALSE;
-        }
-        xcontext->screen = DefaultScreenOfDisplay (xcontext->disp);
-
-        xcontext->width = WidthOfScreen (xcontext->screen);
-        xcontext->height = HeightOfScreen (xcontext->screen);
-
-        fbconfigs = glXChooseFBConfig(xcontext->disp, DefaultScreen(xcontext->disp), attribs, &n);
+        fbconfigs = glXChooseFBConfig(xcontext->disp, screen, attribs, &n);
 
         if (!fbconfigs) {
                 XCloseDisplay (xcontext->disp);
-                g_error ("Cannot get fbconfigs");
+                GST_ERROR ("Cannot get fbconfigs");
                 return FALSE;
         }
 
@@ -256,18 +420,18 @@ nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gcha
         if (xcontext->glxctx == None) {
                 XFree(fbconfigs);
                 XCloseDisplay (xcontext->disp);
-                g_error ("Cannot create new glx context");
+                GST_ERROR ("Cannot create new glx context");
                 return FALSE;
         }
 
-        xcontext->pixmap = XCreatePixmap(xcontext->disp, XDefaultRootWindow(xcontext->disp), 
-                                        1, 1, DisplayPlanes(xcontext->disp, XDefaultScreen(xcontext->disp)));
+        xcontext->pixmap = XCreatePixmap(xcontext->disp, RootWindow(xcontext->disp, screen), 
+                                        1, 1, DisplayPlanes(xcontext->disp, screen));
 
         if (xcontext->pixmap == None) {
                 glXDestroyContext(xcontext->disp, xcontext->glxctx);
                 XFree(fbconfigs);
                 XCloseDisplay (xcontext->disp);
-                g_error ("Cannot create pixmap");
+                GST_ERROR ("Cannot create pixmap");
                 return FALSE;
         }
 
@@ -278,7 +442,7 @@ nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gcha
                 glXDestroyContext(xcontext->disp, xcontext->glxctx);
                 XFree(fbconfigs);
                 XCloseDisplay (xcontext->disp);
-                g_error ("Cannot create glx pixmap");
+                GST_ERROR ("Cannot create glx pixmap");
                 return FALSE;
         }
 
@@ -289,7 +453,7 @@ nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gcha
                 glXDestroyContext(xcontext->disp, xcontext->glxctx);
                 XFree(fbconfigs);
                 XCloseDisplay (xcontext->disp);
-                g_error ("Cannot set current context");
+                GST_ERROR ("Cannot set current context");
                 return FALSE;
         }
 
@@ -297,17 +461,279 @@ nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gcha
 
         XFree(fbconfigs);
 
+        return TRUE;
+}
+
+/* Creates the CUDA context NvFBC captures into and NVENC reads from, it is
+   current on the worker thread from now on. The CUDA device ordinal is the
+   GPU index, so CUDA_DEVICE_ORDER=PCI_BUS_ID has to match it with the X
+   screens on hosts with several GPUs. */
+static gboolean
+nvimageutil_cuda_get (GstXContext *xcontext, GstElement * parent)
+{
+        CUdevice device;
+        CUresult res;
+
+        res = nvidia.init(0);
+        if (res == CUDA_SUCCESS)
+                res = nvidia.deviceGet(&device, xcontext->gpu);
+        if (res == CUDA_SUCCESS)
+                res = nvidia.ctxCreate(&xcontext->cuctx, CU_CTX_SCHED_BLOCKING_SYNC, device);
+        if (res != CUDA_SUCCESS) {
+                GST_ERROR_OBJECT (parent, "Cannot create CUDA context on GPU %d: %d", xcontext->gpu, res);
+                xcontext->cuctx = NULL;
+                XCloseDisplay (xcontext->disp);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Tracks the damage of the root window, FALSE without XFixes and XDamage */
+static gboolean
+nvimageutil_damage_get (GstXContext *xcontext)
+{
+        gint event_base, error_base;
+
+        xcontext->xfixes = XFixesQueryExtension (xcontext->disp, &event_base, &error_base);
+        if (!xcontext->xfixes || !XDamageQueryExtension (xcontext->disp, &event_base, &error_base))
+                return FALSE;
+
+        xcontext->damage = XDamageCreate (xcontext->disp, RootWindowOfScreen (xcontext->screen),
+                                XDamageReportNonEmpty);
+        xcontext->region = XFixesCreateRegion (xcontext->disp, NULL, 0);
+
+        return TRUE;
+}
+
+static void
+nvimageutil_damage_clear (GstXContext *xcontext)
+{
+        if (!xcontext->damage)
+                return;
+
+        XDamageDestroy (xcontext->disp, xcontext->damage);
+        XFixesDestroyRegion (xcontext->disp, xcontext->region);
+        xcontext->damage = None;
+}
+
+/* Moves the damage since the previous call into the region */
+static void
+nvimageutil_damage_fetch (GstXContext *xcontext)
+{
+        XEvent ev;
+
+        /* The events only say that there is damage, the region comes with
+           the subtract */
+        while (XPending (xcontext->disp))
+                XNextEvent (xcontext->disp, &ev);
+        XDamageSubtract (xcontext->disp, xcontext->damage, None, xcontext->region);
+}
+
+/* Share of the screen damaged since the previous call, -1 without XDamage */
+static gdouble
+nvimageutil_damage_area (GstXContext *xcontext)
+{
+        XRectangle *rects;
+        gint64 pixels = 0;
+        gint n = 0;
+
+        if (!xcontext->damage)
+                return -1.0;
+
+        nvimageutil_damage_fetch (xcontext);
+        rects = XFixesFetchRegion (xcontext->disp, xcontext->region, &n);
+        for (gint i = 0; i < n; i++)
+                pixels += rects[i].width * rects[i].height;
+        if (rects)
+                XFree (rects);
+
+        return MIN ((gdouble) pixels / (xcontext->width * xcontext->height), 1.0);
+}
+
+/* Sets up capture through XShm for hosts without a GPU. The screen is read
+   through one shared memory image, with XDamage only the rectangles that
+   changed since the previous grab. */
+static gboolean
+nvimageutil_xshm_get (GstXContext *xcontext, GstElement * parent, gint screen)
+{
+        gint depth = DefaultDepth (xcontext->disp, screen);
+
+        if (!XShmQueryExtension (xcontext->disp) || (depth != 24 && depth != 32)) {
+                GST_ERROR_OBJECT (parent, "XShm capture needs the MIT-SHM extension and a 24 bit screen");
+                XCloseDisplay (xcontext->disp);
+                return FALSE;
+        }
+
+        xcontext->ximage = XShmCreateImage (xcontext->disp, DefaultVisual (xcontext->disp, screen), depth,
+                                        ZPixmap, NULL, &xcontext->shminfo, xcontext->width, xcontext->height);
+        if (!xcontext->ximage || xcontext->ximage->bits_per_pixel != 32) {
+                GST_ERROR_OBJECT (parent, "Cannot create a 32 bpp XShm image");
+                goto fail;
+        }
+
+        xcontext->shminfo.shmid = shmget (IPC_PRIVATE, xcontext->ximage->bytes_per_line * xcontext->height,
+                                        IPC_CREAT | 0600);
+        if (xcontext->shminfo.shmid < 0) {
+                GST_ERROR_OBJECT (parent, "Cannot get shared memory: %s", g_strerror (errno));
+                goto fail;
+        }
+        xcontext->shminfo.shmaddr = xcontext->ximage->data = shmat (xcontext->shminfo.shmid, NULL, 0);
+        xcontext->shminfo.readOnly = False;
+        if (xcontext->shminfo.shmaddr == (void *) -1 || !XShmAttach (xcontext->disp, &xcontext->shminfo)) {
+                GST_ERROR_OBJECT (parent, "Cannot attach shared memory");
+                shmctl (xcontext->shminfo.shmid, IPC_RMID, NULL);
+                goto fail;
+        }
+        XSync (xcontext->disp, False);
+        /* Gone once both of us detach */
+        shmctl (xcontext->shminfo.shmid, IPC_RMID, NULL);
+
+        if (!nvimageutil_damage_get (xcontext))
+                GST_WARNING_OBJECT (parent, "No XDamage, every frame is a full screen copy");
+
+        xcontext->frame = g_malloc0 (xcontext->width * xcontext->height * 4);
+        xcontext->frame_valid = FALSE;
+        /* The format is picked with the first frame */
+        gst_video_info_init (&xcontext->outInfo);
+        xcontext->cursor_x = xcontext->cursor_y = -1;
+
+        return TRUE;
+
+fail:
+        if (xcontext->ximage) {
+                if (xcontext->shminfo.shmaddr && xcontext->shminfo.shmaddr != (void *) -1)
+                        shmdt (xcontext->shminfo.shmaddr);
+                xcontext->ximage->data = NULL;
+                XDestroyImage (xcontext->ximage);
+                xcontext->ximage = NULL;
+        }
+        XCloseDisplay (xcontext->disp);
+        return FALSE;
+}
+
+static void
+nvimageutil_xshm_clear (GstXContext *xcontext)
+{
+        nvimageutil_damage_clear (xcontext);
+
+        XShmDetach (xcontext->disp, &xcontext->shminfo);
+        XSync (xcontext->disp, False);
+        shmdt (xcontext->shminfo.shmaddr);
+        xcontext->ximage->data = NULL;
+        XDestroyImage (xcontext->ximage);
+        xcontext->ximage = NULL;
+
+        g_free (xcontext->frame);
+        xcontext->frame = NULL;
+        g_free (xcontext->yuv);
+        xcontext->yuv = NULL;
+        g_free (xcontext->pointerFrame);
+        xcontext->pointerFrame = NULL;
+        gst_video_info_init (&xcontext->outInfo);
+}
+
+/* This function gets the X Display and global info about it. Everything is
+   stored in our object and will be cleaned when the object is disposed. Note
+   here that caps for supported format are generated without any window or
+   image creation.
+   Every GPU drives its own X screen, so @gpu selects the screen to capture
+   and the GPU whose NVFBC and NVENC do the work, -1 places the context on
+   the screen with the fewest sessions. In CUDA mode NvFBC opens the display
+   itself and captures its default screen, so the screen has to be part of
+   the display name there. Without a GPU the screen is captured through
+   XShm. With @max_sessions the encoder probe takes a broker slot like any
+   other session. */
+static gboolean
+nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gchar * display_name, gint gpu, GstNVimageCaptureMode mode, guint max_sessions)
+{
+        gint screen;
+        gboolean fallback = mode == NVIMAGE_CAPTURE_AUTO;
+
+        if (mode == NVIMAGE_CAPTURE_AUTO) {
+                mode = nvimageutil_nvidia_get (NVIMAGE_CAPTURE_GL) ? NVIMAGE_CAPTURE_GL : NVIMAGE_CAPTURE_XSHM;
+        } else if (mode != NVIMAGE_CAPTURE_XSHM && !nvimageutil_nvidia_get (mode)) {
+                GST_ERROR_OBJECT (parent, "Cannot load the NVIDIA capture and encode libraries");
+                return FALSE;
+        }
+
+        xcontext->disp = XOpenDisplay (display_name);
+        GST_DEBUG_OBJECT (parent, "opened display %p", xcontext->disp);
+        if (!xcontext->disp) {
+                GST_ERROR_OBJECT (parent, "Cannot open display %s", display_name ? display_name : "");
+                return FALSE;
+        }
+
+        if (gpu >= ScreenCount (xcontext->disp)) {
+                GST_ERROR_OBJECT (parent, "GPU %d requested, display has %d screens",
+                                  gpu, ScreenCount (xcontext->disp));
+                XCloseDisplay (xcontext->disp);
+                return FALSE;
+        }
+        if (mode == NVIMAGE_CAPTURE_CUDA && gpu >= 0 && gpu != DefaultScreen (xcontext->disp)) {
+                GST_ERROR_OBJECT (parent, "GPU %d requested, CUDA capture needs it in the display name, e.g. %s.%d",
+                                  gpu, display_name ? display_name : ":0", gpu);
+                XCloseDisplay (xcontext->disp);
+                return FALSE;
+        }
+        /* NvFBC captures the screen a GPU drives, so there is only a choice
+           with a screen per GPU. CUDA capture is tied to the screen of the
+           display name. */
+        if (gpu < 0 && mode == NVIMAGE_CAPTURE_GL && ScreenCount (xcontext->disp) > 1)
+                gpu = nvencbroker_least_loaded (ScreenCount (xcontext->disp));
+        else if (gpu < 0)
+                gpu = DefaultScreen (xcontext->disp);
+
+        screen = gpu;
+        xcontext->gpu = mode == NVIMAGE_CAPTURE_XSHM ? -1 : gpu;
+        xcontext->mode = mode;
+        xcontext->screen = ScreenOfDisplay (xcontext->disp, screen);
+        GST_INFO_OBJECT (parent, "capturing screen %d on GPU %d through %s", screen, xcontext->gpu,
+                         mode == NVIMAGE_CAPTURE_XSHM ? "XShm" : mode == NVIMAGE_CAPTURE_CUDA ? "CUDA" : "OpenGL");
+
+        xcontext->width = WidthOfScreen (xcontext->screen);
+        xcontext->height = HeightOfScreen (xcontext->screen);
+
+        if (mode == NVIMAGE_CAPTURE_XSHM) {
+                if (!nvimageutil_xshm_get (xcontext, parent, screen))
+                        return FALSE;
+        } else if (mode == NVIMAGE_CAPTURE_CUDA) {
+                if (!nvimageutil_cuda_get (xcontext, parent))
+                        return FALSE;
+        } else if (!nvimageutil_gl_get (xcontext, screen)) {
+                /* gl_get closed the display */
+                if (!fallback)
+                        return FALSE;
+                GST_WARNING_OBJECT (parent, "NVIDIA capture failed, falling back to XShm");
+                return nvimageutil_xcontext_get (xcontext, parent, display_name, gpu, NVIMAGE_CAPTURE_XSHM, max_sessions);
+        }
+
         xcontext->fps_n = 30;
         xcontext->fps_d = 1;
         xcontext->bitrate = 2000000;
         xcontext->goplen = 10;
         xcontext->show_pointer = 0;
 
-        if (!nvimageutil_fbccontext_get(xcontext)) {
+        if (mode == NVIMAGE_CAPTURE_XSHM)
+                return TRUE;
+
+        /* Counted by the placement of the following contexts */
+        xcontext->session = nvencbroker_register (xcontext->gpu);
+
+        /* The encoder is opened with the first frame, once the real
+           parameters and the broker settings are known */
+        if (!nvimageutil_capture_get(xcontext)) {
                 nvimageutil_xcontext_clear(xcontext);
-                return FALSE;
+                if (!fallback)
+                        return FALSE;
+                GST_WARNING_OBJECT (parent, "NVIDIA capture failed, falling back to XShm");
+                return nvimageutil_xcontext_get (xcontext, parent, display_name, gpu, NVIMAGE_CAPTURE_XSHM, max_sessions);
         }
 
+        xcontext->yuv444_supported = nvimageutil_encoder_probe_yuv444(xcontext, max_sessions);
+        GST_INFO_OBJECT (parent, "GPU %d %s encode 4:4:4", xcontext->gpu,
+                         xcontext->yuv444_supported ? "can" : "cannot");
+
         return TRUE;
 }
 
@@ -318,50 +744,89 @@ nvimageutil_xcontext_clear (GstXContext * xcontext)
 {
         g_return_if_fail (xcontext != NULL);
 
-        nvimageutil_fbccontext_clear(xcontext);
+        if (xcontext->mode == NVIMAGE_CAPTURE_XSHM) {
+                nvimageutil_xshm_clear (xcontext);
+                XCloseDisplay (xcontext->disp);
+                return;
+        }
 
-        glXMakeCurrent(xcontext->disp, 0, NULL);
-        glXDestroyPixmap(xcontext->disp, xcontext->glxpixmap);
-        XFreePixmap(xcontext->disp, xcontext->pixmap);
-        glXDestroyContext(xcontext->disp, xcontext->glxctx);
+        nvimageutil_fbccontext_clear(xcontext);
+        nvimageutil_damage_clear(xcontext);
+        nvencbroker_unregister(xcontext->session);
+        xcontext->session = NULL;
+        nvencbroker_ticket_free(xcontext->ticket);
+        xcontext->ticket = NULL;
+
+        if (xcontext->mode == NVIMAGE_CAPTURE_CUDA) {
+                nvidia.ctxDestroy(xcontext->cuctx);
+                xcontext->cuctx = NULL;
+        } else {
+                glXMakeCurrent(xcontext->disp, 0, NULL);
+                glXDestroyPixmap(xcontext->disp, xcontext->glxpixmap);
+                XFreePixmap(xcontext->disp, xcontext->pixmap);
+                glXDestroyContext(xcontext->disp, xcontext->glxctx);
+        }
         XCloseDisplay (xcontext->disp);
 }
 
+/* Capture session and encoder */
 static gboolean
 nvimageutil_fbccontext_get(GstXContext *xcontext)
+{
+        return nvimageutil_capture_get(xcontext) && nvimageutil_encoder_get(xcontext);
+}
+
+/* Logs why NvFBC cannot capture and drops the handle created so far, the
+   capture session goes with it */
+static gboolean
+nvimageutil_capture_fail(GstXContext *xcontext, const gchar *what, NVFBCSTATUS fbcStatus)
+{
+        NVFBC_DESTROY_HANDLE_PARAMS destroyHandleParams;
+
+        GST_ERROR (what, fbcStatus);
+
+        if (xcontext->fbcHandle) {
+                memset(&destroyHandleParams, 0, sizeof(destroyHandleParams));
+                destroyHandleParams.dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER;
+                xcontext->pFn.nvFBCDestroyHandle(xcontext->fbcHandle, &destroyHandleParams);
+        }
+        memset(&xcontext->pFn, 0, sizeof(xcontext->pFn));
+        xcontext->fbcHandle = 0;
+
+        return FALSE;
+}
+
+static gboolean
+nvimageutil_capture_get(GstXContext *xcontext)
 {
         NVFBCSTATUS                             fbcStatus;
         NVFBC_CREATE_HANDLE_PARAMS              createHandleParams;
         NVFBC_GET_STATUS_PARAMS                 statusParams;
         NVFBC_SIZE                              frameSize = { 0, 0};
         NVFBC_CREATE_CAPTURE_SESSION_PARAMS     createCaptureParams;
-        NVENCSTATUS                             encStatus;
-        NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS    encodeSessionParams;
-        GUID                                    encodeGuid;
-        NV_ENC_PRESET_CONFIG                    presetConfig;
-        NV_ENC_INITIALIZE_PARAMS                initParams;
-        NV_ENC_CREATE_BITSTREAM_BUFFER          bitstreamBufferParams;
+        NVFBC_BUFFER_FORMAT                     bufferFormat;
+        gboolean                                raw = xcontext->config.raw_format != GST_VIDEO_FORMAT_UNKNOWN;
 
 
         xcontext->pFn.dwVersion = NVFBC_VERSION;
 
-        fbcStatus = NvFBCCreateInstance(&xcontext->pFn);
+        fbcStatus = nvidia.fbcCreateInstance(&xcontext->pFn);
         if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot create FBC instance %d", fbcStatus);
-                return FALSE;
+                return nvimageutil_capture_fail (xcontext, "Cannot create FBC instance %d", fbcStatus);
         }
 
         memset(&createHandleParams, 0, sizeof(createHandleParams));
 
         createHandleParams.dwVersion                 = NVFBC_CREATE_HANDLE_PARAMS_VER;
-        createHandleParams.bExternallyManagedContext = NVFBC_TRUE;
-        createHandleParams.glxCtx                    = xcontext->glxctx;
-        createHandleParams.glxFBConfig               = xcontext->fbconfig;
+        if (xcontext->mode == NVIMAGE_CAPTURE_GL) {
+                createHandleParams.bExternallyManagedContext = NVFBC_TRUE;
+                createHandleParams.glxCtx                    = xcontext->glxctx;
+                createHandleParams.glxFBConfig               = xcontext->fbconfig;
+        }
 
         fbcStatus = xcontext->pFn.nvFBCCreateHandle(&xcontext->fbcHandle, &createHandleParams);
         if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot create FBC handle %d", fbcStatus);
-                return FALSE;
+                return nvimageutil_capture_fail (xcontext, "Cannot create FBC handle %d", fbcStatus);
         }
 
         memset(&statusParams, 0, sizeof(statusParams));
@@ -370,8 +835,7 @@ nvimageutil_fbccontext_get(GstXContext *xcontext)
 
         fbcStatus = xcontext->pFn.nvFBCGetStatus(xcontext->fbcHandle, &statusParams);
         if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot get FBC status %d", fbcStatus);
-                return FALSE;
+                return nvimageutil_capture_fail (xcontext, "Cannot get FBC status %d", fbcStatus);
         }
 
         frameSize.w = statusParams.screenSize.w;
@@ -384,97 +848,328 @@ nvimageutil_fbccontext_get(GstXContext *xcontext)
         memset(&createCaptureParams, 0, sizeof(createCaptureParams));
 
         createCaptureParams.dwVersion                   = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER;
-        createCaptureParams.eCaptureType                = NVFBC_CAPTURE_TO_GL;
+        if (xcontext->mode == NVIMAGE_CAPTURE_CUDA)
+                createCaptureParams.eCaptureType        = NVFBC_CAPTURE_SHARED_CUDA;
+        else if (raw)
+                createCaptureParams.eCaptureType        = NVFBC_CAPTURE_TO_SYS;
+        else
+                createCaptureParams.eCaptureType        = NVFBC_CAPTURE_TO_GL;
         createCaptureParams.bWithCursor                 = xcontext->show_pointer;
         createCaptureParams.frameSize                   = frameSize;
         createCaptureParams.eTrackingType               = NVFBC_TRACKING_SCREEN;
         createCaptureParams.bDisableAutoModesetRecovery = NVFBC_TRUE;
+        /* Frames as the applications present them instead of sampled every
+           16 ms, a fullscreen one is copied straight from its swapchain
+           unless the pointer has to be drawn in */
+        if (xcontext->config.high_refresh) {
+                createCaptureParams.bPushModel          = NVFBC_TRUE;
+                createCaptureParams.bAllowDirectCapture = xcontext->show_pointer ? NVFBC_FALSE : NVFBC_TRUE;
+        }
 
         fbcStatus = xcontext->pFn.nvFBCCreateCaptureSession(xcontext->fbcHandle, &createCaptureParams);
         
         if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot create FBC session %d", fbcStatus);
-                return FALSE;
+                return nvimageutil_capture_fail (xcontext, "Cannot create FBC session %d", fbcStatus);
+        }
+
+        /* NvFBC converts on the GPU, BGRA is its native format */
+        if (xcontext->config.raw_format == GST_VIDEO_FORMAT_BGRx)
+                bufferFormat = NVFBC_BUFFER_FORMAT_BGRA;
+        else if (xcontext->config.yuv444)
+                bufferFormat = NVFBC_BUFFER_FORMAT_YUV444P;
+        else
+                bufferFormat = NVFBC_BUFFER_FORMAT_NV12;
+
+        if (xcontext->mode == NVIMAGE_CAPTURE_CUDA) {
+                NVFBC_TOCUDA_SETUP_PARAMS cudaSetupParams;
+
+                memset(&cudaSetupParams, 0, sizeof(cudaSetupParams));
+                cudaSetupParams.dwVersion     = NVFBC_TOCUDA_SETUP_PARAMS_VER;
+                cudaSetupParams.eBufferFormat = bufferFormat;
+
+                fbcStatus = xcontext->pFn.nvFBCToCudaSetUp(xcontext->fbcHandle, &cudaSetupParams);
+                if (fbcStatus != NVFBC_SUCCESS) {
+                        return nvimageutil_capture_fail (xcontext, "Cannot setup FBC CUDA %d", fbcStatus);
+                }
+                return TRUE;
+        }
+
+        if (raw) {
+                NVFBC_TOSYS_SETUP_PARAMS sysSetupParams;
+
+                memset(&sysSetupParams, 0, sizeof(sysSetupParams));
+                sysSetupParams.dwVersion     = NVFBC_TOSYS_SETUP_PARAMS_VER;
+                sysSetupParams.eBufferFormat = bufferFormat;
+                sysSetupParams.ppBuffer      = &xcontext->sysBuffer;
+                /* NvFBC only diffs RGB formats */
+                if (xcontext->config.diff_map_block && bufferFormat == NVFBC_BUFFER_FORMAT_BGRA) {
+                        sysSetupParams.bWithDiffMap           = NVFBC_TRUE;
+                        sysSetupParams.ppDiffMap              = (void **) &xcontext->diffMap;
+                        sysSetupParams.dwDiffMapScalingFactor = xcontext->config.diff_map_block;
+                }
+
+                fbcStatus = xcontext->pFn.nvFBCToSysSetUp(xcontext->fbcHandle, &sysSetupParams);
+                if (fbcStatus != NVFBC_SUCCESS) {
+                        return nvimageutil_capture_fail (xcontext, "Cannot setup FBC system memory %d", fbcStatus);
+                }
+                xcontext->diffMapSize = sysSetupParams.diffMapSize;
+                return TRUE;
         }
 
         xcontext->setupParams.dwVersion     = NVFBC_TOGL_SETUP_PARAMS_VER;
-        xcontext->setupParams.eBufferFormat = NVFBC_BUFFER_FORMAT_NV12;
+        xcontext->setupParams.eBufferFormat = bufferFormat;
 
         fbcStatus = xcontext->pFn.nvFBCToGLSetUp(xcontext->fbcHandle, &xcontext->setupParams);
         if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot setup FBC GL %d", fbcStatus);
-                return FALSE;
+                return nvimageutil_capture_fail (xcontext, "Cannot setup FBC GL %d", fbcStatus);
         }
 
-        xcontext->pEncFn.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+        return TRUE;
+}
 
-        encStatus = NvEncodeAPICreateInstance(&xcontext->pEncFn);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot create NVENC instance %d", encStatus);
-                return FALSE;
-        }
+/* NVENC session on the device of the capture, opened the same way for
+   encoding and for probing */
+static NVENCSTATUS
+nvimageutil_encoder_open(GstXContext *xcontext, NV_ENCODE_API_FUNCTION_LIST *encFn, void **encoder)
+{
+        NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS    encodeSessionParams;
+        NVENCSTATUS                             encStatus;
+
+        encFn->version = NV_ENCODE_API_FUNCTION_LIST_VER;
+
+        encStatus = nvidia.encCreateInstance(encFn);
+        if (encStatus != NV_ENC_SUCCESS)
+                return encStatus;
 
         memset(&encodeSessionParams, 0, sizeof(encodeSessionParams));
 
         encodeSessionParams.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
         encodeSessionParams.apiVersion = NVENCAPI_VERSION;
-        encodeSessionParams.deviceType = NV_ENC_DEVICE_TYPE_OPENGL;
-
-        encStatus = xcontext->pEncFn.nvEncOpenEncodeSessionEx(&encodeSessionParams, &xcontext->encoder);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot open NVENC session %d", encStatus);
-                return FALSE;
+        if (xcontext->mode == NVIMAGE_CAPTURE_CUDA) {
+                encodeSessionParams.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+                encodeSessionParams.device = xcontext->cuctx;
+        } else {
+                encodeSessionParams.deviceType = NV_ENC_DEVICE_TYPE_OPENGL;
         }
 
-        encodeGuid = NV_ENC_CODEC_HEVC_GUID;
+        return encFn->nvEncOpenEncodeSessionEx(&encodeSessionParams, encoder);
+}
 
-        memset(&presetConfig, 0, sizeof(presetConfig));
+/* Whether NVENC can encode 4:4:4, not all GPUs have it. With a broker
+   the probe session needs a slot like any other. It does not queue for
+   one, a GPU whose slots are all taken reads as no 4:4:4. */
+static gboolean
+nvimageutil_encoder_probe_yuv444(GstXContext *xcontext, guint max_sessions)
+{
+        NV_ENCODE_API_FUNCTION_LIST     encFn;
+        NV_ENC_CAPS_PARAM               capsParams;
+        NvEncBrokerLease                *lease = NULL;
+        NvEncBrokerTicket               *ticket = NULL;
+        void                            *encoder = NULL;
+        int                             supported = 0;
+
+        if (max_sessions) {
+                lease = nvencbroker_poll (xcontext->gpu, max_sessions, &ticket);
+                nvencbroker_ticket_free (ticket);
+                if (!lease) {
+                        GST_INFO ("No NVENC session free on GPU %d to probe 4:4:4", xcontext->gpu);
+                        return FALSE;
+                }
+        }
 
-        presetConfig.version = NV_ENC_PRESET_CONFIG_VER;
-        presetConfig.presetCfg.version = NV_ENC_CONFIG_VER;
-        encStatus = xcontext->pEncFn.nvEncGetEncodePresetConfig(xcontext->encoder,
-                                                  encodeGuid,
-                                                  NV_ENC_PRESET_LOW_LATENCY_HQ_GUID,
-                                                  &presetConfig);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot get NVENC preset config %d", encStatus);
+        memset(&encFn, 0, sizeof(encFn));
+        if (nvimageutil_encoder_open(xcontext, &encFn, &encoder) != NV_ENC_SUCCESS) {
+                nvencbroker_release (lease);
                 return FALSE;
         }
 
-        presetConfig.presetCfg.rcParams.averageBitRate   = xcontext->bitrate;
-        presetConfig.presetCfg.rcParams.maxBitRate       = xcontext->bitrate;
-        presetConfig.presetCfg.rcParams.vbvBufferSize    = 0;
-        presetConfig.presetCfg.rcParams.rateControlMode  = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
-        presetConfig.presetCfg.rcParams.zeroReorderDelay = 1;
-        presetConfig.presetCfg.profileGUID               = NV_ENC_HEVC_PROFILE_MAIN_GUID;
-        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.repeatSPSPPS           = 0;
-        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.outputAUD              = 1;
-        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.outputPictureTimingSEI = 1;
-        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.chromaFormatIDC        = 1;
-        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.level                  = NV_ENC_LEVEL_AUTOSELECT;
-        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.idrPeriod              = 0;
-	presetConfig.presetCfg.gopLength 					   = NVENC_INFINITE_GOPLENGTH;
+        memset(&capsParams, 0, sizeof(capsParams));
+        capsParams.version = NV_ENC_CAPS_PARAM_VER;
+        capsParams.capsToQuery = NV_ENC_CAPS_SUPPORT_YUV444_ENCODE;
 
-	memset(&initParams, 0, sizeof(initParams));
-        initParams.version = NV_ENC_INITIALIZE_PARAMS_VER;
-        initParams.encodeGUID = encodeGuid;
-        initParams.presetGUID = NV_ENC_PRESET_LOW_LATENCY_HQ_GUID;
-        initParams.encodeConfig = &presetConfig.presetCfg;
-        initParams.encodeWidth = frameSize.w;
-        initParams.encodeHeight = frameSize.h;
-        initParams.frameRateNum = xcontext->fps_n;
-        initParams.frameRateDen = xcontext->fps_d;
-        initParams.enablePTD = 1;
+        if (encFn.nvEncGetEncodeCaps(encoder, NV_ENC_CODEC_HEVC_GUID, &capsParams, &supported) != NV_ENC_SUCCESS)
+                supported = 0;
 
-        encStatus = xcontext->pEncFn.nvEncInitializeEncoder(xcontext->encoder, &initParams);
+        encFn.nvEncDestroyEncoder(encoder);
+        nvencbroker_release (lease);
+
+        return supported != 0;
+}
+
+/* Rate control and frame rate of the content profile. Motion gets the
+   two pass rate control and spatial AQ, which would blur text. Lookahead
+   would need a new session and adds latency, it stays off in both. */
+static void
+nvimageutil_encoder_content(GstXContext *xcontext, NV_ENC_INITIALIZE_PARAMS *initParams, NV_ENC_CONFIG *encodeConfig)
+{
+        gboolean motion = xcontext->content == NVIMAGE_CONTENT_MOTION;
+
+        encodeConfig->rcParams.rateControlMode = motion ? NV_ENC_PARAMS_RC_CBR_HQ : NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
+        encodeConfig->rcParams.enableAQ        = motion;
+        encodeConfig->rcParams.aqStrength      = 0;
+
+        if (!motion && xcontext->config.content_adaptive && xcontext->config.text_fps) {
+                initParams->frameRateNum = xcontext->config.text_fps;
+                initParams->frameRateDen = 1;
+        } else {
+                initParams->frameRateNum = xcontext->fps_n;
+                initParams->frameRateDen = xcontext->fps_d;
+        }
+}
+
+/* Classifies the content from the damaged share of the screen, the share
+   of redrawn frames and the size of the encoded frames against the frame
+   budget, each averaged over about 16 frames. Motion needs all three to be
+   high, text either of the first two to be low, and a profile is kept for
+   NVIMAGEUTIL_CONTENT_HOLD at least. Returns TRUE if the profile changed. */
+static gboolean
+nvimageutil_content_update(GstXContext *xcontext, gboolean newFrame, guint size)
+{
+        gdouble budget = MAX(xcontext->bitrate / 8.0 * xcontext->initParams.frameRateDen /
+                             xcontext->initParams.frameRateNum, 1.0);
+        gdouble area = nvimageutil_damage_area(xcontext);
+        gint64 now = g_get_monotonic_time();
+        gint content = xcontext->content;
+
+        /* Without XDamage a redraw counts as a full screen change */
+        if (area < 0)
+                area = newFrame ? 1.0 : 0.0;
+
+        xcontext->damageArea += (area - xcontext->damageArea) / 16;
+        xcontext->changeRate += ((newFrame ? 1.0 : 0.0) - xcontext->changeRate) / 16;
+        xcontext->bitsRatio  += (MIN(size / budget, 2.0) - xcontext->bitsRatio) / 16;
+
+        if (now - xcontext->contentSince < NVIMAGEUTIL_CONTENT_HOLD)
+                return FALSE;
+
+        if (content == NVIMAGE_CONTENT_TEXT &&
+            xcontext->changeRate > 0.7 && xcontext->damageArea > 0.05 && xcontext->bitsRatio > 0.5)
+                content = NVIMAGE_CONTENT_MOTION;
+        else if (content == NVIMAGE_CONTENT_MOTION &&
+                 (xcontext->changeRate < 0.3 || xcontext->damageArea < 0.02))
+                content = NVIMAGE_CONTENT_TEXT;
+
+        if (content == xcontext->content)
+                return FALSE;
+
+        xcontext->content = content;
+        xcontext->contentSince = now;
+        return TRUE;
+}
+
+/* NVENC reads the textures and buffers in the format NvFBC captures to */
+static NV_ENC_BUFFER_FORMAT
+nvimageutil_encoder_input_format(GstXContext *xcontext)
+{
+        return xcontext->config.yuv444 ? NV_ENC_BUFFER_FORMAT_YUV444 : NV_ENC_BUFFER_FORMAT_NV12;
+}
+
+/* Opens the NVENC session for the textures of the capture session, the
+   CUDA buffer is registered with the first grab. With
+   max_sessions set the session is only opened once the broker grants a
+   slot, FALSE without an error means the source is queued for one and
+   asks again with the next frame. */
+static gboolean
+nvimageutil_encoder_get(GstXContext *xcontext)
+{
+        NVFBC_SIZE                              frameSize = { xcontext->width, xcontext->height };
+        NVENCSTATUS                             encStatus;
+        GUID                                    encodeGuid;
+        NV_ENC_PRESET_CONFIG                    presetConfig;
+        NV_ENC_INITIALIZE_PARAMS                initParams;
+        NV_ENC_CREATE_BITSTREAM_BUFFER          bitstreamBufferParams;
+
+        if (xcontext->config.max_sessions) {
+                xcontext->lease = nvencbroker_poll (xcontext->gpu, xcontext->config.max_sessions, &xcontext->ticket);
+                if (!xcontext->lease)
+                        return FALSE;
+        }
+
+        encStatus = nvimageutil_encoder_open(xcontext, &xcontext->pEncFn, &xcontext->encoder);
+        if (encStatus != NV_ENC_SUCCESS) {
+                GST_ERROR ("Cannot open NVENC session %d", encStatus);
+                return FALSE;
+        }
+
+        encodeGuid = NV_ENC_CODEC_HEVC_GUID;
+
+        memset(&presetConfig, 0, sizeof(presetConfig));
+
+        presetConfig.version = NV_ENC_PRESET_CONFIG_VER;
+        presetConfig.presetCfg.version = NV_ENC_CONFIG_VER;
+        encStatus = xcontext->pEncFn.nvEncGetEncodePresetConfig(xcontext->encoder,
+                                                  encodeGuid,
+                                                  NV_ENC_PRESET_LOW_LATENCY_HQ_GUID,
+                                                  &presetConfig);
         if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot initialize NVENC encoder %d", encStatus);
+                GST_ERROR ("Cannot get NVENC preset config %d", encStatus);
                 return FALSE;
         }
 
+        presetConfig.presetCfg.rcParams.averageBitRate   = xcontext->bitrate;
+        presetConfig.presetCfg.rcParams.maxBitRate       = xcontext->bitrate;
+        presetConfig.presetCfg.rcParams.vbvBufferSize    = 0;
+        if (xcontext->config.max_frame_size) {
+                /* A VBV of one frame makes the rate control keep every frame,
+                   IDRs included, below the bound */
+                presetConfig.presetCfg.rcParams.vbvBufferSize  = xcontext->config.max_frame_size * 8;
+                presetConfig.presetCfg.rcParams.vbvInitialDelay = xcontext->config.max_frame_size * 8;
+        }
+        if (xcontext->config.max_qp) {
+                presetConfig.presetCfg.rcParams.enableMaxQP      = 1;
+                presetConfig.presetCfg.rcParams.maxQP.qpInterP   = xcontext->config.max_qp;
+                presetConfig.presetCfg.rcParams.maxQP.qpInterB   = xcontext->config.max_qp;
+                presetConfig.presetCfg.rcParams.maxQP.qpIntra    = xcontext->config.max_qp;
+        }
+        presetConfig.presetCfg.rcParams.zeroReorderDelay = 1;
+        presetConfig.presetCfg.profileGUID               = xcontext->config.yuv444 ?
+                                                           NV_ENC_HEVC_PROFILE_FREXT_GUID :
+                                                           NV_ENC_HEVC_PROFILE_MAIN_GUID;
+        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.repeatSPSPPS           = 1;
+        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.outputAUD              = 1;
+        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.outputPictureTimingSEI = 1;
+        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.chromaFormatIDC        = xcontext->config.yuv444 ? 3 : 1;
+        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.level                  = NV_ENC_LEVEL_AUTOSELECT;
+        presetConfig.presetCfg.encodeCodecConfig.hevcConfig.idrPeriod              = 0;
+	presetConfig.presetCfg.gopLength 					   = NVENC_INFINITE_GOPLENGTH;
+        if (xcontext->config.slice_size) {
+                /* sliceMode 1 = slices of at most sliceModeData bytes */
+                presetConfig.presetCfg.encodeCodecConfig.hevcConfig.sliceMode     = 1;
+                presetConfig.presetCfg.encodeCodecConfig.hevcConfig.sliceModeData = xcontext->config.slice_size;
+        }
+
+	memset(&initParams, 0, sizeof(initParams));
+        initParams.version = NV_ENC_INITIALIZE_PARAMS_VER;
+        initParams.encodeGUID = encodeGuid;
+        initParams.presetGUID = NV_ENC_PRESET_LOW_LATENCY_HQ_GUID;
+        initParams.encodeConfig = &presetConfig.presetCfg;
+        initParams.encodeWidth = frameSize.w;
+        initParams.encodeHeight = frameSize.h;
+        xcontext->content = NVIMAGE_CONTENT_TEXT;
+        xcontext->contentSince = g_get_monotonic_time();
+        xcontext->damageArea = xcontext->changeRate = xcontext->bitsRatio = 0.0;
+        nvimageutil_encoder_content(xcontext, &initParams, &presetConfig.presetCfg);
+        initParams.enablePTD = 1;
+        initParams.reportSliceOffsets = 1;
+
+        encStatus = xcontext->pEncFn.nvEncInitializeEncoder(xcontext->encoder, &initParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                GST_ERROR ("Cannot initialize NVENC encoder %d", encStatus);
+                return FALSE;
+        }
+
+        xcontext->encodeConfig = presetConfig.presetCfg;
+        xcontext->initParams = initParams;
+        xcontext->initParams.encodeConfig = &xcontext->encodeConfig;
+
+        xcontext->lastChange = g_get_monotonic_time();
+        xcontext->lastQP = 0;
+        xcontext->refineQP = 0;
+        xcontext->refineWait = 0;
+
         xcontext->mapParams.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
 
-        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX && xcontext->mode == NVIMAGE_CAPTURE_GL; i++) {
                 NV_ENC_REGISTER_RESOURCE         registerParams;
                 NV_ENC_INPUT_RESOURCE_OPENGL_TEX texParams;
 
@@ -493,11 +1188,11 @@ nvimageutil_fbccontext_get(GstXContext *xcontext)
                 registerParams.height = frameSize.h;
                 registerParams.pitch = frameSize.w;
                 registerParams.resourceToRegister = &texParams;
-                registerParams.bufferFormat = NV_ENC_BUFFER_FORMAT_NV12;
+                registerParams.bufferFormat = nvimageutil_encoder_input_format(xcontext);
 
                 encStatus = xcontext->pEncFn.nvEncRegisterResource(xcontext->encoder, &registerParams);
                 if (encStatus != NV_ENC_SUCCESS) {
-                        g_error ("Cannot register NVENC resource %d", encStatus);
+                        GST_ERROR ("Cannot register NVENC resource %d", encStatus);
                         return FALSE;
                 }
 
@@ -509,12 +1204,15 @@ nvimageutil_fbccontext_get(GstXContext *xcontext)
 
         encStatus = xcontext->pEncFn.nvEncCreateBitstreamBuffer(xcontext->encoder, &bitstreamBufferParams);
         if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot create NVENC bitstream buffer %d", encStatus);
+                GST_ERROR ("Cannot create NVENC bitstream buffer %d", encStatus);
                 return FALSE;
         }
 
         xcontext->outputBuffer = bitstreamBufferParams.bitstreamBuffer;
 
+        /* Slice offsets are reported per MB, size the array for the whole frame */
+        xcontext->sliceOffsets = g_new0 (uint32_t, ((frameSize.w + 15) / 16) * ((frameSize.h + 15) / 16));
+
         xcontext->encParams.version = NV_ENC_PIC_PARAMS_VER;
         xcontext->encParams.inputWidth = frameSize.w;
         xcontext->encParams.inputHeight = frameSize.h;
@@ -530,41 +1228,75 @@ nvimageutil_fbccontext_get(GstXContext *xcontext)
 
 static gboolean
 nvimageutil_fbccontext_clear(GstXContext *xcontext) {
-        NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroyCaptureParams;
-        NVFBC_DESTROY_HANDLE_PARAMS          destroyHandleParams;
-        NVFBCSTATUS                          fbcStatus;
+        return nvimageutil_encoder_clear(xcontext) && nvimageutil_capture_clear(xcontext);
+}
+
+/* Closes the NVENC session and gives its broker slot back */
+static gboolean
+nvimageutil_encoder_clear(GstXContext *xcontext) {
         NVENCSTATUS                          encStatus;
 
+        if (!xcontext->encoder)
+                goto release;
+
+        /* A picture still in flight is dropped, its input is unmapped */
+        if (xcontext->pending) {
+                xcontext->pEncFn.nvEncUnmapInputResource(xcontext->encoder, xcontext->pendingInput);
+                xcontext->pending = FALSE;
+                xcontext->pendingInput = NULL;
+                xcontext->pendingForced = FALSE;
+        }
+
         if (xcontext->outputBuffer != NULL) {
                 encStatus = xcontext->pEncFn.nvEncDestroyBitstreamBuffer(xcontext->encoder, xcontext->outputBuffer);
-                if (encStatus != NV_ENC_SUCCESS) {
-                        g_error("Cannot destroy bitstream buffer %d", encStatus);
-                        return FALSE;
-                }
+                if (encStatus != NV_ENC_SUCCESS)
+                        GST_WARNING ("Cannot destroy bitstream buffer %d", encStatus);
         }
         for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
                 if (xcontext->registeredResources[i]) {
                         encStatus = xcontext->pEncFn.nvEncUnregisterResource(xcontext->encoder, xcontext->registeredResources[i]);
-                        if (encStatus != NV_ENC_SUCCESS) {
-                                g_error("Cannot unregister resource %d", encStatus);
-                                return FALSE;
-                        }
+                        if (encStatus != NV_ENC_SUCCESS)
+                                GST_WARNING ("Cannot unregister resource %d", encStatus);
                         xcontext->registeredResources[i] = NULL;
                 }
         }
         encStatus = xcontext->pEncFn.nvEncDestroyEncoder(xcontext->encoder);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error("Cannot destroy encoder %d", encStatus);
-                return FALSE;
-        }
+        if (encStatus != NV_ENC_SUCCESS)
+                GST_WARNING ("Cannot destroy encoder %d", encStatus);
+
+        g_free(xcontext->sliceOffsets);
+        xcontext->sliceOffsets = NULL;
+
+        xcontext->cudaBuffer = 0;
+        xcontext->outputBuffer = NULL;
+        memset(&xcontext->pEncFn, 0, sizeof(xcontext->pEncFn));
+        xcontext->encoder = 0;
+        memset(&xcontext->mapParams, 0, sizeof(xcontext->mapParams));
+        memset(&xcontext->encParams, 0, sizeof(xcontext->encParams));
+        memset(&xcontext->initParams, 0, sizeof(xcontext->initParams));
+        memset(&xcontext->encodeConfig, 0, sizeof(xcontext->encodeConfig));
+
+release:
+        nvencbroker_release(xcontext->lease);
+        xcontext->lease = NULL;
+        return TRUE;
+}
+
+static gboolean
+nvimageutil_capture_clear(GstXContext *xcontext) {
+        NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroyCaptureParams;
+        NVFBC_DESTROY_HANDLE_PARAMS          destroyHandleParams;
+        NVFBCSTATUS                          fbcStatus;
+
+        /* NvFBC never started or failed to */
+        if (!xcontext->fbcHandle)
+                return TRUE;
 
         memset(&destroyCaptureParams, 0, sizeof(destroyCaptureParams));
         destroyCaptureParams.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER;
         fbcStatus = xcontext->pFn.nvFBCDestroyCaptureSession(xcontext->fbcHandle, &destroyCaptureParams);
-        if (fbcStatus != NVFBC_SUCCESS) {
-                g_error("Cannot destroy capture session %d", fbcStatus);
-                return FALSE;
-        }
+        if (fbcStatus != NVFBC_SUCCESS)
+                GST_WARNING ("Cannot destroy capture session %d", fbcStatus);
 
         memset(&destroyHandleParams, 0, sizeof(destroyHandleParams));
         destroyHandleParams.dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER;
@@ -579,14 +1311,200 @@ nvimageutil_fbccontext_clear(GstXContext *xcontext) {
 
         memset(&xcontext->pFn, 0, sizeof(xcontext->pFn));
         xcontext->fbcHandle = 0;
-        memset(&xcontext->pEncFn, 0, sizeof(xcontext->pEncFn));
-        xcontext->encoder = 0;
-        memset(&xcontext->mapParams, 0, sizeof(xcontext->mapParams));
-        memset(&xcontext->encParams, 0, sizeof(xcontext->encParams));
         memset(&xcontext->setupParams, 0, sizeof(xcontext->setupParams));
+        xcontext->sysBuffer = NULL;
+        xcontext->diffMap = NULL;
+        memset(&xcontext->diffMapSize, 0, sizeof(xcontext->diffMapSize));
+        return TRUE;
+}
+
+/* Applies encodeConfig to the running session without touching the
+   capture session, the rate control keeps its state and no IDR is forced. */
+static NVENCSTATUS
+nvimageutil_encoder_reconfigure(GstXContext *xcontext) {
+        NV_ENC_RECONFIGURE_PARAMS reconfigureParams;
+
+        memset(&reconfigureParams, 0, sizeof(reconfigureParams));
+        reconfigureParams.version            = NV_ENC_RECONFIGURE_PARAMS_VER;
+        reconfigureParams.reInitEncodeParams = xcontext->initParams;
+
+        return xcontext->pEncFn.nvEncReconfigureEncoder(xcontext->encoder, &reconfigureParams);
+}
+
+/* Changes the target bitrate and the frame rate of the running session.
+   The capture does not depend on either, so no new session and no IDR
+   is needed. */
+static gboolean
+nvimageutil_encoder_set_rate(GstXContext *xcontext, guint bitrate, guint fps_n, guint fps_d) {
+        guint                     old_fps_n = xcontext->fps_n;
+        guint                     old_fps_d = xcontext->fps_d;
+        NVENCSTATUS               encStatus;
+
+        if (!xcontext->encoder || !xcontext->initParams.encodeConfig)
+                return FALSE;
+
+        xcontext->encodeConfig.rcParams.averageBitRate = bitrate;
+        xcontext->encodeConfig.rcParams.maxBitRate     = bitrate;
+        xcontext->fps_n = fps_n;
+        xcontext->fps_d = fps_d;
+        nvimageutil_encoder_content(xcontext, &xcontext->initParams, &xcontext->encodeConfig);
+
+        encStatus = nvimageutil_encoder_reconfigure(xcontext);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning ("Cannot reconfigure NVENC to %u bps at %f fps: %d",
+                           bitrate, ((double)fps_n)/fps_d, encStatus);
+                /* The session is recreated with the new rate instead */
+                xcontext->fps_n = old_fps_n;
+                xcontext->fps_d = old_fps_d;
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Switches the session to a constant QP for a refinement frame, 0 goes
+   back to the rate control of the content profile */
+static gboolean
+nvimageutil_encoder_set_qp(GstXContext *xcontext, guint qp) {
+        NV_ENC_RC_PARAMS *rc = &xcontext->encodeConfig.rcParams;
+        NVENCSTATUS      encStatus;
+
+        if (qp) {
+                rc->rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
+                rc->constQP.qpInterP = qp;
+                rc->constQP.qpInterB = qp;
+                rc->constQP.qpIntra  = qp;
+        } else {
+                nvimageutil_encoder_content(xcontext, &xcontext->initParams, &xcontext->encodeConfig);
+        }
+
+        encStatus = nvimageutil_encoder_reconfigure(xcontext);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning ("Cannot reconfigure NVENC to QP %u: %d", qp, encStatus);
+                return FALSE;
+        }
+
         return TRUE;
 }
 
+/* QP to re-encode an unchanged screen at, 0 = leave it to the rate control.
+   Under CBR a still screen stays at the quality of its last change. Once
+   it has been still for refine_delay ms every step lowers the QP by
+   NVIMAGEUTIL_REFINE_STEP until refine_qp is reached and the encoder goes
+   quiet again. A step is only taken once the previous one has been paid
+   for out of the per frame budget the skipped frames leave unused. */
+static guint
+nvimageutil_refine_qp(GstXContext *xcontext, gboolean newFrame, gint forcekeyframe) {
+        guint start;
+
+        if (newFrame) {
+                xcontext->lastChange = g_get_monotonic_time();
+                xcontext->refineQP = 0;
+                xcontext->refineWait = 0;
+                return 0;
+        }
+
+        if (!xcontext->config.refine_qp || forcekeyframe || !xcontext->lastQP ||
+            g_get_monotonic_time() - xcontext->lastChange < xcontext->config.refine_delay * G_TIME_SPAN_MILLISECOND)
+                return 0;
+
+        if (xcontext->refineWait) {
+                xcontext->refineWait--;
+                return 0;
+        }
+
+        start = xcontext->refineQP ? xcontext->refineQP : xcontext->lastQP;
+        if (start <= xcontext->config.refine_qp)
+                return 0;
+
+        return MAX(start - MIN(start, NVIMAGEUTIL_REFINE_STEP), xcontext->config.refine_qp);
+}
+
+/* In high refresh mode a grab waits this long for the next presented
+   frame before it returns the last one, half a frame interval */
+static uint32_t
+nvimageutil_grab_timeout(GstXContext *xcontext) {
+        return MAX(500 * xcontext->fps_d / xcontext->fps_n, 1);
+}
+
+/* Grabs the next frame and returns the NVENC resource holding it and
+   whether the screen was redrawn since the last grab */
+static NVFBCSTATUS
+nvimageutil_grab(GstXContext *xcontext, NV_ENC_REGISTERED_PTR *resource, gboolean *newFrame) {
+        NVFBC_TOGL_GRAB_FRAME_PARAMS   glGrabParams;
+        NVFBC_TOCUDA_GRAB_FRAME_PARAMS cudaGrabParams;
+        NVFBC_FRAME_GRAB_INFO          frameInfo;
+        NV_ENC_REGISTER_RESOURCE       registerParams;
+        CUdeviceptr                    cudaBuffer = 0;
+        NVFBCSTATUS                    fbcStatus;
+        NVENCSTATUS                    encStatus;
+
+        if (xcontext->mode == NVIMAGE_CAPTURE_GL) {
+                memset(&glGrabParams, 0, sizeof(glGrabParams));
+                glGrabParams.dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER;
+                if (xcontext->config.high_refresh) {
+                        glGrabParams.dwFlags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY | NVFBC_TOGL_GRAB_FLAGS_FORCE_REFRESH;
+                        glGrabParams.dwTimeoutMs = nvimageutil_grab_timeout(xcontext);
+                } else {
+                        glGrabParams.dwFlags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT | NVFBC_TOGL_GRAB_FLAGS_FORCE_REFRESH;
+                }
+                glGrabParams.pFrameGrabInfo = &frameInfo;
+
+                fbcStatus = xcontext->pFn.nvFBCToGLGrabFrame(xcontext->fbcHandle, &glGrabParams);
+                if (fbcStatus == NVFBC_SUCCESS) {
+                        *resource = xcontext->registeredResources[glGrabParams.dwTextureIndex];
+                        *newFrame = frameInfo.bIsNewFrame;
+                }
+                return fbcStatus;
+        }
+
+        memset(&cudaGrabParams, 0, sizeof(cudaGrabParams));
+        cudaGrabParams.dwVersion = NVFBC_TOCUDA_GRAB_FRAME_PARAMS_VER;
+        if (xcontext->config.high_refresh) {
+                cudaGrabParams.dwFlags = NVFBC_TOCUDA_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY | NVFBC_TOCUDA_GRAB_FLAGS_FORCE_REFRESH;
+                cudaGrabParams.dwTimeoutMs = nvimageutil_grab_timeout(xcontext);
+        } else {
+                cudaGrabParams.dwFlags = NVFBC_TOCUDA_GRAB_FLAGS_NOWAIT | NVFBC_TOCUDA_GRAB_FLAGS_FORCE_REFRESH;
+        }
+        cudaGrabParams.pCUDADeviceBuffer = &cudaBuffer;
+        cudaGrabParams.pFrameGrabInfo = &frameInfo;
+
+        fbcStatus = xcontext->pFn.nvFBCToCudaGrabFrame(xcontext->fbcHandle, &cudaGrabParams);
+        if (fbcStatus != NVFBC_SUCCESS)
+                return fbcStatus;
+        *newFrame = frameInfo.bIsNewFrame;
+
+        /* NvFBC hands out the same buffer until the capture session is
+           recreated, it is registered once */
+        if (cudaBuffer != xcontext->cudaBuffer) {
+                if (xcontext->registeredResources[0]) {
+                        xcontext->pEncFn.nvEncUnregisterResource(xcontext->encoder, xcontext->registeredResources[0]);
+                        xcontext->registeredResources[0] = NULL;
+                }
+
+                memset(&registerParams, 0, sizeof(registerParams));
+                registerParams.version = NV_ENC_REGISTER_RESOURCE_VER;
+                registerParams.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+                registerParams.width = xcontext->width;
+                registerParams.height = xcontext->height;
+                registerParams.pitch = xcontext->width;
+                registerParams.resourceToRegister = (void *) cudaBuffer;
+                registerParams.bufferFormat = nvimageutil_encoder_input_format(xcontext);
+
+                encStatus = xcontext->pEncFn.nvEncRegisterResource(xcontext->encoder, &registerParams);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        GST_ERROR ("Cannot register NVENC CUDA resource %d", encStatus);
+                        return NVFBC_ERR_CUDA;
+                }
+
+                xcontext->registeredResources[0] = registerParams.registeredResource;
+                xcontext->cudaBuffer = cudaBuffer;
+        }
+
+        *resource = xcontext->registeredResources[0];
+        return NVFBC_SUCCESS;
+}
+
 static gboolean
 gst_nvimagesrc_buffer_dispose (GstBuffer * nvimage)
 {
@@ -611,49 +1529,522 @@ gst_nvimagesrc_buffer_dispose (GstBuffer * nvimage)
         return ret;
 }
 
+/* Attaches the changed blocks of the diff map as "changed" region of
+   interest metas, one per block row spanning its changed blocks, merged
+   with the row above when they line up. Returns the number of changed
+   blocks. */
+static gint
+nvimageutil_add_changed_regions(GstXContext *xcontext, GstBuffer *nvimage, gint width, gint height) {
+        GstVideoRegionOfInterestMeta *roi = NULL;
+        guint block = xcontext->config.diff_map_block;
+        gint changed = 0;
+
+        for (guint y = 0; y < xcontext->diffMapSize.h; y++) {
+                const guint8 *row = xcontext->diffMap + y * xcontext->diffMapSize.w;
+                gint first = -1, last = -1;
+                guint rx, ry, rw, rh;
+
+                for (guint x = 0; x < xcontext->diffMapSize.w; x++) {
+                        if (row[x]) {
+                                if (first < 0)
+                                        first = x;
+                                last = x;
+                                changed++;
+                        }
+                }
+                if (first < 0) {
+                        roi = NULL;
+                        continue;
+                }
+
+                rx = first * block;
+                ry = y * block;
+                rw = MIN ((last + 1) * block, width) - rx;
+                rh = MIN (block, height - ry);
+
+                if (roi && roi->x == rx && roi->w == rw && roi->y + roi->h == ry)
+                        roi->h += rh;
+                else
+                        roi = gst_buffer_add_video_region_of_interest_meta (nvimage, "changed", rx, ry, rw, rh);
+        }
+
+        return changed;
+}
+
+/* Captures a frame in the raw format of the config without encoding it.
+   In CUDA mode it is copied out of video memory, otherwise NvFBC already
+   downloaded it. */
+static GstBuffer *
+nvimageutil_raw_new (GstXContext * xcontext, GstElement * parent)
+{
+        GstBuffer                      *nvimage;
+        GstMetaNVimage                 *meta;
+        NVFBC_FRAME_GRAB_INFO          frameInfo;
+        NVFBC_TOSYS_GRAB_FRAME_PARAMS  sysGrabParams;
+        NVFBC_TOCUDA_GRAB_FRAME_PARAMS cudaGrabParams;
+        CUdeviceptr                    cudaBuffer = 0;
+        NVFBCSTATUS                    fbcStatus;
+        CUresult                       res;
+        gint                           i = 0;
+
+restart:
+        memset(&frameInfo, 0, sizeof(frameInfo));
+        if (xcontext->mode == NVIMAGE_CAPTURE_CUDA) {
+                memset(&cudaGrabParams, 0, sizeof(cudaGrabParams));
+                cudaGrabParams.dwVersion = NVFBC_TOCUDA_GRAB_FRAME_PARAMS_VER;
+                if (xcontext->config.high_refresh) {
+                        cudaGrabParams.dwFlags = NVFBC_TOCUDA_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY | NVFBC_TOCUDA_GRAB_FLAGS_FORCE_REFRESH;
+                        cudaGrabParams.dwTimeoutMs = nvimageutil_grab_timeout(xcontext);
+                } else {
+                        cudaGrabParams.dwFlags = NVFBC_TOCUDA_GRAB_FLAGS_NOWAIT | NVFBC_TOCUDA_GRAB_FLAGS_FORCE_REFRESH;
+                }
+                cudaGrabParams.pCUDADeviceBuffer = &cudaBuffer;
+                cudaGrabParams.pFrameGrabInfo = &frameInfo;
+                fbcStatus = xcontext->pFn.nvFBCToCudaGrabFrame(xcontext->fbcHandle, &cudaGrabParams);
+        } else {
+                memset(&sysGrabParams, 0, sizeof(sysGrabParams));
+                sysGrabParams.dwVersion = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER;
+                if (xcontext->config.high_refresh) {
+                        sysGrabParams.dwFlags = NVFBC_TOSYS_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY | NVFBC_TOSYS_GRAB_FLAGS_FORCE_REFRESH;
+                        sysGrabParams.dwTimeoutMs = nvimageutil_grab_timeout(xcontext);
+                } else {
+                        sysGrabParams.dwFlags = NVFBC_TOSYS_GRAB_FLAGS_NOWAIT | NVFBC_TOSYS_GRAB_FLAGS_FORCE_REFRESH;
+                }
+                sysGrabParams.pFrameGrabInfo = &frameInfo;
+                fbcStatus = xcontext->pFn.nvFBCToSysGrabFrame(xcontext->fbcHandle, &sysGrabParams);
+        }
+
+        if (fbcStatus == NVFBC_ERR_MUST_RECREATE) {
+                g_warning ("Recreating FBC capture, must recreate status.");
+                if (!nvimageutil_capture_clear(xcontext) || !nvimageutil_capture_get(xcontext))
+                        return NULL;
+                if (++i <= 3)
+                        goto restart;
+                return NULL;
+        } else if (fbcStatus != NVFBC_SUCCESS) {
+                GST_ERROR ("Cannot grab frame %d", fbcStatus);
+                return NULL;
+        }
+
+        nvimage = gst_buffer_new ();
+        GST_MINI_OBJECT_CAST (nvimage)->dispose =
+                (GstMiniObjectDisposeFunction) gst_nvimagesrc_buffer_dispose;
+
+        meta = GST_META_NVIMAGE_ADD (nvimage);
+        meta->size = frameInfo.dwByteSize;
+        meta->width = frameInfo.dwWidth;
+        meta->height = frameInfo.dwHeight;
+        meta->data = g_malloc(meta->size);
+
+        if (xcontext->mode == NVIMAGE_CAPTURE_CUDA) {
+                res = nvidia.memcpyDtoH(meta->data, cudaBuffer, meta->size);
+                if (res != CUDA_SUCCESS) {
+                        gst_buffer_unref (nvimage);
+                        GST_ERROR ("Cannot copy frame from the GPU %d", res);
+                        return NULL;
+                }
+        } else {
+                memcpy(meta->data, xcontext->sysBuffer, meta->size);
+        }
+
+        if (xcontext->diffMap)
+                meta->changed_blocks = nvimageutil_add_changed_regions(xcontext, nvimage, meta->width, meta->height);
+
+        gst_buffer_append_memory (nvimage, gst_memory_new_wrapped (GST_MEMORY_FLAG_NO_SHARE, meta->data,
+                                        meta->size, 0, meta->size, NULL, NULL));
+
+        /* Keep a ref to our src */
+        meta->parent = gst_object_ref (parent);
+
+        return nvimage;
+}
+
+/* Converts the rectangle @x, @y, @w, @h of the BGRx screen @src into the
+   YUV frame @dst laid out as @outInfo */
+static void
+nvimageutil_xshm_convert (GstXContext *xcontext, const guint8 *src, guint8 *dst, gint x, gint y, gint w, gint h)
+{
+        GstVideoInfo *info = &xcontext->outInfo;
+        guint8 *planes[GST_VIDEO_MAX_PLANES];
+
+        for (guint i = 0; i < GST_VIDEO_INFO_N_PLANES (info); i++)
+                planes[i] = dst + GST_VIDEO_INFO_PLANE_OFFSET (info, i);
+
+        nvimageconvert_rect (NVIMAGE_CONVERT_AUTO, src, xcontext->width * 4, GST_VIDEO_INFO_FORMAT (info),
+                             planes, info->stride, xcontext->width, xcontext->height, x, y, w, h);
+}
+
+/* Brings the persistent frame up to date, reading only the damaged
+   rectangles of the screen, or all of it the first time and without
+   XDamage. With YUV output the same rectangles are converted into the
+   persistent YUV frame. The rectangles are attached to @nvimage as
+   "changed" regions. Returns their number, -1 if the screen cannot be
+   read. */
+static gint
+nvimageutil_xshm_update (GstXContext *xcontext, GstBuffer *nvimage)
+{
+        Window root = RootWindowOfScreen (xcontext->screen);
+        XRectangle full = { 0, 0, xcontext->width, xcontext->height };
+        XRectangle *rects = &full;
+        gint stride = xcontext->width * 4;
+        gint n = 1;
+
+        if (xcontext->damage) {
+                nvimageutil_damage_fetch (xcontext);
+                if (xcontext->frame_valid)
+                        rects = XFixesFetchRegion (xcontext->disp, xcontext->region, &n);
+        }
+
+        for (gint i = 0; i < n; i++) {
+                gint x = MAX (rects[i].x, 0);
+                gint y = MAX (rects[i].y, 0);
+                gint w = MIN (rects[i].x + rects[i].width, xcontext->width) - x;
+                gint h = MIN (rects[i].y + rects[i].height, xcontext->height) - y;
+                /* The server packs a sub image at the start of the segment */
+                XImage sub = *xcontext->ximage;
+
+                if (w <= 0 || h <= 0)
+                        continue;
+
+                sub.width = w;
+                sub.height = h;
+                sub.bytes_per_line = w * 4;
+                if (!XShmGetImage (xcontext->disp, root, &sub, x, y, AllPlanes)) {
+                        n = -1;
+                        break;
+                }
+
+                for (gint row = 0; row < h; row++)
+                        memcpy (xcontext->frame + (y + row) * stride + x * 4,
+                                xcontext->shminfo.shmaddr + row * w * 4, w * 4);
+
+                if (xcontext->yuv)
+                        nvimageutil_xshm_convert (xcontext, xcontext->frame, xcontext->yuv, x, y, w, h);
+
+                if (rects != &full)
+                        gst_buffer_add_video_region_of_interest_meta (nvimage, "changed", x, y, w, h);
+        }
+
+        if (rects && rects != &full)
+                XFree (rects);
+        if (n >= 0)
+                xcontext->frame_valid = TRUE;
+
+        return n;
+}
+
+/* Blends the pointer into the frame @data, counts a moved or changed
+   pointer as one more change. YUV frames get it through a BGRx copy of
+   the area under it. */
+static void
+nvimageutil_xshm_draw_pointer (GstXContext *xcontext, guint8 *data, gint *changed)
+{
+        XFixesCursorImage *cursor = XFixesGetCursorImage (xcontext->disp);
+        gint stride = xcontext->width * 4;
+        gint x0, y0, x1, y1, cx, cy;
+        guint8 *rgb = data;
+
+        if (!cursor)
+                return;
+
+        if (cursor->x != xcontext->cursor_x || cursor->y != xcontext->cursor_y ||
+            cursor->cursor_serial != xcontext->cursor_serial) {
+                xcontext->cursor_x = cursor->x;
+                xcontext->cursor_y = cursor->y;
+                xcontext->cursor_serial = cursor->cursor_serial;
+                (*changed)++;
+        }
+
+        cx = cursor->x - cursor->xhot;
+        cy = cursor->y - cursor->yhot;
+        x0 = MAX (cx, 0);
+        y0 = MAX (cy, 0);
+        x1 = MIN (cx + cursor->width, xcontext->width);
+        y1 = MIN (cy + cursor->height, xcontext->height);
+        if (x0 >= x1 || y0 >= y1) {
+                XFree (cursor);
+                return;
+        }
+
+        if (xcontext->yuv) {
+                /* The conversion covers whole 2x2 blocks */
+                gint bx0 = x0 & ~1, bx1 = MIN ((x1 + 1) & ~1, xcontext->width);
+
+                if (!xcontext->pointerFrame)
+                        xcontext->pointerFrame = g_malloc (stride * xcontext->height);
+                rgb = xcontext->pointerFrame;
+                for (gint y = y0 & ~1; y < MIN ((y1 + 1) & ~1, xcontext->height); y++)
+                        memcpy (rgb + y * stride + bx0 * 4, xcontext->frame + y * stride + bx0 * 4, (bx1 - bx0) * 4);
+        }
+
+        for (gint y = y0; y < y1; y++) {
+                for (gint x = x0; x < x1; x++) {
+                        /* Premultiplied ARGB */
+                        gulong argb = cursor->pixels[(y - cy) * cursor->width + x - cx];
+                        guint8 *p = rgb + y * stride + x * 4;
+                        guint a = (argb >> 24) & 0xff;
+
+                        p[0] = (argb & 0xff) + p[0] * (255 - a) / 255;
+                        p[1] = ((argb >> 8) & 0xff) + p[1] * (255 - a) / 255;
+                        p[2] = ((argb >> 16) & 0xff) + p[2] * (255 - a) / 255;
+                }
+        }
+
+        if (xcontext->yuv)
+                nvimageutil_xshm_convert (xcontext, rgb, data, x0, y0, x1 - x0, y1 - y0);
+
+        XFree (cursor);
+}
+
+/* Captures a raw frame without a GPU, BGRx as read or converted to NV12
+   or I420 */
+static GstBuffer *
+nvimageutil_xshm_new (GstXContext * xcontext, GstElement * parent)
+{
+        GstVideoFormat format = xcontext->config.raw_format;
+        GstBuffer      *nvimage;
+        GstMetaNVimage *meta;
+        gint           changed;
+
+        if (!nvimageconvert_supports (format))
+                format = GST_VIDEO_FORMAT_BGRx;
+
+        /* Caps changed, everything has to be converted again */
+        if (format != GST_VIDEO_INFO_FORMAT (&xcontext->outInfo)) {
+                gst_video_info_set_format (&xcontext->outInfo, format, xcontext->width, xcontext->height);
+                g_free (xcontext->yuv);
+                xcontext->yuv = NULL;
+                if (format != GST_VIDEO_FORMAT_BGRx)
+                        xcontext->yuv = g_malloc (GST_VIDEO_INFO_SIZE (&xcontext->outInfo));
+                xcontext->frame_valid = FALSE;
+        }
+
+        nvimage = gst_buffer_new ();
+        GST_MINI_OBJECT_CAST (nvimage)->dispose =
+                (GstMiniObjectDisposeFunction) gst_nvimagesrc_buffer_dispose;
+
+        meta = GST_META_NVIMAGE_ADD (nvimage);
+        meta->width = xcontext->width;
+        meta->height = xcontext->height;
+        meta->size = GST_VIDEO_INFO_SIZE (&xcontext->outInfo);
+
+        changed = nvimageutil_xshm_update (xcontext, nvimage);
+        if (changed < 0) {
+                GST_ERROR_OBJECT (parent, "Cannot read the screen through XShm");
+                gst_buffer_unref (nvimage);
+                return NULL;
+        }
+
+        /* Downstream may still hold the previous frames */
+        meta->data = g_malloc (meta->size);
+        memcpy (meta->data, xcontext->yuv ? xcontext->yuv : xcontext->frame, meta->size);
+        if (xcontext->show_pointer && xcontext->xfixes)
+                nvimageutil_xshm_draw_pointer (xcontext, meta->data, &changed);
+        meta->changed_blocks = changed;
+
+        gst_buffer_append_memory (nvimage, gst_memory_new_wrapped (GST_MEMORY_FLAG_NO_SHARE, meta->data,
+                                        meta->size, 0, meta->size, NULL, NULL));
+
+        /* Keep a ref to our src */
+        meta->parent = gst_object_ref (parent);
+
+        return nvimage;
+}
+
+/* High refresh mode encodes a picture while the next frame is grabbed.
+   That needs the two NvFBC textures of the GL path, and leaves out the
+   refinement and the classification, which act on the picture just
+   encoded. */
+static gboolean
+nvimageutil_pipelined(GstXContext *xcontext) {
+        return xcontext->config.high_refresh && xcontext->mode == NVIMAGE_CAPTURE_GL &&
+               xcontext->registeredResources[1] &&
+               !xcontext->config.refine_qp && !xcontext->config.content_adaptive;
+}
+
+/* Waits for the picture in the output buffer, copies it into @nvimage
+   and unmaps its input. @forced and @ts are those the picture was
+   submitted with. */
+static gboolean
+nvimageutil_encoder_finish(GstXContext *xcontext, GstElement *parent, GstBuffer *nvimage, NV_ENC_INPUT_PTR input,
+                           gboolean newFrame, guint refineQP, gint64 start, gboolean forced, gint64 ts) {
+        GstMetaNVimage               *meta = GST_META_NVIMAGE_GET (nvimage);
+        GstMetaNVimageFrame          *fmeta;
+        NV_ENC_LOCK_BITSTREAM        lockParams;
+        NVENCSTATUS                  encStatus;
+        gboolean                     contentChanged = FALSE;
+
+        memset(&lockParams, 0, sizeof(lockParams));
+        lockParams.version = NV_ENC_LOCK_BITSTREAM_VER;
+        lockParams.outputBitstream = xcontext->outputBuffer;
+        lockParams.sliceOffsets = xcontext->sliceOffsets;
+
+        encStatus = xcontext->pEncFn.nvEncLockBitstream(xcontext->encoder, &lockParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                GST_ERROR ("Cannot lock bitstream %d", encStatus);
+                return FALSE;
+        }
+
+        meta->data = g_new(char, lockParams.bitstreamSizeInBytes);
+        meta->size = lockParams.bitstreamSizeInBytes;
+        meta->width = xcontext->encParams.inputWidth;
+        meta->height = xcontext->encParams.inputHeight;
+        memcpy(meta->data, lockParams.bitstreamBufferPtr, lockParams.bitstreamSizeInBytes);
+
+        fmeta = GST_META_NVIMAGE_FRAME_ADD (nvimage);
+        fmeta->frame_idx = lockParams.frameIdx;
+        fmeta->picture_type = lockParams.pictureType;
+        fmeta->avg_qp = lockParams.frameAvgQP;
+        fmeta->num_slices = lockParams.numSlices;
+        fmeta->size = lockParams.bitstreamSizeInBytes;
+        fmeta->keyframe = (lockParams.pictureType == NV_ENC_PIC_TYPE_IDR);
+        fmeta->refine = refineQP != 0;
+        fmeta->content = xcontext->content;
+        fmeta->changed = newFrame;
+        fmeta->encode_time = g_get_monotonic_time() - start;
+        fmeta->forced = forced;
+        fmeta->capture_ts = ts;
+        if (refineQP) {
+                guint budget = MAX(xcontext->bitrate / 8 * xcontext->fps_d / xcontext->fps_n, 1);
+
+                GST_DEBUG_OBJECT (parent, "refined unchanged screen at QP %u, %u bytes",
+                                  refineQP, lockParams.bitstreamSizeInBytes);
+                xcontext->refineQP = refineQP;
+                xcontext->refineWait = lockParams.bitstreamSizeInBytes / budget;
+        } else {
+                if (newFrame)
+                        xcontext->lastQP = lockParams.frameAvgQP;
+                if (xcontext->config.content_adaptive)
+                        contentChanged = nvimageutil_content_update(xcontext, newFrame, lockParams.bitstreamSizeInBytes);
+        }
+        if(xcontext->out)
+                fwrite(meta->data, 1, meta->size, xcontext->out);
+
+        encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, xcontext->outputBuffer);
+
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_free(meta->data);
+                meta->data = NULL;
+                GST_ERROR ("Cannot unlock bitstream %d", encStatus);
+                return FALSE;
+        }
+
+        encStatus = xcontext->pEncFn.nvEncUnmapInputResource(xcontext->encoder, input);
+
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_free(meta->data);
+                meta->data = NULL;
+                GST_ERROR ("Cannot unmap input resource %d", encStatus);
+                return FALSE;
+        }
+
+        if (contentChanged)
+                GST_INFO_OBJECT (parent, "switching to the %s profile, damage %.2f, changes %.2f, bits %.2f",
+                                 xcontext->content == NVIMAGE_CONTENT_MOTION ? "motion" : "text",
+                                 xcontext->damageArea, xcontext->changeRate, xcontext->bitsRatio);
+        if (refineQP || contentChanged)
+                nvimageutil_encoder_set_qp(xcontext, 0);
+
+        gst_buffer_append_memory (nvimage, gst_memory_new_wrapped (GST_MEMORY_FLAG_NO_SHARE, meta->data,
+                                        meta->size, 0, meta->size, NULL, NULL));
+
+        return TRUE;
+}
+
 /* This function handles GstNVimageSrcHEVCBuffer creation depending on XShm availability */
 static GstBuffer *
-gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts) {
+gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts, const GstNVimageEncConfig * config) {
         GstBuffer                    *nvimage = NULL;
         GstMetaNVimage               *meta;
-        NVFBC_TOGL_GRAB_FRAME_PARAMS grabParams;
+        NV_ENC_REGISTERED_PTR        resource = NULL;
+        gboolean                     newFrame = TRUE;
+        gboolean                     finished = FALSE;
+        guint                        refineQP;
         NVFBCSTATUS                  fbcStatus;
         NVENCSTATUS                  encStatus;
-        NV_ENC_LOCK_BITSTREAM        lockParams;
         gint                         i=0;
+        gint64                       start;
+        guint                        lease_time;
+
+        if (xcontext->mode == NVIMAGE_CAPTURE_XSHM) {
+                xcontext->show_pointer = show_pointer;
+                xcontext->config = *config;
+                return nvimageutil_xshm_new(xcontext, parent);
+        }
+
+        if ((xcontext->bitrate != bitrate ||
+             xcontext->fps_n != fps_n ||
+             xcontext->fps_d != fps_d) &&
+            xcontext->show_pointer == show_pointer &&
+            !memcmp(&xcontext->config, config, sizeof(xcontext->config)) &&
+            nvimageutil_encoder_set_rate(xcontext, bitrate, fps_n, fps_d)) {
+                xcontext->bitrate = bitrate;
+        }
 
         if (xcontext->fps_n != fps_n ||
             xcontext->fps_d != fps_d ||
             xcontext->bitrate != bitrate ||
-            xcontext->show_pointer != show_pointer) {
+            xcontext->show_pointer != show_pointer ||
+            memcmp(&xcontext->config, config, sizeof(xcontext->config))) {
                 xcontext->fps_n = fps_n;
                 xcontext->fps_d = fps_d;
                 xcontext->bitrate = bitrate;
                 xcontext->show_pointer = show_pointer;
-                g_warning ("Recreating FBCNVENC pipeline, parametres change: bitrate: %d, showpointer %d, fps: %f", bitrate, show_pointer, ((double)fps_n)/fps_d);
+                xcontext->config = *config;
+                g_warning ("Recreating FBCNVENC pipeline, parametres change: bitrate: %d, showpointer %d, fps: %f, max frame size %u, slice size %u, max qp %u, max sessions %u, 4:4:4 %d",
+                                bitrate, show_pointer, ((double)fps_n)/fps_d, config->max_frame_size, config->slice_size, config->max_qp, config->max_sessions, config->yuv444);
                 if(!nvimageutil_fbccontext_clear(xcontext)) {
-                        g_error("Cannot clear context. Flow error.");
+                        GST_ERROR_OBJECT (parent, "Cannot clear context. Flow error.");
                         return NULL;
                 }
-                if (!nvimageutil_fbccontext_get(xcontext)) {
-                        gst_buffer_unref (nvimage);
-                        g_error("Cannot create new context. Flow error.");
+                if (!nvimageutil_capture_get(xcontext)) {
+                        GST_ERROR_OBJECT (parent, "Cannot create new context. Flow error.");
                         return NULL;
                 }
         }
 
+        if (xcontext->config.raw_format != GST_VIDEO_FORMAT_UNKNOWN)
+                return nvimageutil_raw_new(xcontext, parent);
+
+        /* Hand the session over to a waiting source once our lease time is
+           up, and queue up for the next free one. The new session starts
+           with an IDR. */
+        lease_time = nvencbroker_lease_time(xcontext->config.lease_time);
+        if (xcontext->lease && lease_time &&
+            g_get_monotonic_time() - xcontext->lease->acquired >= lease_time * G_TIME_SPAN_MILLISECOND &&
+            nvencbroker_has_waiters(xcontext->lease)) {
+                GST_INFO_OBJECT (parent, "Yielding NVENC session slot %u after %u ms",
+                                xcontext->lease->slot, lease_time);
+                if (!nvimageutil_encoder_clear(xcontext)) {
+                        GST_ERROR_OBJECT (parent, "Cannot clear encoder. Flow error.");
+                        return NULL;
+                }
+        }
+
+        if (!xcontext->encoder && !nvimageutil_encoder_get(xcontext)) {
+                /* Queued for a session slot, nothing to encode with yet, or
+                   NVENC failed. A session that got half way is closed, its
+                   slot given back. */
+                if (!xcontext->ticket)
+                        nvimageutil_encoder_clear(xcontext);
+                return NULL;
+        }
+
+        /* The classification needs the damage, tracked only while it runs */
+        if (xcontext->config.content_adaptive && !xcontext->damage)
+                nvimageutil_damage_get(xcontext);
+        else if (!xcontext->config.content_adaptive)
+                nvimageutil_damage_clear(xcontext);
+
         nvimage = gst_buffer_new ();
         GST_MINI_OBJECT_CAST (nvimage)->dispose =
                 (GstMiniObjectDisposeFunction) gst_nvimagesrc_buffer_dispose;
 
         meta = GST_META_NVIMAGE_ADD (nvimage);
+        start = g_get_monotonic_time();
 
 restart:
-        memset(&grabParams, 0, sizeof(grabParams));
-        grabParams.dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER;
-        grabParams.dwFlags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT | NVFBC_TOGL_GRAB_FLAGS_FORCE_REFRESH;
-
-        fbcStatus = xcontext->pFn.nvFBCToGLGrabFrame(xcontext->fbcHandle, &grabParams);
+        fbcStatus = nvimageutil_grab(xcontext, &resource, &newFrame);
 
         if (fbcStatus == NVFBC_ERR_MUST_RECREATE) {
                 g_warning ("Recreating FBCNVENC pipeline, must recreate status.");
@@ -674,15 +2065,36 @@ restart:
                 }
         } else if (fbcStatus != NVFBC_SUCCESS) {
                 gst_buffer_unref (nvimage);
-                g_error("Cannot grab frame %d", fbcStatus);
+                GST_ERROR ("Cannot grab frame %d", fbcStatus);
                 return NULL;
         }
 
-        xcontext->mapParams.registeredResource = xcontext->registeredResources[grabParams.dwTextureIndex];
+        refineQP = nvimageutil_refine_qp(xcontext, newFrame, forcekeyframe);
+        if (refineQP && !nvimageutil_encoder_set_qp(xcontext, refineQP))
+                refineQP = 0;
+
+        /* The picture of the last call was encoded while this frame was
+           grabbed, it is returned now and its texture unmapped before the
+           next one is mapped. An IDR it was forced with answers the
+           request this frame is asked to force again. */
+        if (xcontext->pending) {
+                xcontext->pending = FALSE;
+                if (xcontext->pendingForced)
+                        forcekeyframe = 0;
+                if (!nvimageutil_encoder_finish(xcontext, parent, nvimage, xcontext->pendingInput, xcontext->pendingNewFrame,
+                                                0, g_get_monotonic_time() - xcontext->pendingTime,
+                                                xcontext->pendingForced, xcontext->pendingTs)) {
+                        gst_buffer_unref (nvimage);
+                        return NULL;
+                }
+                finished = TRUE;
+        }
+
+        xcontext->mapParams.registeredResource = resource;
         encStatus = xcontext->pEncFn.nvEncMapInputResource(xcontext->encoder, &xcontext->mapParams);
         if (encStatus != NV_ENC_SUCCESS) {
                 gst_buffer_unref (nvimage);
-                g_error("Cannot Map input resource %d", encStatus);
+                GST_ERROR ("Cannot Map input resource %d", encStatus);
                 return NULL;
         }
 
@@ -692,6 +2104,7 @@ restart:
         xcontext->encParams.inputDuration = (1000000000L*xcontext->fps_d)/xcontext->fps_n; 
         xcontext->encParams.inputTimeStamp = frame*xcontext->encParams.inputDuration;
         if(forcekeyframe) {
+                g_warning("Forced keyframe");
                 xcontext->encParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
         } else {
                 xcontext->encParams.encodePicFlags = 0;
@@ -701,50 +2114,29 @@ restart:
 
         if (encStatus != NV_ENC_SUCCESS) {
                 gst_buffer_unref (nvimage);
-                g_error("Cannot encode picture %d", encStatus);
-                return NULL;
-        }
-
-        memset(&lockParams, 0, sizeof(lockParams));
-        lockParams.version = NV_ENC_LOCK_BITSTREAM_VER;
-        lockParams.outputBitstream = xcontext->outputBuffer;
-
-        encStatus = xcontext->pEncFn.nvEncLockBitstream(xcontext->encoder, &lockParams);
-        if (encStatus != NV_ENC_SUCCESS) {
-                gst_buffer_unref (nvimage);
-                g_error("Cannot lock bitstream %d", encStatus);
+                GST_ERROR ("Cannot encode picture %d", encStatus);
                 return NULL;
         }
 
-        meta->data = g_new(char, lockParams.bitstreamSizeInBytes);
-        meta->size = lockParams.bitstreamSizeInBytes;
-        meta->width = xcontext->encParams.inputWidth;
-        meta->height = xcontext->encParams.inputHeight;
-        memcpy(meta->data, lockParams.bitstreamBufferPtr, lockParams.bitstreamSizeInBytes);
-        if(xcontext->out)
-                fwrite(meta->data, 1, meta->size, xcontext->out);
-
-        encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, xcontext->outputBuffer);
-
-        if (encStatus != NV_ENC_SUCCESS) {
-                gst_buffer_unref (nvimage);
-                g_free(meta->data);
-                g_error("Cannot unlock bitstream %d", encStatus);
-                return NULL;
-        }
-
-        encStatus = xcontext->pEncFn.nvEncUnmapInputResource(xcontext->encoder, xcontext->encParams.inputBuffer);
-
-        if (encStatus != NV_ENC_SUCCESS) {
+        if (nvimageutil_pipelined(xcontext)) {
+                xcontext->pending = TRUE;
+                xcontext->pendingInput = xcontext->encParams.inputBuffer;
+                xcontext->pendingNewFrame = newFrame;
+                xcontext->pendingTime = g_get_monotonic_time() - start;
+                xcontext->pendingForced = forcekeyframe != 0;
+                xcontext->pendingTs = ts;
+                /* Nothing to return yet for the first picture */
+                if (!finished) {
+                        forcekeyframe = 0;
+                        start = g_get_monotonic_time();
+                        goto restart;
+                }
+        } else if (!nvimageutil_encoder_finish(xcontext, parent, nvimage, xcontext->encParams.inputBuffer,
+                                               newFrame, refineQP, start, forcekeyframe != 0, ts)) {
                 gst_buffer_unref (nvimage);
-                g_free(meta->data);
-                g_error("Cannot unmap input resource %d", encStatus);
                 return NULL;
         }
 
-        gst_buffer_append_memory (nvimage, gst_memory_new_wrapped (GST_MEMORY_FLAG_NO_SHARE, meta->data,
-                                        meta->size, 0, meta->size, NULL, NULL));
-
         /* Keep a ref to our src */
         meta->parent = gst_object_ref (parent);
 
@@ -23,29 +23,123 @@
 #include <stdio.h>
 
 #include <gst/gst.h>
+#include <gst/video/video.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include <pthread.h>
+#include <cuda.h>
 
 
 #include "NvFBC.h"
 #include "NvFBCUtils.h"
 #include "nvEncodeAPI.h"
+#include "nvencbroker.h"
+#include "nvimageconvert.h"
+#include "nvimagesched.h"
 
 G_BEGIN_DECLS
 
+/* QP steps of the refinement of an unchanged screen */
+#define NVIMAGEUTIL_REFINE_STEP 6
+/* Microseconds a content profile is kept at least */
+#define NVIMAGEUTIL_CONTENT_HOLD G_USEC_PER_SEC
+
 typedef struct _GstXContext GstXContext;
 typedef struct _GstNVimage GstNVimage;
 typedef struct _GstMetaNVimage GstMetaNVimage;
+typedef struct _GstMetaNVimageFrame GstMetaNVimageFrame;
+
+/**
+ * GstNVimageEncConfig:
+ * @max_frame_size: upper bound of a single encoded frame in bytes, 0 = unbounded
+ * @slice_size: target slice size in bytes, 0 = one slice per picture
+ * @max_qp: highest QP the rate control may use, 0 = no clamp
+ * @max_sessions: NVENC sessions the host broker hands out, 0 = no broker
+ * @lease_time: ms a session is kept before it goes to a waiting source, 0 =
+ * forever, capped by the quota of the tenant
+ * @raw_format: output captured frames in this format (NV12 or BGRx) instead
+ * of encoding them, GST_VIDEO_FORMAT_UNKNOWN = encode
+ * @diff_map_block: size in pixels of the blocks of the NvFBC diff map of
+ * raw BGRx frames, 0 = no diff map
+ * @yuv444: capture YUV 4:4:4 and encode it with a 4:4:4 profile
+ * instead of 4:2:0, for sharp coloured text
+ * @refine_qp: QP an unchanged screen is refined down to, 0 = no refinement
+ * @refine_delay: ms the screen has to be unchanged before it is refined
+ * @content_adaptive: classify the content and switch the encoder between
+ * the #GstNVimageContent profiles
+ * @text_fps: frame rate of %NVIMAGE_CONTENT_TEXT, 0 = the negotiated one
+ * @high_refresh: capture frames as the applications present them instead of
+ * at the 60 Hz NvFBC samples the screen with, and in %NVIMAGE_CAPTURE_GL
+ * mode encode a frame while the next one is grabbed
+ *
+ * Encoder tuning on top of fps, bitrate and pointer settings. A change of
+ * any of the fields reinitializes the encoder.
+ */
+typedef struct {
+  guint max_frame_size;
+  guint slice_size;
+  guint max_qp;
+  guint max_sessions;
+  guint lease_time;
+  GstVideoFormat raw_format;
+  guint diff_map_block;
+  gboolean yuv444;
+  guint refine_qp;
+  guint refine_delay;
+  gboolean content_adaptive;
+  guint text_fps;
+  gboolean high_refresh;
+} GstNVimageEncConfig;
+
+/**
+ * GstNVimageContent:
+ * @NVIMAGE_CONTENT_TEXT: mostly still text and UI with small, sporadic
+ * changes, low delay rate control without AQ
+ * @NVIMAGE_CONTENT_MOTION: large areas change with every frame, e.g. video
+ * playback, rate control with spatial AQ at the full frame rate
+ *
+ * Encoder profile picked from the damage area, the change rate and the
+ * size of the encoded frames.
+ */
+typedef enum {
+  NVIMAGE_CONTENT_TEXT,
+  NVIMAGE_CONTENT_MOTION,
+} GstNVimageContent;
+
+/**
+ * GstNVimageCaptureMode:
+ * @NVIMAGE_CAPTURE_GL: NvFBC captures to textures of our GLX context,
+ * NVENC encodes them through its OpenGL interface
+ * @NVIMAGE_CAPTURE_CUDA: NvFBC captures to a CUDA buffer, NVENC encodes
+ * it through its CUDA interface, no GLX context of our own is created
+ * @NVIMAGE_CAPTURE_XSHM: no GPU, XShm copies the rectangles XDamage reports
+ * into a frame kept in system memory, only raw video is produced
+ * @NVIMAGE_CAPTURE_AUTO: %NVIMAGE_CAPTURE_GL if the NVIDIA libraries can be
+ * loaded and NvFBC starts, %NVIMAGE_CAPTURE_XSHM otherwise
+ *
+ * How frames get from the capture to the encoder.
+ */
+typedef enum {
+  NVIMAGE_CAPTURE_GL,
+  NVIMAGE_CAPTURE_CUDA,
+  NVIMAGE_CAPTURE_XSHM,
+  NVIMAGE_CAPTURE_AUTO,
+} GstNVimageCaptureMode;
 
 typedef struct {
         int function;
         union {
           GstElement * parent;
           const gchar * display_name;
+          gint gpu;
+          GstNVimageCaptureMode mode;
+          guint max_sessions;
           uint fps_n; 
           guint fps_d; 
           gint bitrate;
@@ -53,6 +147,7 @@ typedef struct {
           gint forcekeyframe;
           gint64 frame; 
           gint64 ts;
+          const GstNVimageEncConfig * config;
         } args[10];       
         union {
            gboolean b;
@@ -60,13 +155,15 @@ typedef struct {
         } retval;
         gboolean retvalid;
         gboolean inputvalid;
+        /* monotonic time the call was handed to the worker */
+        gint64 signalled;
 } GstXThreadCall;
 
 /* Global X Context stuff */
 /**
  * GstXContext:
  * @disp: the X11 Display of this context
- * @screen: the default Screen of Display @disp
+ * @screen: the Screen of Display @disp driven by the GPU of this context
  * @visual: the default Visual of Screen @screen
  * @root: the root Window of Display @disp
  * @white: the value of a white pixel on Screen @screen
@@ -86,6 +183,31 @@ typedef struct {
  * @use_xshm: used to known wether of not XShm extension is usable or not even
  * if the Extension is present
  * @caps: the #GstCaps that Display @disp can accept
+ * @gpu: index of the GPU capturing and encoding, the X screen it drives
+ * @session: registration of this context on @gpu with the broker
+ * @mode: the capture path, fixed for the lifetime of the context
+ * @yuv444_supported: NVENC of @gpu encodes 4:4:4, probed once when
+ * the context is created on a broker slot
+ * @cuctx: the CUDA context of @gpu in %NVIMAGE_CAPTURE_CUDA mode
+ * @cudaBuffer: the NvFBC frame buffer registered as the NVENC input
+ * @sysBuffer: the NvFBC frame buffer of raw output in %NVIMAGE_CAPTURE_GL mode
+ * @diffMap: the NvFBC map of the blocks of @sysBuffer that changed with the
+ * last grab, @diffMapSize blocks
+ * @xfixes: the XFixes extension is there, for the damage region and the pointer
+ * @shminfo: the shared memory segment of @ximage in %NVIMAGE_CAPTURE_XSHM mode
+ * @ximage: screen sized XShm image the damaged rectangles are read through
+ * @damage: the XDamage of the root window, None without the extension, in
+ * NvFBC modes only created for the content classification
+ * @region: the damaged region fetched with every grab
+ * @frame: the screen as of the last grab, BGRx, only damage is copied into it
+ * @frame_valid: @frame holds a complete screen
+ * @outInfo: the layout of the raw frames pushed in %NVIMAGE_CAPTURE_XSHM mode
+ * @yuv: @frame converted to the NV12 or I420 of @outInfo, NULL for BGRx
+ * @pointerFrame: scratch copy of @frame the pointer is blended into before
+ * it is converted to YUV
+ * @cursor_x: position of the pointer drawn into the last frame
+ * @cursor_y: position of the pointer drawn into the last frame
+ * @cursor_serial: the shape of the pointer drawn into the last frame
  *
  * Structure used to store various information collected/calculated for a
  * Display.
@@ -94,6 +216,10 @@ struct _GstXContext {
   Display *disp;
 
   Screen *screen;
+  gint gpu;
+  NvEncBrokerLease *session;
+  GstNVimageCaptureMode mode;
+  gboolean yuv444_supported;
 
   gint width, height;
 
@@ -102,12 +228,32 @@ struct _GstXContext {
   gint goplen;
   guint bitrate;
   gboolean show_pointer;
+  GstNVimageEncConfig config;
 
   GLXContext glxctx;
   Pixmap pixmap;
   GLXPixmap glxpixmap;
   GLXFBConfig fbconfig;
 
+  CUcontext cuctx;
+  CUdeviceptr cudaBuffer;
+  void *sysBuffer;
+  guint8 *diffMap;
+  NVFBC_SIZE diffMapSize;
+
+  gboolean xfixes;
+  XShmSegmentInfo shminfo;
+  XImage *ximage;
+  Damage damage;
+  XserverRegion region;
+  guint8 *frame;
+  gboolean frame_valid;
+  GstVideoInfo outInfo;
+  guint8 *yuv;
+  guint8 *pointerFrame;
+  gint cursor_x, cursor_y;
+  gulong cursor_serial;
+
   NVFBC_API_FUNCTION_LIST pFn;
   NVFBC_SESSION_HANDLE fbcHandle;
   NV_ENCODE_API_FUNCTION_LIST pEncFn;
@@ -116,10 +262,52 @@ struct _GstXContext {
   NV_ENC_MAP_INPUT_RESOURCE mapParams;
   NV_ENC_OUTPUT_PTR outputBuffer;
   NV_ENC_PIC_PARAMS encParams;
+  /* kept for nvEncReconfigureEncoder */
+  NV_ENC_INITIALIZE_PARAMS initParams;
+  NV_ENC_CONFIG encodeConfig;
   NVFBC_TOGL_SETUP_PARAMS setupParams;
   NV_ENC_REGISTERED_PTR registeredResources[NVFBC_TOGL_TEXTURES_MAX];
+  uint32_t *sliceOffsets;
+
+  /* Refinement of an unchanged screen: the time and QP of the last change,
+     the QP of the last refinement, 0 = none since the change, and the
+     frames until its bits are paid back out of the idle bandwidth */
+  gint64 lastChange;
+  guint lastQP;
+  guint refineQP;
+  guint refineWait;
+
+  /* Content classification: averages of the damaged share of the screen,
+     of the share of redrawn frames and of the encoded frame size relative
+     to the frame budget, the current profile and when it was picked */
+  gdouble damageArea;
+  gdouble changeRate;
+  gdouble bitsRatio;
+  gint content;
+  gint64 contentSince;
 
+  /* High refresh pipelining: a picture submitted by the last call is
+     encoded while the next frame is grabbed into the other texture, its
+     mapped input, whether it was a new frame, the microseconds its
+     grab and submission took, whether it forced an IDR and its capture
+     time */
+  gboolean pending;
+  NV_ENC_INPUT_PTR pendingInput;
+  gboolean pendingNewFrame;
+  gint64 pendingTime;
+  gboolean pendingForced;
+  gint64 pendingTs;
+
+  /* broker slot held while the encoder is open, or the place in the queue
+     while the source waits for one */
+  NvEncBrokerLease *lease;
+  NvEncBrokerTicket *ticket;
+
+  /* the worker thread, its kernel thread ID for the scheduler statistics
+     and the microseconds it took to pick up the last frame request */
   pthread_t worker_tid;
+  pid_t worker_sys_tid;
+  guint wakeupDelay;
   gboolean finish;
   pthread_mutex_t mutex_in;
   pthread_mutex_t mutex_out;
@@ -130,7 +318,7 @@ struct _GstXContext {
   FILE *out;
 };
 
-GstXContext *nvimageutil_xcontext_get_r (GstElement *parent, const gchar *display_name);
+GstXContext *nvimageutil_xcontext_get_r (GstElement *parent, const gchar *display_name, gint gpu, GstNVimageCaptureMode mode, guint max_sessions);
 void nvimageutil_xcontext_clear_r (GstXContext *xcontext);
 
 /* custom nvimagesrc buffer, copied from nvimagesink */
@@ -142,6 +330,8 @@ void nvimageutil_xcontext_clear_r (GstXContext *xcontext);
  * @width: the width in pixels of NVimage @nvimage
  * @height: the height in pixels of NVimage @nvimage
  * @size: the size in bytes of NVimage @nvimage
+ * @changed_blocks: diff map blocks or damaged rectangles that changed since
+ * the previous capture, -1 if changes are not tracked
  *
  * Extra data attached to buffers containing additional information about an NVimage.
  */
@@ -153,6 +343,7 @@ struct _GstMetaNVimage {
   void *data;
   gint width, height;
   size_t size;
+  gint changed_blocks;
 };
 
 GType gst_meta_nvimage_api_get_type (void);
@@ -160,7 +351,49 @@ const GstMetaInfo * gst_meta_nvimage_get_info (void);
 #define GST_META_NVIMAGE_GET(buf) ((GstMetaNVimage *)gst_buffer_get_meta(buf,gst_meta_nvimage_api_get_type()))
 #define GST_META_NVIMAGE_ADD(buf) ((GstMetaNVimage *)gst_buffer_add_meta(buf,gst_meta_nvimage_get_info(),NULL))
 
-GstBuffer * gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts);
+/**
+ * GstMetaNVimageFrame:
+ * @frame_idx: the frame number NVENC reports for this picture
+ * @picture_type: the NV_ENC_PIC_TYPE of the encoded picture
+ * @avg_qp: average QP of the frame
+ * @num_slices: number of slices in the encoded picture
+ * @size: the size in bytes of the encoded picture
+ * @keyframe: TRUE if the picture is an IDR and can be decoded on its own
+ * @refine: TRUE if the picture re-encodes an unchanged screen at a lower QP
+ * @content: the #GstNVimageContent profile the picture was encoded with
+ * @changed: TRUE if the screen changed since the previous capture
+ * @encode_time: microseconds from the grab to the locked bitstream
+ * @forced: TRUE if the picture was submitted with a forced IDR
+ * @capture_ts: the capture time passed with the frame the picture encodes,
+ * an earlier call's in pipelined mode
+ *
+ * Encoder output information attached to every encoded buffer, so that
+ * downstream elements do not have to parse the bitstream to get it.
+ */
+struct _GstMetaNVimageFrame {
+  GstMeta meta;
+
+  guint32 frame_idx;
+  guint picture_type;
+  guint avg_qp;
+  guint num_slices;
+  gsize size;
+  gboolean keyframe;
+  gboolean refine;
+  GstNVimageContent content;
+  gboolean changed;
+  guint encode_time;
+  gboolean forced;
+  GstClockTime capture_ts;
+};
+
+GType gst_meta_nvimage_frame_api_get_type (void);
+const GstMetaInfo * gst_meta_nvimage_frame_get_info (void);
+const gchar * gst_nvimageutil_picture_type_name (guint picture_type);
+#define GST_META_NVIMAGE_FRAME_GET(buf) ((GstMetaNVimageFrame *)gst_buffer_get_meta(buf,gst_meta_nvimage_frame_api_get_type()))
+#define GST_META_NVIMAGE_FRAME_ADD(buf) ((GstMetaNVimageFrame *)gst_buffer_add_meta(buf,gst_meta_nvimage_frame_get_info(),NULL))
+
+GstBuffer * gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts, const GstNVimageEncConfig * config);
 
 void gst_nvimageutil_nvimage_destroy (GstXContext * xcontext, GstBuffer * nvimage);
 
@@ -0,0 +1,15 @@
+#!/bin/bash
+
+OPT="-O2"
+
+CFLAGS="-I. -I/usr/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H"
+
+cc $CFLAGS -MD -MQ gstrtpframepacer.c.o -MF gstrtpframepacer.c.o.d -o gstrtpframepacer.c.o -c gstrtpframepacer.c
+
+cc $CFLAGS -MD -MQ gstrtphdrextabssendtime.c.o -MF gstrtphdrextabssendtime.c.o.d -o gstrtphdrextabssendtime.c.o -c gstrtphdrextabssendtime.c
+
+cc $CFLAGS -MD -MQ gstrtphdrextplayoutdelay.c.o -MF gstrtphdrextplayoutdelay.c.o.d -o gstrtphdrextplayoutdelay.c.o -c gstrtphdrextplayoutdelay.c
+
+cc $CFLAGS -MD -MQ gstrtplowlatency.c.o -MF gstrtplowlatency.c.o.d -o gstrtplowlatency.c.o -c gstrtplowlatency.c
+
+cc  -o libgstrtplowlatency.so gstrtplowlatency.c.o gstrtpframepacer.c.o gstrtphdrextabssendtime.c.o gstrtphdrextplayoutdelay.c.o -Wl,--as-needed -Wl,--no-undefined -shared -fPIC -Wl,--start-group -Wl,-soname,libgstrtplowlatency.so -Wl,-Bsymbolic-functions /usr/lib/x86_64-linux-gnu/libgstbase-1.0.so /usr/lib/x86_64-linux-gnu/libgstreamer-1.0.so /usr/lib/x86_64-linux-gnu/libgobject-2.0.so /usr/lib/x86_64-linux-gnu/libglib-2.0.so /usr/lib/x86_64-linux-gnu/libgstrtp-1.0.so -Wl,--end-group
@@ -0,0 +1,443 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * SECTION:element-rtpframepacer
+ * @title: rtpframepacer
+ *
+ * Spreads the RTP packets of large frames over a fraction of the frame
+ * interval instead of sending them back-to-back, so that shallow router
+ * buffers on the path do not drop the tail of keyframes.
+ *
+ * Pacing uses a token bucket one average frame (bitrate / fps) deep that
+ * refills at bitrate / fraction. Frames up to the average size therefore
+ * leave without any delay, only the part of a frame above it is paced.
+ *
+ * A packet is never held back beyond max-delay after the running time of
+ * its frame, which includes the time it spent in a queue in front of the
+ * pacer. Packets without a timestamp are bounded by the time the backlog
+ * started instead. If the bitrate is stale and the backlog grows, the rest
+ * of the frame leaves in one burst and the bucket starts over.
+ *
+ * ## Example pipelines
+ * |[
+ * gst-launch-1.0 nvimagesrc ! rtph264pay ! queue ! rtpframepacer bitrate=8000000 fps=60 ! udpsink
+ * ]| Paces keyframes over half of a 60 fps frame interval.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "gstrtpframepacer.h"
+
+#include <string.h>
+
+GST_DEBUG_CATEGORY (gst_debug_rtp_frame_pacer);
+#define GST_CAT_DEFAULT gst_debug_rtp_frame_pacer
+
+static GstStaticPadTemplate sink_template =
+GST_STATIC_PAD_TEMPLATE ("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("application/x-rtp"));
+
+static GstStaticPadTemplate src_template =
+GST_STATIC_PAD_TEMPLATE ("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("application/x-rtp"));
+
+enum
+{
+        PROP_0,
+        PROP_BITRATE,
+        PROP_FPS,
+        PROP_FRACTION,
+        PROP_MAX_DELAY,
+        PROP_STATS,
+};
+
+#define DEFAULT_BITRATE 0
+#define DEFAULT_FPS 30.0
+#define DEFAULT_FRACTION 0.5
+#define DEFAULT_MAX_DELAY 0
+
+#define gst_rtp_frame_pacer_parent_class parent_class
+G_DEFINE_TYPE (GstRtpFramePacer, gst_rtp_frame_pacer, GST_TYPE_ELEMENT);
+
+/* Takes the size of @buf from the bucket and returns the clock time the
+ * packet may be sent at, or GST_CLOCK_TIME_NONE if it can go right away. */
+static GstClockTime
+gst_rtp_frame_pacer_reserve (GstRtpFramePacer * p, GstBuffer * buf)
+{
+        GstClockTime now, delay, max_delay, deadline, running_time;
+        gsize size = gst_buffer_get_size (buf);
+        gdouble rate, depth;
+        GstClockTime target = GST_CLOCK_TIME_NONE;
+
+        GST_OBJECT_LOCK (p);
+        p->stats.packets++;
+        p->stats.bytes += size;
+
+        if (p->bitrate == 0 || p->fps <= 0 || GST_ELEMENT_CLOCK (p) == NULL)
+                goto done;
+
+        now = gst_clock_get_time (GST_ELEMENT_CLOCK (p));
+        rate = p->bitrate / p->fraction;
+        depth = p->bitrate / p->fps;
+
+        if (GST_CLOCK_TIME_IS_VALID (p->last_refill) && now > p->last_refill)
+                p->tokens = MIN (depth, p->tokens + (gdouble) (now - p->last_refill) * rate / GST_SECOND);
+        else if (!GST_CLOCK_TIME_IS_VALID (p->last_refill))
+                p->tokens = depth;
+        p->last_refill = now;
+
+        if (p->tokens >= 0) {
+                p->tokens -= size * 8.0;
+                p->backlog_start = GST_CLOCK_TIME_NONE;
+                goto done;
+        }
+
+        if (!GST_CLOCK_TIME_IS_VALID (p->backlog_start))
+                p->backlog_start = now;
+
+        /* The hold-back time is counted from the frame, so the time the
+         * packet already waited upstream while earlier ones were paced counts
+         * as well */
+        max_delay = p->max_delay ? p->max_delay : (GstClockTime) (GST_SECOND / p->fps);
+        running_time = p->segment.format == GST_FORMAT_TIME ?
+                gst_segment_to_running_time (&p->segment, GST_FORMAT_TIME, GST_BUFFER_PTS (buf)) :
+                GST_CLOCK_TIME_NONE;
+        if (GST_CLOCK_TIME_IS_VALID (running_time))
+                deadline = GST_ELEMENT_CAST (p)->base_time + running_time + max_delay;
+        else
+                deadline = p->backlog_start + max_delay;
+
+        delay = (GstClockTime) (-p->tokens * GST_SECOND / rate);
+        if (now + delay > deadline) {
+                /* The backlog is larger than we are allowed to hold back,
+                 * most likely the bitrate is stale. Let it go in one burst. */
+                GST_DEBUG_OBJECT (p, "Backlog of %" GST_TIME_FORMAT " exceeds max delay, bursting",
+                                GST_TIME_ARGS (delay));
+                p->stats.bursts++;
+                p->tokens = 0;
+                p->backlog_start = GST_CLOCK_TIME_NONE;
+                goto done;
+        }
+
+        p->tokens -= size * 8.0;
+        p->stats.paced_packets++;
+        p->stats.total_delay += delay;
+        p->stats.max_delay = MAX (p->stats.max_delay, delay);
+        target = now + delay;
+
+done:
+        GST_OBJECT_UNLOCK (p);
+        return target;
+}
+
+static GstFlowReturn
+gst_rtp_frame_pacer_wait (GstRtpFramePacer * p, GstClockTime target)
+{
+        GstClockID id;
+        GstClockReturn ret;
+
+        GST_OBJECT_LOCK (p);
+        if (p->flushing) {
+                GST_OBJECT_UNLOCK (p);
+                return GST_FLOW_FLUSHING;
+        }
+        if (GST_ELEMENT_CLOCK (p) == NULL) {
+                GST_OBJECT_UNLOCK (p);
+                return GST_FLOW_OK;
+        }
+
+        id = gst_clock_new_single_shot_id (GST_ELEMENT_CLOCK (p), target);
+        p->clock_id = id;
+        GST_OBJECT_UNLOCK (p);
+
+        GST_LOG_OBJECT (p, "Pacing packet until %" GST_TIME_FORMAT, GST_TIME_ARGS (target));
+        ret = gst_clock_id_wait (id, NULL);
+
+        GST_OBJECT_LOCK (p);
+        gst_clock_id_unref (id);
+        p->clock_id = NULL;
+        GST_OBJECT_UNLOCK (p);
+
+        return ret == GST_CLOCK_UNSCHEDULED ? GST_FLOW_FLUSHING : GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_rtp_frame_pacer_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+        GstRtpFramePacer *p = GST_RTP_FRAME_PACER (parent);
+        GstClockTime target;
+        GstFlowReturn ret;
+
+        target = gst_rtp_frame_pacer_reserve (p, buf);
+        if (GST_CLOCK_TIME_IS_VALID (target)) {
+                ret = gst_rtp_frame_pacer_wait (p, target);
+                if (ret != GST_FLOW_OK) {
+                        gst_buffer_unref (buf);
+                        return ret;
+                }
+        }
+
+        return gst_pad_push (p->srcpad, buf);
+}
+
+/* Packets that may leave right away are pushed together, the list is only
+ * split where a packet has to wait */
+static GstFlowReturn
+gst_rtp_frame_pacer_chain_list (GstPad * pad, GstObject * parent, GstBufferList * list)
+{
+        GstRtpFramePacer *p = GST_RTP_FRAME_PACER (parent);
+        GstBufferList *out = NULL;
+        GstFlowReturn ret = GST_FLOW_OK;
+        guint i, len;
+
+        len = gst_buffer_list_length (list);
+        for (i = 0; i < len; i++) {
+                GstBuffer *buf = gst_buffer_list_get (list, i);
+                GstClockTime target = gst_rtp_frame_pacer_reserve (p, buf);
+
+                if (GST_CLOCK_TIME_IS_VALID (target)) {
+                        if (out) {
+                                ret = gst_pad_push_list (p->srcpad, out);
+                                out = NULL;
+                                if (ret != GST_FLOW_OK)
+                                        goto done;
+                        }
+                        ret = gst_rtp_frame_pacer_wait (p, target);
+                        if (ret != GST_FLOW_OK)
+                                goto done;
+                }
+
+                if (!out)
+                        out = gst_buffer_list_new_sized (len - i);
+                gst_buffer_list_add (out, gst_buffer_ref (buf));
+        }
+
+        if (out) {
+                ret = gst_pad_push_list (p->srcpad, out);
+                out = NULL;
+        }
+
+done:
+        if (out)
+                gst_buffer_list_unref (out);
+        gst_buffer_list_unref (list);
+        return ret;
+}
+
+static void
+gst_rtp_frame_pacer_set_flushing (GstRtpFramePacer * p, gboolean flushing)
+{
+        GST_OBJECT_LOCK (p);
+        p->flushing = flushing;
+        if (flushing && p->clock_id)
+                gst_clock_id_unschedule (p->clock_id);
+        p->last_refill = GST_CLOCK_TIME_NONE;
+        p->backlog_start = GST_CLOCK_TIME_NONE;
+        GST_OBJECT_UNLOCK (p);
+}
+
+static gboolean
+gst_rtp_frame_pacer_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+        GstRtpFramePacer *p = GST_RTP_FRAME_PACER (parent);
+
+        switch (GST_EVENT_TYPE (event)) {
+                case GST_EVENT_FLUSH_START:
+                        gst_rtp_frame_pacer_set_flushing (p, TRUE);
+                        break;
+                case GST_EVENT_FLUSH_STOP:
+                        gst_rtp_frame_pacer_set_flushing (p, FALSE);
+                        GST_OBJECT_LOCK (p);
+                        gst_segment_init (&p->segment, GST_FORMAT_UNDEFINED);
+                        GST_OBJECT_UNLOCK (p);
+                        break;
+                case GST_EVENT_SEGMENT:
+                        GST_OBJECT_LOCK (p);
+                        gst_event_copy_segment (event, &p->segment);
+                        GST_OBJECT_UNLOCK (p);
+                        break;
+                default:
+                        break;
+        }
+
+        return gst_pad_event_default (pad, parent, event);
+}
+
+static GstStateChangeReturn
+gst_rtp_frame_pacer_change_state (GstElement * element, GstStateChange transition)
+{
+        GstRtpFramePacer *p = GST_RTP_FRAME_PACER (element);
+
+        switch (transition) {
+                case GST_STATE_CHANGE_READY_TO_PAUSED:
+                        gst_rtp_frame_pacer_set_flushing (p, FALSE);
+                        GST_OBJECT_LOCK (p);
+                        memset (&p->stats, 0, sizeof (p->stats));
+                        gst_segment_init (&p->segment, GST_FORMAT_UNDEFINED);
+                        GST_OBJECT_UNLOCK (p);
+                        break;
+                case GST_STATE_CHANGE_PAUSED_TO_READY:
+                        /* wake up a streaming thread waiting to send */
+                        gst_rtp_frame_pacer_set_flushing (p, TRUE);
+                        break;
+                default:
+                        break;
+        }
+
+        return GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+}
+
+static GstStructure *
+gst_rtp_frame_pacer_create_stats (GstRtpFramePacer * p)
+{
+        GstRtpFramePacerStats *st = &p->stats;
+
+        return gst_structure_new ("application/x-rtp-frame-pacer-stats",
+                "packets", G_TYPE_UINT64, st->packets,
+                "bytes", G_TYPE_UINT64, st->bytes,
+                "paced-packets", G_TYPE_UINT64, st->paced_packets,
+                "bursts", G_TYPE_UINT64, st->bursts,
+                "avg-delay", G_TYPE_UINT64, st->paced_packets ? st->total_delay / st->paced_packets : 0,
+                "max-delay", G_TYPE_UINT64, st->max_delay,
+                NULL);
+}
+
+static void
+gst_rtp_frame_pacer_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+        GstRtpFramePacer *p = GST_RTP_FRAME_PACER (object);
+
+        GST_OBJECT_LOCK (p);
+        switch (prop_id) {
+                case PROP_BITRATE:
+                        p->bitrate = g_value_get_uint (value);
+                        break;
+                case PROP_FPS:
+                        p->fps = g_value_get_double (value);
+                        break;
+                case PROP_FRACTION:
+                        p->fraction = g_value_get_double (value);
+                        break;
+                case PROP_MAX_DELAY:
+                        p->max_delay = g_value_get_uint64 (value);
+                        break;
+                default:
+                        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+                        break;
+        }
+        GST_OBJECT_UNLOCK (p);
+}
+
+static void
+gst_rtp_frame_pacer_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec)
+{
+        GstRtpFramePacer *p = GST_RTP_FRAME_PACER (object);
+
+        GST_OBJECT_LOCK (p);
+        switch (prop_id) {
+                case PROP_BITRATE:
+                        g_value_set_uint (value, p->bitrate);
+                        break;
+                case PROP_FPS:
+                        g_value_set_double (value, p->fps);
+                        break;
+                case PROP_FRACTION:
+                        g_value_set_double (value, p->fraction);
+                        break;
+                case PROP_MAX_DELAY:
+                        g_value_set_uint64 (value, p->max_delay);
+                        break;
+                case PROP_STATS:
+                        g_value_take_boxed (value, gst_rtp_frame_pacer_create_stats (p));
+                        break;
+                default:
+                        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+                        break;
+        }
+        GST_OBJECT_UNLOCK (p);
+}
+
+static void
+gst_rtp_frame_pacer_class_init (GstRtpFramePacerClass * klass)
+{
+        GObjectClass *gc = G_OBJECT_CLASS (klass);
+        GstElementClass *ec = GST_ELEMENT_CLASS (klass);
+
+        gc->set_property = gst_rtp_frame_pacer_set_property;
+        gc->get_property = gst_rtp_frame_pacer_get_property;
+
+        g_object_class_install_property (gc, PROP_BITRATE,
+                                                g_param_spec_uint ("bitrate", "Bitrate",
+                                                "Target bitrate of the stream in bits per second (0 = no pacing)",
+                                                0, G_MAXUINT, DEFAULT_BITRATE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_FPS,
+                                                g_param_spec_double ("fps", "FPS",
+                                                "Frame rate of the stream",
+                                                0, G_MAXDOUBLE, DEFAULT_FPS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_FRACTION,
+                                                g_param_spec_double ("fraction", "Fraction",
+                                                "Fraction of the frame interval an average frame is spread over",
+                                                0.01, 1.0, DEFAULT_FRACTION, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MAX_DELAY,
+                                                g_param_spec_uint64 ("max-delay", "Maximum delay",
+                                                "Longest time in nanoseconds a packet is held back after its frame, including upstream queuing (0 = one frame interval)",
+                                                0, G_MAXUINT64, DEFAULT_MAX_DELAY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_STATS,
+                                                g_param_spec_boxed ("stats", "Statistics", "Pacing statistics",
+                                                GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        gst_element_class_set_static_metadata (ec, "RTP frame pacer",
+                                                "Filter/Network/RTP",
+                                                "Spreads the packets of large frames over the frame interval",
+                                                "CERIT-SC");
+        gst_element_class_add_static_pad_template (ec, &sink_template);
+        gst_element_class_add_static_pad_template (ec, &src_template);
+
+        ec->change_state = gst_rtp_frame_pacer_change_state;
+}
+
+static void
+gst_rtp_frame_pacer_init (GstRtpFramePacer * p)
+{
+        p->sinkpad = gst_pad_new_from_static_template (&sink_template, "sink");
+        gst_pad_set_chain_function (p->sinkpad, GST_DEBUG_FUNCPTR (gst_rtp_frame_pacer_chain));
+        gst_pad_set_chain_list_function (p->sinkpad, GST_DEBUG_FUNCPTR (gst_rtp_frame_pacer_chain_list));
+        gst_pad_set_event_function (p->sinkpad, GST_DEBUG_FUNCPTR (gst_rtp_frame_pacer_sink_event));
+        GST_PAD_SET_PROXY_CAPS (p->sinkpad);
+        GST_PAD_SET_PROXY_ALLOCATION (p->sinkpad);
+        gst_element_add_pad (GST_ELEMENT (p), p->sinkpad);
+
+        p->srcpad = gst_pad_new_from_static_template (&src_template, "src");
+        GST_PAD_SET_PROXY_CAPS (p->srcpad);
+        gst_element_add_pad (GST_ELEMENT (p), p->srcpad);
+
+        p->bitrate = DEFAULT_BITRATE;
+        p->fps = DEFAULT_FPS;
+        p->fraction = DEFAULT_FRACTION;
+        p->max_delay = DEFAULT_MAX_DELAY;
+        p->last_refill = GST_CLOCK_TIME_NONE;
+        p->backlog_start = GST_CLOCK_TIME_NONE;
+        gst_segment_init (&p->segment, GST_FORMAT_UNDEFINED);
+}
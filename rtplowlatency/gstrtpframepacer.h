@@ -0,0 +1,88 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_RTP_FRAME_PACER_H__
+#define __GST_RTP_FRAME_PACER_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_RTP_FRAME_PACER (gst_rtp_frame_pacer_get_type())
+#define GST_RTP_FRAME_PACER(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_RTP_FRAME_PACER,GstRtpFramePacer))
+#define GST_RTP_FRAME_PACER_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_RTP_FRAME_PACER,GstRtpFramePacerClass))
+#define GST_IS_RTP_FRAME_PACER(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_RTP_FRAME_PACER))
+#define GST_IS_RTP_FRAME_PACER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_RTP_FRAME_PACER))
+
+typedef struct _GstRtpFramePacer GstRtpFramePacer;
+typedef struct _GstRtpFramePacerClass GstRtpFramePacerClass;
+typedef struct _GstRtpFramePacerStats GstRtpFramePacerStats;
+
+GType gst_rtp_frame_pacer_get_type (void) G_GNUC_CONST;
+
+GST_DEBUG_CATEGORY_EXTERN (gst_debug_rtp_frame_pacer);
+
+/* Exposed through the "stats" property */
+struct _GstRtpFramePacerStats
+{
+  guint64 packets;
+  guint64 bytes;
+  guint64 paced_packets;
+  guint64 bursts;
+  GstClockTime total_delay;
+  GstClockTime max_delay;
+};
+
+struct _GstRtpFramePacer
+{
+  GstElement parent;
+
+  GstPad *sinkpad;
+  GstPad *srcpad;
+
+  /* properties, protected by the object lock */
+  guint bitrate;
+  gdouble fps;
+  gdouble fraction;
+  GstClockTime max_delay;
+
+  /* Token bucket in bits, one average frame deep, refilled at the rate
+   * that sends an average frame in fraction of the frame interval */
+  gdouble tokens;
+  GstClockTime last_refill;
+  /* Clock time the bucket last ran dry, bounds the hold-back time of
+   * packets without a timestamp */
+  GstClockTime backlog_start;
+  /* Segment of the sink pad, for the running time of the frames */
+  GstSegment segment;
+
+  GstClockID clock_id;
+  gboolean flushing;
+
+  /* protected by the object lock */
+  GstRtpFramePacerStats stats;
+};
+
+struct _GstRtpFramePacerClass
+{
+  GstElementClass parent_class;
+};
+
+G_END_DECLS
+
+#endif /* __GST_RTP_FRAME_PACER_H__ */
@@ -0,0 +1,106 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * SECTION:element-rtphdrextabssendtime
+ * @title: rtphdrextabssendtime
+ *
+ * RTP header extension carrying the absolute send time of the packet as
+ * 6.18 fixed point seconds, used by the receiver for delay based bandwidth
+ * estimation. The time is taken when the payloader writes the packet, so
+ * it must not be used on a stream that rtpframepacer holds back afterwards.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "gstrtphdrextabssendtime.h"
+
+GST_DEBUG_CATEGORY (gst_debug_rtp_hdrext_abs_send_time);
+#define GST_CAT_DEFAULT gst_debug_rtp_hdrext_abs_send_time
+
+#define ABS_SEND_TIME_SIZE 3
+
+#define gst_rtp_hdrext_abs_send_time_parent_class parent_class
+G_DEFINE_TYPE (GstRTPHeaderExtensionAbsSendTime, gst_rtp_hdrext_abs_send_time, GST_TYPE_RTP_HEADER_EXTENSION);
+
+static GstRTPHeaderExtensionFlags
+gst_rtp_hdrext_abs_send_time_get_supported_flags (GstRTPHeaderExtension * ext)
+{
+        return GST_RTP_HEADER_EXTENSION_ONE_BYTE | GST_RTP_HEADER_EXTENSION_TWO_BYTE;
+}
+
+static gsize
+gst_rtp_hdrext_abs_send_time_get_max_size (GstRTPHeaderExtension * ext, const GstBuffer * input_meta)
+{
+        return ABS_SEND_TIME_SIZE;
+}
+
+static gssize
+gst_rtp_hdrext_abs_send_time_write (GstRTPHeaderExtension * ext, const GstBuffer * input_meta,
+                GstRTPHeaderExtensionFlags write_flags, GstBuffer * output, guint8 * data, gsize size)
+{
+        guint64 now;
+        guint32 abs_send_time;
+
+        g_return_val_if_fail (size >= ABS_SEND_TIME_SIZE, -1);
+
+        /* 6.18 fixed point seconds, wrapping every 64 s */
+        now = g_get_monotonic_time ();
+        abs_send_time = (guint32) (((now << 18) / G_USEC_PER_SEC) & 0xffffff);
+
+        GST_WRITE_UINT24_BE (data, abs_send_time);
+
+        return ABS_SEND_TIME_SIZE;
+}
+
+static gboolean
+gst_rtp_hdrext_abs_send_time_read (GstRTPHeaderExtension * ext, GstRTPHeaderExtensionFlags read_flags,
+                const guint8 * data, gsize size, GstBuffer * buffer)
+{
+        if (size < ABS_SEND_TIME_SIZE)
+                return FALSE;
+
+        GST_LOG_OBJECT (ext, "abs-send-time %u", GST_READ_UINT24_BE (data));
+
+        return TRUE;
+}
+
+static void
+gst_rtp_hdrext_abs_send_time_class_init (GstRTPHeaderExtensionAbsSendTimeClass * klass)
+{
+        GstRTPHeaderExtensionClass *rtp_hdr_class = GST_RTP_HEADER_EXTENSION_CLASS (klass);
+        GstElementClass *ec = GST_ELEMENT_CLASS (klass);
+
+        rtp_hdr_class->get_supported_flags = gst_rtp_hdrext_abs_send_time_get_supported_flags;
+        rtp_hdr_class->get_max_size = gst_rtp_hdrext_abs_send_time_get_max_size;
+        rtp_hdr_class->write = gst_rtp_hdrext_abs_send_time_write;
+        rtp_hdr_class->read = gst_rtp_hdrext_abs_send_time_read;
+
+        gst_element_class_set_static_metadata (ec, "Absolute Send Time",
+                                                GST_RTP_HDREXT_ELEMENT_CLASS,
+                                                "Extends RTP packets with the absolute send time",
+                                                "CERIT-SC");
+        gst_element_class_add_static_metadata (ec, GST_RTP_HEADER_EXTENSION_URI_METADATA_KEY,
+                                                GST_RTP_HDREXT_ABS_SEND_TIME_URI);
+}
+
+static void
+gst_rtp_hdrext_abs_send_time_init (GstRTPHeaderExtensionAbsSendTime * ext)
+{
+}
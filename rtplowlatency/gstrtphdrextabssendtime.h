@@ -0,0 +1,52 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_RTP_HDREXT_ABS_SEND_TIME_H__
+#define __GST_RTP_HDREXT_ABS_SEND_TIME_H__
+
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+G_BEGIN_DECLS
+
+#define GST_RTP_HDREXT_ABS_SEND_TIME_URI "http://www.webrtc.org/experiments/rtp-hdrext/abs-send-time"
+
+#define GST_TYPE_RTP_HDREXT_ABS_SEND_TIME (gst_rtp_hdrext_abs_send_time_get_type())
+#define GST_RTP_HDREXT_ABS_SEND_TIME(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_RTP_HDREXT_ABS_SEND_TIME,GstRTPHeaderExtensionAbsSendTime))
+#define GST_IS_RTP_HDREXT_ABS_SEND_TIME(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_RTP_HDREXT_ABS_SEND_TIME))
+
+typedef struct _GstRTPHeaderExtensionAbsSendTime GstRTPHeaderExtensionAbsSendTime;
+typedef struct _GstRTPHeaderExtensionAbsSendTimeClass GstRTPHeaderExtensionAbsSendTimeClass;
+
+GType gst_rtp_hdrext_abs_send_time_get_type (void) G_GNUC_CONST;
+
+GST_DEBUG_CATEGORY_EXTERN (gst_debug_rtp_hdrext_abs_send_time);
+
+struct _GstRTPHeaderExtensionAbsSendTime
+{
+  GstRTPHeaderExtension parent;
+};
+
+struct _GstRTPHeaderExtensionAbsSendTimeClass
+{
+  GstRTPHeaderExtensionClass parent_class;
+};
+
+G_END_DECLS
+
+#endif /* __GST_RTP_HDREXT_ABS_SEND_TIME_H__ */
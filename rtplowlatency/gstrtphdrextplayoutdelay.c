@@ -0,0 +1,177 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/**
+ * SECTION:element-rtphdrextplayoutdelay
+ * @title: rtphdrextplayoutdelay
+ *
+ * RTP header extension telling the receiver the playout delay range it
+ * should keep, in 10 ms steps. With min-delay and max-delay 0 browsers
+ * render frames as soon as they are decoded.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "gstrtphdrextplayoutdelay.h"
+
+GST_DEBUG_CATEGORY (gst_debug_rtp_hdrext_playout_delay);
+#define GST_CAT_DEFAULT gst_debug_rtp_hdrext_playout_delay
+
+#define PLAYOUT_DELAY_SIZE 3
+/* 12 bits of 10 ms units */
+#define PLAYOUT_DELAY_MAX 40950
+
+enum
+{
+        PROP_0,
+        PROP_MIN_DELAY,
+        PROP_MAX_DELAY,
+};
+
+#define DEFAULT_MIN_DELAY 0
+#define DEFAULT_MAX_DELAY 0
+
+#define gst_rtp_hdrext_playout_delay_parent_class parent_class
+G_DEFINE_TYPE (GstRTPHeaderExtensionPlayoutDelay, gst_rtp_hdrext_playout_delay, GST_TYPE_RTP_HEADER_EXTENSION);
+
+static GstRTPHeaderExtensionFlags
+gst_rtp_hdrext_playout_delay_get_supported_flags (GstRTPHeaderExtension * ext)
+{
+        return GST_RTP_HEADER_EXTENSION_ONE_BYTE | GST_RTP_HEADER_EXTENSION_TWO_BYTE;
+}
+
+static gsize
+gst_rtp_hdrext_playout_delay_get_max_size (GstRTPHeaderExtension * ext, const GstBuffer * input_meta)
+{
+        return PLAYOUT_DELAY_SIZE;
+}
+
+static gssize
+gst_rtp_hdrext_playout_delay_write (GstRTPHeaderExtension * ext, const GstBuffer * input_meta,
+                GstRTPHeaderExtensionFlags write_flags, GstBuffer * output, guint8 * data, gsize size)
+{
+        GstRTPHeaderExtensionPlayoutDelay *self = GST_RTP_HDREXT_PLAYOUT_DELAY (ext);
+        guint min_delay, max_delay;
+
+        g_return_val_if_fail (size >= PLAYOUT_DELAY_SIZE, -1);
+
+        GST_OBJECT_LOCK (self);
+        min_delay = self->min_delay / 10;
+        max_delay = self->max_delay / 10;
+        GST_OBJECT_UNLOCK (self);
+
+        data[0] = min_delay >> 4;
+        data[1] = ((min_delay & 0xf) << 4) | (max_delay >> 8);
+        data[2] = max_delay & 0xff;
+
+        return PLAYOUT_DELAY_SIZE;
+}
+
+static gboolean
+gst_rtp_hdrext_playout_delay_read (GstRTPHeaderExtension * ext, GstRTPHeaderExtensionFlags read_flags,
+                const guint8 * data, gsize size, GstBuffer * buffer)
+{
+        if (size < PLAYOUT_DELAY_SIZE)
+                return FALSE;
+
+        GST_LOG_OBJECT (ext, "playout delay min %u ms max %u ms",
+                        ((data[0] << 4) | (data[1] >> 4)) * 10, (((data[1] & 0xf) << 8) | data[2]) * 10);
+
+        return TRUE;
+}
+
+static void
+gst_rtp_hdrext_playout_delay_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+        GstRTPHeaderExtensionPlayoutDelay *self = GST_RTP_HDREXT_PLAYOUT_DELAY (object);
+
+        GST_OBJECT_LOCK (self);
+        switch (prop_id) {
+                case PROP_MIN_DELAY:
+                        self->min_delay = g_value_get_uint (value);
+                        break;
+                case PROP_MAX_DELAY:
+                        self->max_delay = g_value_get_uint (value);
+                        break;
+                default:
+                        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+                        break;
+        }
+        GST_OBJECT_UNLOCK (self);
+}
+
+static void
+gst_rtp_hdrext_playout_delay_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec)
+{
+        GstRTPHeaderExtensionPlayoutDelay *self = GST_RTP_HDREXT_PLAYOUT_DELAY (object);
+
+        GST_OBJECT_LOCK (self);
+        switch (prop_id) {
+                case PROP_MIN_DELAY:
+                        g_value_set_uint (value, self->min_delay);
+                        break;
+                case PROP_MAX_DELAY:
+                        g_value_set_uint (value, self->max_delay);
+                        break;
+                default:
+                        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+                        break;
+        }
+        GST_OBJECT_UNLOCK (self);
+}
+
+static void
+gst_rtp_hdrext_playout_delay_class_init (GstRTPHeaderExtensionPlayoutDelayClass * klass)
+{
+        GObjectClass *gc = G_OBJECT_CLASS (klass);
+        GstRTPHeaderExtensionClass *rtp_hdr_class = GST_RTP_HEADER_EXTENSION_CLASS (klass);
+        GstElementClass *ec = GST_ELEMENT_CLASS (klass);
+
+        gc->set_property = gst_rtp_hdrext_playout_delay_set_property;
+        gc->get_property = gst_rtp_hdrext_playout_delay_get_property;
+
+        g_object_class_install_property (gc, PROP_MIN_DELAY,
+                                                g_param_spec_uint ("min-delay", "Minimum delay",
+                                                "Minimum playout delay in milliseconds, rounded down to 10 ms",
+                                                0, PLAYOUT_DELAY_MAX, DEFAULT_MIN_DELAY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MAX_DELAY,
+                                                g_param_spec_uint ("max-delay", "Maximum delay",
+                                                "Maximum playout delay in milliseconds, rounded down to 10 ms",
+                                                0, PLAYOUT_DELAY_MAX, DEFAULT_MAX_DELAY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        rtp_hdr_class->get_supported_flags = gst_rtp_hdrext_playout_delay_get_supported_flags;
+        rtp_hdr_class->get_max_size = gst_rtp_hdrext_playout_delay_get_max_size;
+        rtp_hdr_class->write = gst_rtp_hdrext_playout_delay_write;
+        rtp_hdr_class->read = gst_rtp_hdrext_playout_delay_read;
+
+        gst_element_class_set_static_metadata (ec, "Playout Delay",
+                                                GST_RTP_HDREXT_ELEMENT_CLASS,
+                                                "Extends RTP packets with the playout delay the receiver should use",
+                                                "CERIT-SC");
+        gst_element_class_add_static_metadata (ec, GST_RTP_HEADER_EXTENSION_URI_METADATA_KEY,
+                                                GST_RTP_HDREXT_PLAYOUT_DELAY_URI);
+}
+
+static void
+gst_rtp_hdrext_playout_delay_init (GstRTPHeaderExtensionPlayoutDelay * self)
+{
+        self->min_delay = DEFAULT_MIN_DELAY;
+        self->max_delay = DEFAULT_MAX_DELAY;
+}
@@ -0,0 +1,56 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_RTP_HDREXT_PLAYOUT_DELAY_H__
+#define __GST_RTP_HDREXT_PLAYOUT_DELAY_H__
+
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+G_BEGIN_DECLS
+
+#define GST_RTP_HDREXT_PLAYOUT_DELAY_URI "http://www.webrtc.org/experiments/rtp-hdrext/playout-delay"
+
+#define GST_TYPE_RTP_HDREXT_PLAYOUT_DELAY (gst_rtp_hdrext_playout_delay_get_type())
+#define GST_RTP_HDREXT_PLAYOUT_DELAY(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_RTP_HDREXT_PLAYOUT_DELAY,GstRTPHeaderExtensionPlayoutDelay))
+#define GST_IS_RTP_HDREXT_PLAYOUT_DELAY(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_RTP_HDREXT_PLAYOUT_DELAY))
+
+typedef struct _GstRTPHeaderExtensionPlayoutDelay GstRTPHeaderExtensionPlayoutDelay;
+typedef struct _GstRTPHeaderExtensionPlayoutDelayClass GstRTPHeaderExtensionPlayoutDelayClass;
+
+GType gst_rtp_hdrext_playout_delay_get_type (void) G_GNUC_CONST;
+
+GST_DEBUG_CATEGORY_EXTERN (gst_debug_rtp_hdrext_playout_delay);
+
+struct _GstRTPHeaderExtensionPlayoutDelay
+{
+  GstRTPHeaderExtension parent;
+
+  /* in milliseconds, protected by the object lock */
+  guint min_delay;
+  guint max_delay;
+};
+
+struct _GstRTPHeaderExtensionPlayoutDelayClass
+{
+  GstRTPHeaderExtensionClass parent_class;
+};
+
+G_END_DECLS
+
+#endif /* __GST_RTP_HDREXT_PLAYOUT_DELAY_H__ */
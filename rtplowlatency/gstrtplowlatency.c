@@ -0,0 +1,55 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "gstrtpframepacer.h"
+#include "gstrtphdrextabssendtime.h"
+#include "gstrtphdrextplayoutdelay.h"
+
+static gboolean
+plugin_init (GstPlugin * plugin)
+{
+        gboolean ret;
+
+        GST_DEBUG_CATEGORY_INIT (gst_debug_rtp_frame_pacer, "rtpframepacer", 0,
+                                        "rtpframepacer element debug");
+
+        GST_DEBUG_CATEGORY_INIT (gst_debug_rtp_hdrext_abs_send_time, "rtphdrextabssendtime", 0,
+                                        "rtphdrextabssendtime element debug");
+        GST_DEBUG_CATEGORY_INIT (gst_debug_rtp_hdrext_playout_delay, "rtphdrextplayoutdelay", 0,
+                                        "rtphdrextplayoutdelay element debug");
+
+        ret = gst_element_register (plugin, "rtpframepacer", GST_RANK_NONE, GST_TYPE_RTP_FRAME_PACER);
+        ret &= gst_element_register (plugin, "rtphdrextabssendtime", GST_RANK_MARGINAL,
+                                        GST_TYPE_RTP_HDREXT_ABS_SEND_TIME);
+        ret &= gst_element_register (plugin, "rtphdrextplayoutdelay", GST_RANK_MARGINAL,
+                                        GST_TYPE_RTP_HDREXT_PLAYOUT_DELAY);
+
+        return ret;
+}
+
+GST_PLUGIN_DEFINE (GST_VERSION_MAJOR,
+    GST_VERSION_MINOR,
+    rtplowlatency,
+    "RTP elements for low latency desktop streaming",
+    plugin_init, VERSION, GST_LICENSE, GST_PACKAGE_NAME, GST_PACKAGE_ORIGIN);
@@ -0,0 +1,236 @@
+# Copyright 2021 The Selkies Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import logging
+logger = logging.getLogger("congestion_control")
+
+# Loss above which the rate is reduced and below which it may grow, 0-1.
+LOSS_HIGH = 0.10
+LOSS_LOW = 0.02
+
+# Queueing delay on top of the base RTT that is treated as overuse, seconds.
+RTT_OVERUSE = 0.05
+
+# TWCC average delta-of-delta that is treated as overuse, nanoseconds.
+TWCC_OVERUSE = 5000000
+
+# Multiplicative decrease on overuse and increase per second otherwise.
+DECREASE_FACTOR = 0.85
+INCREASE_PER_SECOND = 1.08
+
+# Minimum time between two decreases so that one congestion event, reported
+# by several stats snapshots, does not cut the rate repeatedly, seconds.
+DECREASE_HOLDOFF = 0.5
+
+# Relative change below which the encoder is not reconfigured.
+MIN_CHANGE = 0.03
+
+
+class CongestionController:
+    """Delay and loss based sender side estimator of the video bitrate.
+
+    The loss based part follows the receiver reported loss, the delay based
+    part the TWCC delta-of-delta when transport-cc is negotiated and the RTT
+    growth over its minimum otherwise. The smaller of the two wins.
+    """
+
+    def __init__(self, bitrate, min_bitrate=500, max_bitrate=None):
+        """Arguments:
+            bitrate {integer} -- initial bitrate in kbps.
+            min_bitrate {integer} -- lowest bitrate the controller goes to in kbps.
+            max_bitrate {integer} -- highest bitrate in kbps, defaults to the initial bitrate.
+        """
+
+        self.min_bitrate = min_bitrate
+        self.max_bitrate = max_bitrate or bitrate
+        self.initial_bitrate = bitrate
+
+        self.protection_overhead = 0.0
+
+        self.on_bitrate = lambda bitrate: logger.warn(
+            "unhandled on_bitrate")
+
+        self.reset()
+
+    def reset(self):
+        self.bitrate = min(self.initial_bitrate, self.max_bitrate)
+        self.applied_bitrate = self.bitrate
+        self.min_rtt = None
+        self.last_update = None
+        self.last_decrease = None
+
+    def set_max_bitrate(self, max_bitrate):
+        """Sets the ceiling, e.g. when the user selects a bitrate in the client.
+
+        Arguments:
+            max_bitrate {integer} -- highest bitrate in kbps.
+        """
+
+        self.max_bitrate = max_bitrate
+        self.initial_bitrate = max_bitrate
+        self.bitrate = min(self.bitrate, max_bitrate)
+
+        # The caller sets the encoder to the new ceiling, the next update
+        # brings it back to the estimate.
+        self.applied_bitrate = max_bitrate
+
+    def set_protection_overhead(self, overhead):
+        """Leaves room for FEC in the estimate, applied with the next update.
+
+        Arguments:
+            overhead {float} -- FEC bitrate relative to the media bitrate, e.g. 0.2 for 20%.
+        """
+
+        self.protection_overhead = overhead
+
+    def update(self, stats):
+        """Feeds one stats snapshot to the estimator.
+
+        Arguments:
+            stats {VideoTransportStats} -- video stats from WebRTCStatsMonitor.
+        """
+
+        now = stats.timestamp
+        dt = 0 if self.last_update is None else max(0.0, now - self.last_update)
+        self.last_update = now
+
+        loss_target = self.__loss_based(stats, dt)
+        delay_target = self.__delay_based(stats, dt)
+        target = min(loss_target, delay_target)
+
+        if target < self.bitrate:
+            if self.last_decrease is not None and now - self.last_decrease < DECREASE_HOLDOFF:
+                target = self.bitrate
+            else:
+                self.last_decrease = now
+
+        self.bitrate = max(self.min_bitrate, min(self.max_bitrate, target))
+
+        # The encoder gets what is left after the FEC overhead.
+        media_bitrate = int(self.bitrate / (1 + self.protection_overhead))
+
+        if abs(media_bitrate - self.applied_bitrate) > self.applied_bitrate * MIN_CHANGE or \
+                (media_bitrate != self.applied_bitrate and self.bitrate in (self.min_bitrate, self.max_bitrate)):
+            logger.debug("video bitrate %d -> %d kbps, loss %.3f, rtt %s" % (
+                self.applied_bitrate, media_bitrate, self.__loss(stats), stats.rtt))
+            self.applied_bitrate = media_bitrate
+            self.on_bitrate(self.applied_bitrate)
+
+    def __loss(self, stats):
+        if stats.twcc and "packet-loss-pct" in stats.twcc:
+            return stats.twcc["packet-loss-pct"] / 100.0
+        return stats.fraction_lost
+
+    def __loss_based(self, stats, dt):
+        loss = self.__loss(stats)
+
+        # A receiver report is repeated in the stats until the next one
+        # arrives, only react to a high loss once.
+        fresh = stats.twcc is not None or stats.rr_fresh
+        if loss > LOSS_HIGH:
+            return self.bitrate * (1 - 0.5 * loss) if fresh else self.bitrate
+        if loss < LOSS_LOW:
+            return self.bitrate * INCREASE_PER_SECOND ** dt
+        return self.bitrate
+
+    def __delay_based(self, stats, dt):
+        overuse = False
+
+        if stats.twcc and "avg-delta-of-delta" in stats.twcc:
+            overuse = stats.twcc["avg-delta-of-delta"] > TWCC_OVERUSE
+        elif stats.rtt is not None and stats.rr_fresh:
+            if self.min_rtt is None or stats.rtt < self.min_rtt:
+                self.min_rtt = stats.rtt
+            overuse = stats.rtt - self.min_rtt > RTT_OVERUSE
+
+        if overuse:
+            # Fall below what actually gets through, if we know it.
+            received = stats.twcc.get("bitrate-recv", 0) / 1000 if stats.twcc else 0
+            if received > 0:
+                return min(self.bitrate, received) * DECREASE_FACTOR
+            return self.bitrate * DECREASE_FACTOR
+
+        return self.bitrate * INCREASE_PER_SECOND ** dt
+
+
+# Smoothed loss at which FEC is turned on, at any RTT and with a long RTT.
+FEC_LOSS_ANY_RTT = 0.05
+FEC_LOSS_LONG_RTT = 0.01
+
+# RTT above which NACK retransmissions arrive too late to be useful, seconds.
+FEC_LONG_RTT = 0.1
+
+# Smoothed loss below which FEC is turned off after FEC_OFF_HOLD seconds.
+FEC_LOSS_OFF = 0.005
+FEC_OFF_HOLD = 5.0
+
+# FEC packets per lost packet and the bounds of fec-percentage.
+FEC_REDUNDANCY = 3
+FEC_PERCENTAGE_STEP = 5
+FEC_PERCENTAGE_MAX = 50
+
+
+class FECController:
+    """Scales the ULPFEC protection of the video stream with loss and RTT.
+
+    On short RTT links NACK is enough and FEC stays off, on long RTT links
+    retransmissions come too late and FEC takes over. With no loss FEC is
+    turned off again so that no bandwidth is wasted.
+    """
+
+    def __init__(self):
+        self.on_percentage = lambda percentage: logger.warn(
+            "unhandled on_percentage")
+
+        self.reset()
+
+    def reset(self):
+        self.percentage = 0
+        self.loss = 0.0
+        self.rtt = None
+        self.last_needed = None
+
+    def update(self, stats):
+        """Feeds one stats snapshot to the controller.
+
+        Arguments:
+            stats {VideoTransportStats} -- video stats from WebRTCStatsMonitor.
+        """
+
+        now = stats.timestamp
+
+        if stats.twcc and "packet-loss-pct" in stats.twcc:
+            self.loss = 0.7 * self.loss + 0.3 * stats.twcc["packet-loss-pct"] / 100.0
+        elif stats.rr_fresh:
+            self.loss = 0.7 * self.loss + 0.3 * stats.fraction_lost
+
+        if stats.rtt is not None:
+            self.rtt = stats.rtt
+
+        percentage = self.percentage
+        long_rtt = self.rtt is not None and self.rtt >= FEC_LONG_RTT
+
+        if self.loss >= FEC_LOSS_ANY_RTT or (long_rtt and self.loss >= FEC_LOSS_LONG_RTT):
+            self.last_needed = now
+            steps = -(-int(self.loss * 100 * FEC_REDUNDANCY) // FEC_PERCENTAGE_STEP)
+            percentage = max(FEC_PERCENTAGE_STEP, min(FEC_PERCENTAGE_MAX, steps * FEC_PERCENTAGE_STEP))
+        elif self.loss < FEC_LOSS_OFF and self.percentage:
+            if self.last_needed is None or now - self.last_needed >= FEC_OFF_HOLD:
+                percentage = 0
+
+        if percentage != self.percentage:
+            logger.info("video fec-percentage %d -> %d, loss %.3f, rtt %s" % (
+                self.percentage, percentage, self.loss, self.rtt))
+            self.percentage = percentage
+            self.on_percentage(percentage)
@@ -12,28 +12,248 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-import GPUtil
+import json
+import threading
 import time
 
 import logging
 logger = logging.getLogger("gpu_monitor")
 
 
+class GPUStats:
+    """One sample of the counters of a GPU.
+
+    Attributes:
+        index {int} -- GPU index.
+        load {float} -- GPU utilization, 0-1.
+        memory_load {float} -- memory controller utilization, 0-1.
+        memory_total {float} -- total memory in MB.
+        memory_used {float} -- used memory in MB.
+        encoder_load {float} -- NVENC utilization, 0-1.
+        decoder_load {float} -- NVDEC utilization, 0-1.
+        encoder_sessions {int} -- active NVENC sessions of all processes.
+        encoder_fps {float} -- average fps of the NVENC sessions.
+        encoder_latency {float} -- average NVENC encode latency in microseconds.
+    """
+
+    def __init__(self, index=0):
+        self.index = index
+        self.load = 0.0
+        self.memory_load = 0.0
+        self.memory_total = 0.0
+        self.memory_used = 0.0
+        self.encoder_load = 0.0
+        self.decoder_load = 0.0
+        self.encoder_sessions = 0
+        self.encoder_fps = 0.0
+        self.encoder_latency = 0.0
+
+
+class GPUSampler:
+    """Source of GPUStats, implemented by NVMLSampler and FileSampler."""
+
+    def sample(self, index):
+        """Reads the current counters of a GPU.
+
+        Arguments:
+            index {int} -- GPU index.
+
+        Returns:
+            [GPUStats] -- the counters.
+        """
+        raise NotImplementedError()
+
+    def count(self):
+        """Returns the number of GPUs."""
+        raise NotImplementedError()
+
+    def close(self):
+        pass
+
+
+class NVMLSampler(GPUSampler):
+    """Reads the counters in process through NVML, no nvidia-smi is spawned."""
+
+    def __init__(self):
+        import pynvml
+        self.nvml = pynvml
+        self.nvml.nvmlInit()
+        self.handles = {}
+
+    def sample(self, index):
+        nvml = self.nvml
+
+        handle = self.handles.get(index)
+        if handle is None:
+            handle = nvml.nvmlDeviceGetHandleByIndex(index)
+            self.handles[index] = handle
+
+        res = GPUStats(index)
+
+        util = nvml.nvmlDeviceGetUtilizationRates(handle)
+        res.load = util.gpu / 100.0
+        res.memory_load = util.memory / 100.0
+
+        mem = nvml.nvmlDeviceGetMemoryInfo(handle)
+        res.memory_total = mem.total / 1048576.0
+        res.memory_used = mem.used / 1048576.0
+
+        # Both return the utilization and the sampling period. GPUs without
+        # NVENC or NVDEC, e.g. A100 or some vGPU profiles, do not support
+        # them, the loads stay 0 there.
+        try:
+            res.encoder_load = nvml.nvmlDeviceGetEncoderUtilization(handle)[0] / 100.0
+        except nvml.NVMLError as e:
+            logger.debug("no encoder utilization on GPU %d: %s" % (index, e))
+        try:
+            res.decoder_load = nvml.nvmlDeviceGetDecoderUtilization(handle)[0] / 100.0
+        except nvml.NVMLError as e:
+            logger.debug("no decoder utilization on GPU %d: %s" % (index, e))
+
+        try:
+            sessions, fps, latency = nvml.nvmlDeviceGetEncoderStats(handle)
+            res.encoder_sessions = sessions
+            res.encoder_fps = float(fps)
+            res.encoder_latency = float(latency)
+        except nvml.NVMLError as e:
+            logger.debug("no encoder stats on GPU %d: %s" % (index, e))
+
+        return res
+
+    def count(self):
+        return self.nvml.nvmlDeviceGetCount()
+
+    def close(self):
+        self.handles = {}
+        self.nvml.nvmlShutdown()
+
+
+class FileSampler(GPUSampler):
+    """Reads the counters from a JSON file, for testing without a GPU.
+
+    The file holds a list with one object per GPU, the keys are the
+    GPUStats attribute names. Missing keys and GPUs read as 0.
+    """
+
+    def __init__(self, path):
+        self.path = path
+
+    def sample(self, index):
+        with open(self.path, 'r') as f:
+            gpus = json.load(f)
+
+        res = GPUStats(index)
+        if index < len(gpus):
+            for k, v in gpus[index].items():
+                if hasattr(res, k) and k != "index":
+                    setattr(res, k, v)
+        return res
+
+    def count(self):
+        with open(self.path, 'r') as f:
+            return len(json.load(f))
+
+
+class SharedSampler(GPUSampler):
+    """Shares one sampler between the monitors of all sessions in the process.
+
+    A sample younger than max_age is returned from the cache, so the
+    counters are read once per period no matter how many sessions ask.
+    """
+
+    def __init__(self, sampler, max_age=0.5):
+        self.sampler = sampler
+        self.max_age = max_age
+        self.lock = threading.Lock()
+        self.cache = {}
+
+    def sample(self, index):
+        with self.lock:
+            now = time.time()
+            cached = self.cache.get(index)
+            if cached is not None and now - cached[0] < self.max_age:
+                return cached[1]
+
+            res = self.sampler.sample(index)
+            self.cache[index] = (now, res)
+            return res
+
+    def count(self):
+        return self.sampler.count()
+
+    def close(self):
+        with self.lock:
+            self.cache = {}
+            self.sampler.close()
+
+
+_shared_sampler = None
+_shared_sampler_lock = threading.Lock()
+
+
+def get_shared_sampler(stats_file=None):
+    """Returns the process wide sampler, created on first use.
+
+    Arguments:
+        stats_file {string} -- read the counters from this JSON file instead of NVML.
+
+    Returns:
+        [SharedSampler] -- the sampler.
+    """
+
+    global _shared_sampler
+    with _shared_sampler_lock:
+        if _shared_sampler is None:
+            if stats_file:
+                sampler = FileSampler(stats_file)
+            else:
+                sampler = NVMLSampler()
+            _shared_sampler = SharedSampler(sampler)
+        return _shared_sampler
+
+
+def least_loaded_gpu(sampler):
+    """Picks the GPU with the lowest NVENC utilization for a new session.
+
+    The GPU load breaks ties, so idle GPUs are filled from the one that
+    does the least other work.
+
+    Arguments:
+        sampler {GPUSampler} -- source of the counters.
+
+    Returns:
+        [int] -- GPU index.
+    """
+
+    stats = [sampler.sample(i) for i in range(sampler.count())]
+    if not stats:
+        return 0
+    return min(stats, key=lambda s: (s.encoder_load, s.load, s.index)).index
+
+
 class GPUMonitor:
-    def __init__(self, period=1, enabled=True):
+    def __init__(self, period=1, enabled=True, gpu_index=0, sampler=None):
         self.period = period
         self.enabled = enabled
         self.running = False
 
-        self.on_stats = lambda load, memoryTotal, memoryUsed: logger.warn(
+        self.gpu_index = gpu_index
+        self.sampler = sampler
+
+        self.on_stats = lambda stats: logger.warn(
             "unhandled on_stats")
 
     def start(self):
         self.running = True
         while self.running:
             if self.enabled:
-                gpu = GPUtil.getGPUs()[0]
-                self.on_stats(gpu.load, gpu.memoryTotal, gpu.memoryUsed)
+                try:
+                    if self.sampler is None:
+                        self.sampler = get_shared_sampler()
+                    self.on_stats(self.sampler.sample(self.gpu_index))
+                except Exception as e:
+                    logger.error("failed to read GPU stats, disabling GPU monitor: %s" % e)
+                    self.enabled = False
             time.sleep(self.period)
 
     def stop(self):
@@ -21,19 +21,35 @@ import gi
 gi.require_version("Gst", "1.0")
 gi.require_version('GstWebRTC', '1.0')
 gi.require_version('GstSdp', '1.0')
+gi.require_version('GstRtp', '1.0')
+gi.require_version('GstVideo', '1.0')
 from gi.repository import Gst
 from gi.repository import GstWebRTC
 from gi.repository import GstSdp
+from gi.repository import GstRtp
+from gi.repository import GstVideo
 
 logger = logging.getLogger("gstwebrtc_app")
 logger.setLevel(logging.INFO)
 
+RTP_HDREXT_TWCC = "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
+RTP_HDREXT_ABS_SEND_TIME = "http://www.webrtc.org/experiments/rtp-hdrext/abs-send-time"
+RTP_HDREXT_PLAYOUT_DELAY = "http://www.webrtc.org/experiments/rtp-hdrext/playout-delay"
+
+# Header extensions added to every payloader, the position is the extension id.
+RTP_HEADER_EXTENSIONS = [RTP_HDREXT_TWCC, RTP_HDREXT_ABS_SEND_TIME, RTP_HDREXT_PLAYOUT_DELAY]
+
+# H.264 payload types offered with 4:4:4, the client answers with those it decodes.
+H264_PAYLOAD_444 = 122
+H264_PAYLOAD_HIGH = 123
+
+
 class GSTWebRTCAppError(Exception):
     pass
 
 
 class GSTWebRTCApp:
-    def __init__(self, stun_servers=None, turn_servers=None, audio=True, framerate=30, encoder=None, video_bitrate=2000, audio_bitrate=64000):
+    def __init__(self, stun_servers=None, turn_servers=None, audio=True, framerate=30, encoder=None, video_bitrate=2000, audio_bitrate=64000, video_pacing=False, video_fec=False, video_queue_latency=50, gpu=-1, capture_mode="auto", raw_capture=False, unchanged_frame_interval=0, yuv444=False, refine_qp=0, content_adaptive=False, text_fps=0, idle_fps=1, high_refresh=False, sched_policy="other", sched_priority=10, cpu_affinity="", numa_local=False):
         """Initialize gstreamer webrtc app.
 
         Initializes GObjects and checks for required plugins.
@@ -43,6 +59,23 @@ class GSTWebRTCApp:
                                     stun:<host>:<port>
             turn_servers {[list of strings]} -- Optional TURN server uris in the form of:
                                     turn://<user>:<password>@<host>:<port>
+            video_pacing {bool} -- spread the RTP packets of large video frames over the frame interval.
+            video_fec {bool} -- negotiate ULPFEC/RED for video, the protection is set with set_video_fec_percentage().
+            video_queue_latency {integer} -- milliseconds of video each stage queue holds before it drops the oldest raw buffers, or encoded ones up to the next keyframe.
+            gpu {integer} -- GPU to capture and encode on, -1 lets nvimagesrc pick the one with the fewest sessions.
+            capture_mode {string} -- nvimagesrc capture path, "gl", "cuda", "xshm" for hosts without a GPU or "auto".
+            raw_capture {bool} -- capture with nvimagesrc instead of ximagesrc for the software encoders.
+            unchanged_frame_interval {integer} -- with raw_capture, drop frames without screen changes but send one every this many milliseconds, 0 disables.
+            yuv444 {bool} -- prefer H.264 4:4:4 from nvimagesrc, 4:2:0 is used if the GPU or the client lacks it.
+            refine_qp {integer} -- nvimagesrc re-encodes a still screen in steps down to this QP, 0 disables.
+            content_adaptive {bool} -- let nvimagesrc switch its encoder between a text and a motion profile.
+            text_fps {integer} -- with content_adaptive, frame rate of the text profile, 0 keeps the framerate.
+            idle_fps {integer} -- keep-alive frame rate of nvimagesrc while the user is idle and the screen static, 0 keeps the framerate.
+            high_refresh {bool} -- let nvimagesrc capture frames as they are presented and overlap capture and encode, for 90 fps and more.
+            sched_policy {string} -- scheduling policy of the nvimagesrc capture threads, "other", "fifo" or "rr".
+            sched_priority {integer} -- real-time priority of the "fifo" and "rr" sched_policy.
+            cpu_affinity {string} -- CPUs the nvimagesrc capture threads run on, e.g. "2-5,8", empty for all.
+            numa_local {bool} -- keep the nvimagesrc capture threads on the CPUs of the NUMA node of their GPU.
         """
 
         self.stun_servers = stun_servers
@@ -56,6 +89,24 @@ class GSTWebRTCApp:
         self.framerate = framerate
         self.video_bitrate = video_bitrate
         self.audio_bitrate = audio_bitrate
+        self.video_pacing = video_pacing
+        self.video_fec = video_fec
+        self.video_queue_latency = video_queue_latency
+        self.gpu = gpu
+        self.capture_mode = capture_mode
+        self.raw_capture = raw_capture
+        self.unchanged_frame_interval = unchanged_frame_interval
+        self.yuv444 = yuv444
+        self.refine_qp = refine_qp
+        self.content_adaptive = content_adaptive
+        self.text_fps = text_fps
+        self.idle_fps = idle_fps
+        self.idle = False
+        self.high_refresh = high_refresh
+        self.sched_policy = sched_policy
+        self.sched_priority = sched_priority
+        self.cpu_affinity = cpu_affinity
+        self.numa_local = numa_local
 
         # WebRTC ICE and SDP events
         self.on_ice = lambda mlineindex, candidate: logger.warn(
@@ -77,6 +128,18 @@ class GSTWebRTCApp:
         self.ximagesrc = None
         self.last_cursor_sent = None
         self.nvimagesrc = None
+        self.nvimagesrc_capsfilter = None
+        self.rtph264pay_capsfilter = None
+
+        # Stage queues of the video branch and their drop counts.
+        self.video_queues = {}
+        self.video_queue_drops = {}
+        # Encoded stages dropping until the next keyframe.
+        self.video_queue_skipping = set()
+
+        # Encoded video frames counted after the encoder.
+        self.video_frames_encoded = 0
+        self.video_keyframes_encoded = 0
 
     def stop_ximagesrc(self):
         """Helper function to stop the ximagesrc, useful when resizing
@@ -141,19 +204,36 @@ class GSTWebRTCApp:
             self.nvimagesrc.set_property("show-pointer", 0)
             self.nvimagesrc.set_property("bitrate", 2000000)
             self.nvimagesrc.set_property("do-timestamp", True)
+            self.nvimagesrc.set_property("gpu", self.gpu)
+            Gst.util_set_object_arg(self.nvimagesrc, "capture-mode", self.capture_mode)
+            self.nvimagesrc.set_property("refine-qp", self.refine_qp)
+            self.nvimagesrc.set_property("content-adaptive", self.content_adaptive)
+            self.nvimagesrc.set_property("text-fps", self.text_fps)
+            self.nvimagesrc.set_property("idle-fps", self.idle_fps)
+            self.nvimagesrc.set_property("idle", self.idle)
+            self.nvimagesrc.set_property("high-refresh", self.high_refresh)
+            self.__set_nvimagesrc_sched()
             videoconvert_caps = Gst.caps_from_string("video/x-h264")
+            if self.yuv444:
+                # In order of preference, nvimagesrc only offers 4:4:4 if
+                # its GPU can encode it.
+                videoconvert_caps = Gst.caps_from_string(
+                    "video/x-h264,profile=high-4:4:4;video/x-h264,profile=high")
             videoconvert_caps.set_value("framerate", Gst.Fraction(self.framerate, 1))
             videoconvert_capsfilter = Gst.ElementFactory.make("capsfilter")
             videoconvert_capsfilter.set_property("caps", videoconvert_caps)
+            self.nvimagesrc_capsfilter = videoconvert_capsfilter
             rtph264pay = Gst.ElementFactory.make("rtph264pay")
             rtph264pay_caps = Gst.caps_from_string("application/x-rtp")
             rtph264pay_caps.set_value("media", "video")
             rtph264pay_caps.set_value("encoding-name", "H264")
-            rtph264pay_caps.set_value("payload", 123)
+            rtph264pay_caps.set_value("payload", H264_PAYLOAD_444 if self.yuv444 else H264_PAYLOAD_HIGH)
             rtph264pay_caps.set_value("aggregate-mode", "zero-latency")
             rtph264pay_caps.set_value("rtcp-fb-ccm-fir", True)
+            self.__add_rtp_header_extensions(rtph264pay, rtph264pay_caps, self.video_pacing)
             rtph264pay_capsfilter = Gst.ElementFactory.make("capsfilter")
             rtph264pay_capsfilter.set_property("caps", rtph264pay_caps)
+            self.rtph264pay_capsfilter = rtph264pay_capsfilter
             self.pipeline.add(self.nvimagesrc)
             self.pipeline.add(videoconvert_capsfilter)
             self.pipeline.add(rtph264pay)
@@ -161,23 +241,31 @@ class GSTWebRTCApp:
             if not Gst.Element.link(self.nvimagesrc, videoconvert_capsfilter):
                 raise GSTWebRTCAppError("Failed to link nvimagesrc -> videoconvert")
 
-            if not Gst.Element.link(videoconvert_capsfilter, rtph264pay):
-                raise GSTWebRTCAppError(
-                    "Failed to link videoconvert_capsfilter -> rpth264pay")
+            self.__link_video_stage(videoconvert_capsfilter, rtph264pay, "encode", encoded=True)
 
             if not Gst.Element.link(rtph264pay, rtph264pay_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link rtph264pay -> rtph264pay_capsfilter")
 
             # Link the last element to the webrtcbin
-            if not Gst.Element.link(rtph264pay_capsfilter, self.webrtcbin):
-                raise GSTWebRTCAppError(
-                    "Failed to link rtph264pay_capsfilter -> webrtcbin")
+            self.__link_video_to_webrtcbin(rtph264pay_capsfilter)
+
+            if self.yuv444:
+                self.__offer_h264_444(rtph264pay_caps)
         elif self.encoder in ["nvfbchevcenc"]:
             self.nvimagesrc = Gst.ElementFactory.make("nvimagesrchevc", "x11")
             self.nvimagesrc.set_property("show-pointer", 0)
             self.nvimagesrc.set_property("bitrate", 2000000)
             self.nvimagesrc.set_property("do-timestamp", True)
+            self.nvimagesrc.set_property("gpu", self.gpu)
+            Gst.util_set_object_arg(self.nvimagesrc, "capture-mode", self.capture_mode)
+            self.nvimagesrc.set_property("refine-qp", self.refine_qp)
+            self.nvimagesrc.set_property("content-adaptive", self.content_adaptive)
+            self.nvimagesrc.set_property("text-fps", self.text_fps)
+            self.nvimagesrc.set_property("idle-fps", self.idle_fps)
+            self.nvimagesrc.set_property("idle", self.idle)
+            self.nvimagesrc.set_property("high-refresh", self.high_refresh)
+            self.__set_nvimagesrc_sched()
             videoconvert_caps = Gst.caps_from_string("video/x-h265")
             videoconvert_caps.set_value("framerate", Gst.Fraction(self.framerate, 1))
             videoconvert_capsfilter = Gst.ElementFactory.make("capsfilter")
@@ -189,6 +277,7 @@ class GSTWebRTCApp:
             rtph265pay_caps.set_value("payload", 96)
             rtph265pay_caps.set_value("aggregate-mode", "zero-latency")
             rtph265pay_caps.set_value("rtcp-fb-ccm-fir", True)
+            self.__add_rtp_header_extensions(rtph265pay, rtph265pay_caps, self.video_pacing)
             rtph265pay_capsfilter = Gst.ElementFactory.make("capsfilter")
             rtph265pay_capsfilter.set_property("caps", rtph265pay_caps)
             self.pipeline.add(self.nvimagesrc)
@@ -198,18 +287,52 @@ class GSTWebRTCApp:
             if not Gst.Element.link(self.nvimagesrc, videoconvert_capsfilter):
                 raise GSTWebRTCAppError("Failed to link nvimagesrc -> videoconvert")
 
-            if not Gst.Element.link(videoconvert_capsfilter, rtph265pay):
-                raise GSTWebRTCAppError(
-                    "Failed to link videoconvert_capsfilter -> rpth265pay")
+            self.__link_video_stage(videoconvert_capsfilter, rtph265pay, "encode", encoded=True)
 
             if not Gst.Element.link(rtph265pay, rtph265pay_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link rtph265pay -> rtph265pay_capsfilter")
 
             # Link the last element to the webrtcbin
-            if not Gst.Element.link(rtph265pay_capsfilter, self.webrtcbin):
-                raise GSTWebRTCAppError(
-                    "Failed to link rtph265pay_capsfilter -> webrtcbin")
+            self.__link_video_to_webrtcbin(rtph265pay_capsfilter)
+        elif self.raw_capture:
+            # NvFBC captures the screen and converts it to NV12 on the GPU,
+            # the software encoders get the frames without XGetImage/XShm
+            # copies and with little left to convert on the CPU.
+            self.nvimagesrc = Gst.ElementFactory.make("nvimagesrc", "x11")
+            self.nvimagesrc.set_property("show-pointer", 0)
+            self.nvimagesrc.set_property("do-timestamp", True)
+            self.nvimagesrc.set_property("gpu", self.gpu)
+            Gst.util_set_object_arg(self.nvimagesrc, "capture-mode", self.capture_mode)
+            self.nvimagesrc.set_property("idle-fps", self.idle_fps)
+            self.nvimagesrc.set_property("idle", self.idle)
+            self.nvimagesrc.set_property("high-refresh", self.high_refresh)
+            self.__set_nvimagesrc_sched()
+
+            # Without a GPU nvimagesrc falls back to XShm and converts the
+            # damaged areas to NV12 on the CPU.
+            raw_format = "NV12"
+            if self.unchanged_frame_interval > 0:
+                # NvFBC only produces the diff map of changed blocks for RGB
+                # frames grabbed to system memory. Frames nothing changed in
+                # are not encoded at all, which saves most of the CPU time on
+                # an idle desktop.
+                # XDamage gives the same for XShm capture.
+                raw_format = "BGRx"
+                if self.capture_mode == "cuda":
+                    Gst.util_set_object_arg(self.nvimagesrc, "capture-mode", "gl")
+                self.nvimagesrc.set_property("diff-map-block-size", 16)
+                self.nvimagesrc.set_property("unchanged-frame-interval", self.unchanged_frame_interval)
+
+            ximagesrc_caps = Gst.caps_from_string("video/x-raw,format=(string)%s" % raw_format)
+            ximagesrc_caps.set_value("framerate", Gst.Fraction(self.framerate, 1))
+            ximagesrc_capsfilter = Gst.ElementFactory.make("capsfilter")
+            ximagesrc_capsfilter.set_property("caps", ximagesrc_caps)
+
+            self.pipeline.add(self.nvimagesrc)
+            self.pipeline.add(ximagesrc_capsfilter)
+            if not Gst.Element.link(self.nvimagesrc, ximagesrc_capsfilter):
+                raise GSTWebRTCAppError("Failed to link nvimagesrc -> ximagesrc_capsfilter")
         else:
             # Create ximagesrc element named x11
             # Note that when using the ximagesrc plugin, ensure that the X11 server was
@@ -291,6 +414,11 @@ class GSTWebRTCApp:
             # frame buffers to an H.264 encoded byte-stream on the GPU.
             nvh264enc = Gst.ElementFactory.make("nvh264enc", "nvenc")
 
+            # Keep upload, conversion and encoding on the selected GPU.
+            if self.gpu >= 0:
+                for element in [cudaupload, cudaconvert, nvh264enc]:
+                    element.set_property("cuda-device-id", self.gpu)
+
             # The initial bitrate of the encoder in bits per second.
             # Setting this to 0 will use the bitrate from the NVENC preset.
             # This parameter can be set while the pipeline is running using the
@@ -371,6 +499,8 @@ class GSTWebRTCApp:
             rtph264pay_caps.set_value("rtcp-fb-ccm-fir", True)
             rtph264pay_caps.set_value("rtcp-fb-x-gstreamer-fir-as-repair", True)
 
+            self.__add_rtp_header_extensions(rtph264pay, rtph264pay_caps, self.video_pacing)
+
             # Create a capability filter for the rtph264pay_caps.
             rtph264pay_capsfilter = Gst.ElementFactory.make("capsfilter")
             rtph264pay_capsfilter.set_property("caps", rtph264pay_caps)
@@ -409,6 +539,8 @@ class GSTWebRTCApp:
             rtph264pay_caps.set_value("rtcp-fb-ccm-fir", True)
             rtph264pay_caps.set_value("rtcp-fb-x-gstreamer-fir-as-repair", True)
 
+            self.__add_rtp_header_extensions(rtph264pay, rtph264pay_caps, self.video_pacing)
+
             # Create a capability filter for the rtph264pay_caps.
             rtph264pay_capsfilter = Gst.ElementFactory.make("capsfilter")
             rtph264pay_capsfilter.set_property("caps", rtph264pay_caps)
@@ -430,6 +562,7 @@ class GSTWebRTCApp:
                 rtpvppay_caps.set_value("media", "video")
                 rtpvppay_caps.set_value("encoding-name", "VP8")
                 rtpvppay_caps.set_value("payload", 123)
+                self.__add_rtp_header_extensions(rtpvppay, rtpvppay_caps, self.video_pacing)
                 rtpvppay_capsfilter = Gst.ElementFactory.make("capsfilter")
                 rtpvppay_capsfilter.set_property("caps", rtpvppay_caps)
 
@@ -445,6 +578,7 @@ class GSTWebRTCApp:
                 rtpvppay_caps.set_value("media", "video")
                 rtpvppay_caps.set_value("encoding-name", "VP9")
                 rtpvppay_caps.set_value("payload", 123)
+                self.__add_rtp_header_extensions(rtpvppay, rtpvppay_caps, self.video_pacing)
                 rtpvppay_capsfilter = Gst.ElementFactory.make("capsfilter")
                 rtpvppay_capsfilter.set_property("caps", rtpvppay_caps)
 
@@ -489,9 +623,7 @@ class GSTWebRTCApp:
             self.pipeline.add(rtpvppay_capsfilter)
 
         if self.encoder == "nvh264enc":
-            if not Gst.Element.link(ximagesrc_capsfilter, cudaupload):
-                raise GSTWebRTCAppError(
-                    "Failed to link ximagesrc_capsfilter -> cudaupload")
+            self.__link_video_stage(ximagesrc_capsfilter, cudaupload, "capture")
 
             if not Gst.Element.link(cudaupload, cudaconvert):
                 raise GSTWebRTCAppError(
@@ -501,86 +633,303 @@ class GSTWebRTCApp:
                 raise GSTWebRTCAppError(
                     "Failed to link cudaconvert -> cudaconvert_capsfilter")
 
-            if not Gst.Element.link(cudaconvert_capsfilter, nvh264enc):
-                raise GSTWebRTCAppError(
-                    "Failed to link cudaconvert_capsfilter -> nvh264enc")
+            self.__link_video_stage(cudaconvert_capsfilter, nvh264enc, "convert")
 
             if not Gst.Element.link(nvh264enc, nvh264enc_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link nvh264enc -> nvh264enc_capsfilter")
 
-            if not Gst.Element.link(nvh264enc_capsfilter, rtph264pay):
-                raise GSTWebRTCAppError(
-                    "Failed to link nvh264enc_capsfilter -> rtph264pay")
+            self.__link_video_stage(nvh264enc_capsfilter, rtph264pay, "encode", encoded=True)
 
             if not Gst.Element.link(rtph264pay, rtph264pay_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link rtph264pay -> rtph264pay_capsfilter")
 
             # Link the last element to the webrtcbin
-            if not Gst.Element.link(rtph264pay_capsfilter, self.webrtcbin):
-                raise GSTWebRTCAppError(
-                    "Failed to link rtph264pay_capsfilter -> webrtcbin")
+            self.__link_video_to_webrtcbin(rtph264pay_capsfilter)
 
         elif self.encoder == "x264enc":
-            if not Gst.Element.link(ximagesrc_capsfilter, videoconvert):
-                raise GSTWebRTCAppError(
-                    "Failed to link ximagesrc_capsfilter -> videoconvert")
+            self.__link_video_stage(ximagesrc_capsfilter, videoconvert, "capture")
 
             if not Gst.Element.link(videoconvert, videoconvert_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link videoconvert -> videoconvert_capsfilter")
 
-            if not Gst.Element.link(videoconvert_capsfilter, x264enc):
-                raise GSTWebRTCAppError(
-                    "Failed to link videoconvert_capsfilter -> x264enc")
+            self.__link_video_stage(videoconvert_capsfilter, x264enc, "convert")
 
             if not Gst.Element.link(x264enc, x264enc_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link x264enc -> x264enc_capsfilter")
 
-            if not Gst.Element.link(x264enc_capsfilter, rtph264pay):
-                raise GSTWebRTCAppError(
-                    "Failed to link x264enc_capsfilter -> rtph264pay")
+            self.__link_video_stage(x264enc_capsfilter, rtph264pay, "encode", encoded=True)
 
             if not Gst.Element.link(rtph264pay, rtph264pay_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link rtph264pay -> rtph264pay_capsfilter")
 
             # Link the last element to the webrtcbin
-            if not Gst.Element.link(rtph264pay_capsfilter, self.webrtcbin):
-                raise GSTWebRTCAppError(
-                    "Failed to link rtph264pay_capsfilter -> webrtcbin")
+            self.__link_video_to_webrtcbin(rtph264pay_capsfilter)
 
         elif self.encoder.startswith("vp"):
-            if not Gst.Element.link(ximagesrc_capsfilter, videoconvert):
-                raise GSTWebRTCAppError(
-                    "Failed to link ximagesrc_capsfilter -> videoconvert")
+            self.__link_video_stage(ximagesrc_capsfilter, videoconvert, "capture")
 
             if not Gst.Element.link(videoconvert, videoconvert_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link videoconvert -> videoconvert_capsfilter")
 
-            if not Gst.Element.link(videoconvert_capsfilter, vpenc):
-                raise GSTWebRTCAppError(
-                    "Failed to link videoconvert_capsfilter -> vpenc")
+            self.__link_video_stage(videoconvert_capsfilter, vpenc, "convert")
 
             if not Gst.Element.link(vpenc, vpenc_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link vpenc -> vpenc_capsfilter")
 
-            if not Gst.Element.link(vpenc_capsfilter, rtpvppay):
-                raise GSTWebRTCAppError(
-                    "Failed to link vpenc_capsfilter -> rtpvppay")
+            self.__link_video_stage(vpenc_capsfilter, rtpvppay, "encode", encoded=True)
 
             if not Gst.Element.link(rtpvppay, rtpvppay_capsfilter):
                 raise GSTWebRTCAppError(
                     "Failed to link rtpvppay -> rtpvppay_capsfilter")
 
             # Link the last element to the webrtcbin
-            if not Gst.Element.link(rtpvppay_capsfilter, self.webrtcbin):
+            self.__link_video_to_webrtcbin(rtpvppay_capsfilter)
+
+    def __link_video_stage(self, upstream, downstream, stage, encoded=False):
+        """Links two stages of the video branch through a latency bounded queue.
+
+        The queue decouples the stages and drops the oldest buffers once it
+        holds more than video_queue_latency of video, so a stalled webrtcbin
+        or network does not build up a backlog of stale frames.
+
+        Encoded frames depend on the ones before them, dropping from the
+        middle of a GOP would leave everything up to the next keyframe
+        undecodable. An encoded stage therefore never leaks. Once it holds
+        video_queue_latency it asks the encoder for a keyframe and drops
+        the incoming frames until that keyframe arrives. The keyframe itself
+        is always queued, the queue holds twice the latency before it blocks
+        the encoder.
+
+        Arguments:
+            upstream {Gst.Element} -- last element of the previous stage.
+            downstream {Gst.Element} -- first element of the next stage.
+            stage {string} -- name of the stage, used for the queue name and metrics.
+            encoded {bool} -- True if the queue carries encoded video.
+        """
+
+        queue = Gst.ElementFactory.make("queue", "video_%s_queue" % stage)
+
+        # Only time based, leaky downstream drops the oldest raw buffers.
+        if encoded:
+            queue.set_property("max-size-time", 2 * self.video_queue_latency * 1000000)
+        else:
+            queue.set_property("leaky", "downstream")
+            queue.set_property("max-size-time", self.video_queue_latency * 1000000)
+        queue.set_property("max-size-buffers", 0)
+        queue.set_property("max-size-bytes", 0)
+
+        self.video_queues[stage] = queue
+        self.video_queue_drops[stage] = 0
+
+        if encoded:
+            queue.get_static_pad("sink").add_probe(
+                Gst.PadProbeType.BUFFER, self.__on_video_encoded_buffer)
+            queue.get_static_pad("sink").add_probe(
+                Gst.PadProbeType.BUFFER, lambda pad, info: self.__on_video_queue_encoded(pad, info, queue, stage))
+        else:
+            queue.connect("overrun", lambda q: self.__on_video_queue_overrun(q, stage))
+
+        self.pipeline.add(queue)
+
+        if not Gst.Element.link(upstream, queue):
+            raise GSTWebRTCAppError(
+                "Failed to link %s -> %s" % (upstream.get_name(), queue.get_name()))
+
+        if not Gst.Element.link(queue, downstream):
+            raise GSTWebRTCAppError(
+                "Failed to link %s -> %s" % (queue.get_name(), downstream.get_name()))
+
+    def __on_video_queue_overrun(self, queue, stage):
+        # Called from the streaming thread, a full leaky queue drops one
+        # buffer per overrun.
+        self.video_queue_drops[stage] += 1
+        logger.debug("video %s queue full, dropping the oldest buffer" % stage)
+
+    def __on_video_queue_encoded(self, pad, info, queue, stage):
+        # Called from the streaming thread for every frame entering an
+        # encoded stage queue.
+        keyframe = not info.get_buffer().has_flags(Gst.BufferFlags.DELTA_UNIT)
+
+        if stage in self.video_queue_skipping:
+            if not keyframe:
+                self.video_queue_drops[stage] += 1
+                return Gst.PadProbeReturn.DROP
+            self.video_queue_skipping.discard(stage)
+            logger.debug("video %s queue resumes at a keyframe" % stage)
+            return Gst.PadProbeReturn.OK
+
+        if not keyframe and queue.get_property("current-level-time") >= self.video_queue_latency * 1000000:
+            self.video_queue_skipping.add(stage)
+            self.video_queue_drops[stage] += 1
+            logger.debug("video %s queue full, dropping until the next keyframe" % stage)
+            event = GstVideo.video_event_new_upstream_force_key_unit(
+                Gst.CLOCK_TIME_NONE, True, 0)
+            pad.push_event(event)
+            return Gst.PadProbeReturn.DROP
+
+        return Gst.PadProbeReturn.OK
+
+    def __on_video_encoded_buffer(self, pad, info):
+        self.video_frames_encoded += 1
+        if not info.get_buffer().has_flags(Gst.BufferFlags.DELTA_UNIT):
+            self.video_keyframes_encoded += 1
+        return Gst.PadProbeReturn.OK
+
+    def get_video_encoder_stats(self):
+        """Returns the number of frames produced by the video encoder
+
+        Returns:
+            [dict] -- "frames" and "keyframes" encoded since the pipeline started.
+        """
+
+        return {
+            "frames": self.video_frames_encoded,
+            "keyframes": self.video_keyframes_encoded,
+        }
+
+    def get_video_gpu(self):
+        """Returns the GPU the video is captured and encoded on
+
+        Returns:
+            [integer] -- GPU index, None if the encoder does not run on a GPU
+                         or nvimagesrc has not placed itself yet.
+        """
+
+        if self.nvimagesrc is not None:
+            gpu = self.nvimagesrc.get_property("current-gpu")
+            return gpu if gpu >= 0 else None
+        if self.encoder == "nvh264enc":
+            return max(self.gpu, 0)
+        return None
+
+    def __set_nvimagesrc_sched(self):
+        """Applies the scheduling settings to the capture threads of nvimagesrc"""
+
+        Gst.util_set_object_arg(self.nvimagesrc, "sched-policy", self.sched_policy)
+        self.nvimagesrc.set_property("sched-priority", self.sched_priority)
+        if self.cpu_affinity:
+            self.nvimagesrc.set_property("cpu-affinity", self.cpu_affinity)
+        self.nvimagesrc.set_property("numa-local", self.numa_local)
+
+    def get_nvimagesrc_stats(self):
+        """Returns the stats of nvimagesrc
+
+        Returns:
+            [dict] -- the "stats" structure of nvimagesrc, None without it.
+        """
+
+        if self.nvimagesrc is None:
+            return None
+        stats = self.nvimagesrc.get_property("stats")
+        if stats is None:
+            return None
+        return self.__structure_to_dict(stats)
+
+    def get_video_queue_stats(self):
+        """Returns the fill level and drops of the video stage queues
+
+        Returns:
+            [dict] -- per stage dict with "level_time" in milliseconds,
+                      "level_buffers" and "dropped" buffers since the
+                      pipeline started.
+        """
+
+        res = {}
+        for stage, queue in list(self.video_queues.items()):
+            res[stage] = {
+                "level_time": queue.get_property("current-level-time") / 1000000,
+                "level_buffers": queue.get_property("current-level-buffers"),
+                "dropped": self.video_queue_drops.get(stage, 0),
+            }
+        return res
+
+    def __add_rtp_header_extensions(self, payloader, caps, paced=False):
+        """Adds the low latency RTP header extensions to a payloader.
+
+        transport-cc and abs-send-time let the browser estimate the bandwidth
+        from the packet arrival times, playout-delay with a zero minimum asks
+        it to keep the smallest jitter buffer. The extensions end up in the
+        payloader caps and webrtcbin puts them in the SDP offer.
+
+        The payloader stamps abs-send-time, so behind rtpframepacer the time
+        a packet is held back would look like queuing delay on the network.
+        Paced streams leave it out, transport-cc is numbered by webrtcbin
+        when the packet is actually sent.
+
+        Arguments:
+            payloader {Gst.Element} -- RTP payloader.
+            caps {Gst.Caps} -- caps of the capsfilter after the payloader, updated in place.
+            paced {bool} -- the packets pass through rtpframepacer.
+        """
+
+        for ext_id, uri in enumerate(RTP_HEADER_EXTENSIONS, start=1):
+            if paced and uri == RTP_HDREXT_ABS_SEND_TIME:
+                continue
+            try:
+                ext = GstRtp.RTPHeaderExtension.create_from_uri(uri)
+            except AttributeError:
+                logger.warning("RTP header extensions need GStreamer 1.20")
+                return
+            if ext is None:
+                logger.warning("no RTP header extension for %s" % uri)
+                continue
+
+            ext.set_id(ext_id)
+            if uri == RTP_HDREXT_PLAYOUT_DELAY:
+                ext.set_property("min-delay", 0)
+                ext.set_property("max-delay", 0)
+            payloader.emit("add-extension", ext)
+
+            if uri == RTP_HDREXT_TWCC:
+                caps.set_value("rtcp-fb-transport-cc", True)
+
+    def __link_video_to_webrtcbin(self, element):
+        """Links the last element of the video branch to webrtcbin.
+
+        With pacing enabled the RTP packets pass through a queue and the
+        rtpframepacer first. The queue decouples the encoder from the time
+        the pacer holds packets back.
+
+        Arguments:
+            element {Gst.Element} -- payloader capsfilter ending the video branch.
+        """
+
+        if not self.video_pacing:
+            if not Gst.Element.link(element, self.webrtcbin):
                 raise GSTWebRTCAppError(
-                    "Failed to link rtpvppay_capsfilter -> webrtcbin")
+                    "Failed to link %s -> webrtcbin" % element.get_name())
+            return
+
+        video_pacer_queue = Gst.ElementFactory.make("queue", "video_pacer_queue")
+
+        # Spread frames larger than bitrate/framerate over half of the frame
+        # interval, smaller frames are sent without delay.
+        video_pacer = Gst.ElementFactory.make("rtpframepacer", "video_pacer")
+        video_pacer.set_property("bitrate", self.video_bitrate*1000)
+        video_pacer.set_property("fps", float(self.framerate))
+        video_pacer.set_property("fraction", 0.5)
+
+        self.pipeline.add(video_pacer_queue)
+        self.pipeline.add(video_pacer)
+
+        if not Gst.Element.link(element, video_pacer_queue):
+            raise GSTWebRTCAppError(
+                "Failed to link %s -> video_pacer_queue" % element.get_name())
+
+        if not Gst.Element.link(video_pacer_queue, video_pacer):
+            raise GSTWebRTCAppError(
+                "Failed to link video_pacer_queue -> video_pacer")
+
+        if not Gst.Element.link(video_pacer, self.webrtcbin):
+            raise GSTWebRTCAppError(
+                "Failed to link video_pacer -> webrtcbin")
 
     # [END build_video_pipeline]
 
@@ -645,6 +994,8 @@ class GSTWebRTCApp:
         #   https://tools.ietf.org/html/rfc4566#section-6
         rtpopuspay_caps.set_value("payload", 111)
 
+        self.__add_rtp_header_extensions(rtpopuspay, rtpopuspay_caps)
+
         # Create a capability filter for the rtpopuspay_caps.
         rtpopuspay_capsfilter = Gst.ElementFactory.make("capsfilter")
         rtpopuspay_capsfilter.set_property("caps", rtpopuspay_caps)
@@ -700,6 +1051,9 @@ class GSTWebRTCApp:
         if self.encoder.startswith("vp"):
             required.append("vpx")
 
+        if self.video_pacing:
+            required.append("rtplowlatency")
+
         missing = list(
             filter(lambda p: Gst.Registry.get().find_plugin(p) is None, required))
         if missing:
@@ -731,6 +1085,76 @@ class GSTWebRTCApp:
         self.webrtcbin.emit('set-remote-description', answer, promise)
         promise.interrupt()
 
+        if self.yuv444 and self.nvimagesrc_capsfilter and \
+                (not self.__sdp_has_h264_444(sdp) or not self.__nvimagesrc_has_444()):
+            self.__disable_yuv444()
+
+    def __offer_h264_444(self, rtph264pay_caps):
+        """Offers High 4:4:4 Predictive and High as separate H.264 payload types.
+
+        The video transceiver gets both as codec preferences, so the client
+        can answer with High alone when it cannot decode 4:4:4.
+
+        Arguments:
+            rtph264pay_caps {Gst.Caps} -- caps of the payloader, the template of both payload types.
+        """
+
+        caps = Gst.Caps.new_empty()
+        for payload, profile_level_id in [(H264_PAYLOAD_444, "f4001f"), (H264_PAYLOAD_HIGH, "640c1f")]:
+            structure = rtph264pay_caps.get_structure(0).copy()
+            structure.set_value("payload", payload)
+            structure.set_value("clock-rate", 90000)
+            structure.set_value("packetization-mode", "1")
+            structure.set_value("profile-level-id", profile_level_id)
+            caps.append_structure(structure)
+
+        transceiver = self.webrtcbin.emit("get-transceiver", 0)
+        transceiver.set_property("codec-preferences", caps)
+
+    def __sdp_has_h264_444(self, sdp):
+        """Checks whether the answer kept the High 4:4:4 payload type in its video media.
+
+        Arguments:
+            sdp {string} -- SDP text of the answer.
+
+        Returns:
+            [bool] -- True if the video m-line lists the 4:4:4 payload type.
+        """
+
+        for line in sdp.splitlines():
+            if line.startswith("m=video"):
+                return str(H264_PAYLOAD_444) in line.split()[3:]
+        return False
+
+    def __nvimagesrc_has_444(self):
+        """Checks whether nvimagesrc encodes 4:4:4, it falls back to High on GPUs without it.
+
+        Returns:
+            [bool] -- False once nvimagesrc negotiated another profile.
+        """
+
+        caps = self.nvimagesrc.get_static_pad("src").get_current_caps()
+        if caps is None:
+            return True
+        return caps.get_structure(0).get_string("profile") == "high-4:4:4"
+
+    def __disable_yuv444(self):
+        """Switches nvimagesrc to 4:2:0 for a client that cannot decode 4:4:4 or a GPU that cannot encode it.
+
+        The new caps make nvimagesrc renegotiate and reopen its encoder.
+        """
+
+        logger.info("client or GPU lacks H.264 4:4:4, using 4:2:0")
+        self.yuv444 = False
+        caps = Gst.caps_from_string("video/x-h264,profile=high")
+        caps.set_value("framerate", Gst.Fraction(self.framerate, 1))
+        self.nvimagesrc_capsfilter.set_property("caps", caps)
+
+        # Sent with the High payload type the client answered with.
+        caps = self.rtph264pay_capsfilter.get_property("caps").copy()
+        caps.set_value("payload", H264_PAYLOAD_HIGH)
+        self.rtph264pay_capsfilter.set_property("caps", caps)
+
     def set_ice(self, mlineindex, candidate):
         """Adds ice candidate received from signalling server
 
@@ -774,6 +1198,29 @@ class GSTWebRTCApp:
             bitrate {integer} -- bitrate in bits per second, for example, 2000 for 2kbits/s or 10000 for 1mbit/sec.
         """
 
+        self.set_video_target_bitrate(bitrate)
+
+        logger.info("video bitrate set to: %d" % bitrate)
+
+        self.video_bitrate = bitrate
+
+        self.__send_data_channel_message(
+            "pipeline", {"status": "Video bitrate set to: %d" % bitrate})
+
+    def set_video_target_bitrate(self, bitrate):
+        """Changes the encoder target bitrate of the running pipeline
+
+        Unlike set_video_bitrate() this does not change the configured video
+        bitrate and does not notify the peer, it is meant for frequent
+        adjustments by the congestion controller.
+
+        Arguments:
+            bitrate {integer} -- bitrate in kbits per second.
+        """
+
+        if not self.pipeline:
+            return
+
         if self.encoder.startswith("nvh"):
             element = Gst.Bin.get_by_name(self.pipeline, "nvenc")
             element.set_property("bitrate", bitrate)
@@ -789,12 +1236,26 @@ class GSTWebRTCApp:
         else:
             logger.warning("set_video_bitrate not supported with encoder: %s" % self.encoder)
 
-        logger.info("video bitrate set to: %d" % bitrate)
+        if self.video_pacing:
+            element = Gst.Bin.get_by_name(self.pipeline, "video_pacer")
+            element.set_property("bitrate", bitrate*1000)
 
-        self.video_bitrate = bitrate
+    def set_video_fec_percentage(self, percentage):
+        """Sets the amount of ULPFEC protection of the video stream
 
-        self.__send_data_channel_message(
-            "pipeline", {"status": "Video bitrate set to: %d" % bitrate})
+        Only has an effect when the pipeline was started with video_fec. With
+        0 only the RED encapsulation remains, no FEC packets are sent.
+
+        Arguments:
+            percentage {integer} -- FEC packets per 100 media packets.
+        """
+
+        if not self.video_fec or not self.webrtcbin:
+            return
+
+        transceiver = self.webrtcbin.emit("get-transceiver", 0)
+        transceiver.set_property("fec-percentage", percentage)
+        logger.info("video fec percentage set to: %d" % percentage)
 
     def set_video_framerate(self, framerate):
         """Set NvFBC framerate
@@ -805,12 +1266,30 @@ class GSTWebRTCApp:
         if self.encoder.startswith("nvfbc"):
             element = Gst.Bin.get_by_name(self.pipeline, "x11")
             element.set_property("fps", framerate)
+            if self.video_pacing:
+                pacer = Gst.Bin.get_by_name(self.pipeline, "video_pacer")
+                pacer.set_property("fps", framerate)
             self.__send_data_channel_message(
                 "pipeline", {"status": "Video fps set to: %f" % framerate})
             return True
         else:
             return False
 
+    def set_idle(self, idle):
+        """Tells nvimagesrc whether the user is idle
+
+        While idle, a static screen is captured at idle_fps only. The full
+        framerate is back on the next slot once this is cleared.
+
+        Arguments:
+            idle {bool} -- True when no input arrived for a while.
+        """
+
+        self.idle = idle
+        if self.nvimagesrc is not None:
+            self.nvimagesrc.set_property("idle", idle)
+            logger.info("video %s" % ("idle, keep-alive at %d fps" % self.idle_fps if idle else "active"))
+
     def set_audio_bitrate(self, bitrate):
         """Set Opus encoder target bitrate in bps
 
@@ -848,19 +1327,54 @@ class GSTWebRTCApp:
         self.__send_data_channel_message(
             "cursor", data)
 
-    def send_gpu_stats(self, load, memory_total, memory_used):
+    def send_gpu_stats(self, load, memory_total, memory_used, encoder_load=None,
+                       decoder_load=None, encoder_sessions=None, encoder_fps=None, encoder_latency=None, gpu=None):
         """Sends GPU stats to the data channel
 
         Arguments:
             load {float} -- utilization of GPU between 0 and 1
             memory_total {float} -- total memory on GPU in MB
             memory_used {float} -- memor used on GPU in MB
+            encoder_load {float} -- utilization of NVENC between 0 and 1
+            decoder_load {float} -- utilization of NVDEC between 0 and 1
+            encoder_sessions {int} -- NVENC sessions on the GPU
+            encoder_fps {float} -- average fps of the NVENC sessions
+            encoder_latency {float} -- average NVENC latency in microseconds
+            gpu {int} -- index of the GPU the stats are from
         """
 
-        self.__send_data_channel_message("gpu_stats", {
+        stats = {
             "load": load,
             "memory_total": memory_total,
             "memory_used": memory_used,
+        }
+
+        # Only sent when the sampler provides them.
+        extra = {
+            "encoder_load": encoder_load,
+            "decoder_load": decoder_load,
+            "encoder_sessions": encoder_sessions,
+            "encoder_fps": encoder_fps,
+            "encoder_latency": encoder_latency,
+            "gpu": gpu,
+        }
+        stats.update({k: v for k, v in extra.items() if v is not None})
+
+        self.__send_data_channel_message("gpu_stats", stats)
+
+    def send_video_degradation(self, level, fps, reason=None):
+        """Sends the load degradation of the video to the data channel
+
+        Arguments:
+            level {int} -- degradation level, 0 is the selected framerate.
+            fps {int} -- framerate of the level.
+            reason {string} -- what triggered the last step down, None when recovering.
+        """
+
+        self.__send_data_channel_message("video_degradation", {
+            "level": level,
+            "fps": fps,
+            "reason": reason,
         })
 
     def send_reload_window(self):
@@ -931,6 +1445,19 @@ class GSTWebRTCApp:
         self.__send_data_channel_message(
             "latency_measurement", {"latency_ms": latency})
 
+    def send_video_fps(self, target_fps, achieved_fps):
+        """Sends the frame rate nvimagesrc achieves against its target
+
+        Arguments:
+            target_fps {float} -- the frame rate the source captures at.
+            achieved_fps {float} -- frames pushed over the last second.
+        """
+
+        self.__send_data_channel_message("video_fps", {
+            "target": target_fps,
+            "achieved": achieved_fps,
+        })
+
     def send_system_stats(self, cpu_percent, mem_total, mem_used):
         """Sends system stats
         """
@@ -942,6 +1469,79 @@ class GSTWebRTCApp:
                 "mem_used": mem_used,
             })
 
+    def get_webrtc_stats(self):
+        """Returns the current webrtcbin statistics
+
+        Blocks until webrtcbin answers the get-stats request.
+
+        Returns:
+            [dict] -- stats dicts keyed by stats id, the "type" of every
+                      entry is the stats type nick, e.g. "remote-inbound-rtp".
+                      The transport-wide congestion control stats of the video
+                      session are added under the "twcc" key when available.
+        """
+
+        if not self.webrtcbin:
+            return {}
+
+        promise = Gst.Promise.new()
+        self.webrtcbin.emit('get-stats', None, promise)
+        promise.wait()
+        reply = promise.get_reply()
+        if reply is None:
+            return {}
+
+        stats = self.__structure_to_dict(reply)
+
+        twcc = self.__get_twcc_stats()
+        if twcc:
+            stats["twcc"] = twcc
+
+        return stats
+
+    def __get_twcc_stats(self):
+        """Reads the TWCC stats of the video RTP session from the rtpbin in webrtcbin
+
+        Returns:
+            [dict] -- twcc stats or None when TWCC is not negotiated or not supported.
+        """
+
+        rtpbin = self.webrtcbin.get_by_name("rtpbin")
+        if not rtpbin:
+            return None
+
+        # The video stream is added first, so it uses RTP session 0.
+        session = rtpbin.emit("get-session", 0)
+        if not session:
+            return None
+
+        try:
+            twcc = session.get_property("twcc-stats")
+        except TypeError:
+            return None
+
+        if not twcc or twcc.n_fields() == 0:
+            return None
+
+        return self.__structure_to_dict(twcc)
+
+    def __structure_to_dict(self, structure):
+        """Converts a Gst.Structure to a dict, nested structures included.
+
+        Enum values are converted to their nicks.
+        """
+
+        res = {}
+        for i in range(structure.n_fields()):
+            name = structure.nth_field_name(i)
+            value = structure.get_value(name)
+            if isinstance(value, Gst.Structure):
+                value = self.__structure_to_dict(value)
+            elif hasattr(value, "value_nick"):
+                value = value.value_nick
+            res[name] = value
+        return res
+
     def is_data_channel_ready(self):
         """Checks to see if the data channel is open.
 
@@ -1053,8 +1653,11 @@ class GSTWebRTCApp:
             'on-message-string', lambda _, msg: self.on_data_message(msg))
 
         transceiver = self.webrtcbin.emit("get-transceiver", 0)
-        #transceiver.set_property("fec-type", GstWebRTC.WebRTCFECType.ULP_RED)
-        #transceiver.set_property("fec-percentage", 25)
+        if self.video_fec:
+            # FEC has to be negotiated up front, it starts disabled and is
+            # scaled by set_video_fec_percentage() with the measured loss.
+            transceiver.set_property("fec-type", GstWebRTC.WebRTCFECType.ULP_RED)
+            transceiver.set_property("fec-percentage", 0)
         transceiver.set_property("do-nack", True)
 
 
@@ -1071,6 +1674,11 @@ class GSTWebRTCApp:
             self.pipeline.set_state(Gst.State.NULL)
             self.pipeline.unparent()
             self.pipeline = None
+            self.video_queues = {}
+            self.video_queue_drops = {}
+            self.video_queue_skipping = set()
+            self.video_frames_encoded = 0
+            self.video_keyframes_encoded = 0
             logger.info("pipeline set to state NULL")
         if self.webrtcbin:
             self.webrtcbin.set_state(Gst.State.NULL)
@@ -0,0 +1,154 @@
+# Copyright 2021 The Selkies Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import logging
+logger = logging.getLogger("load_control")
+
+# Frame rate of each degradation level relative to the selected one.
+LEVELS = [1.0, 0.75, 0.5, 0.33, 0.25]
+
+# Share of the frame slots missed because the previous frame was not done
+# yet above which the session is overloaded, 0-1.
+LATE_HIGH = 0.05
+
+# NVENC utilization of the GPU above which it is saturated and below which
+# there is room to step back up, 0-1.
+ENCODER_LOAD_HIGH = 0.95
+ENCODER_LOAD_LOW = 0.80
+
+# Share of the budget the encode time has to stay below to step back up.
+RECOVER_MARGIN = 0.6
+
+# Minimum time between two steps down, the stats of the first period after
+# a step still show the old rate, seconds.
+DEGRADE_HOLDOFF = 2.0
+
+# Time the session has to be comfortably within its budget before the
+# next step up, seconds.
+RECOVER_HOLD = 10.0
+
+
+class LoadController:
+    """Lowers the frame rate of a session that falls behind on a shared GPU.
+
+    The per-frame capture and encode time and the frame slots nvimagesrc
+    missed tell whether this session keeps up, the NVENC utilization whether
+    the GPU as a whole is saturated. On overload the frame rate goes one level
+    down, after a quiet period one level up again.
+    """
+
+    def __init__(self, fps, latency_budget, min_fps=5):
+        """Arguments:
+            fps {integer} -- selected frame rate, the rate of level 0.
+            latency_budget {integer} -- milliseconds the capture and encode of a frame may take.
+            min_fps {integer} -- lowest frame rate the controller goes to.
+        """
+
+        self.max_fps = fps
+        self.latency_budget = latency_budget
+        self.min_fps = min_fps
+
+        self.on_fps = lambda fps: logger.warn(
+            "unhandled on_fps")
+        self.on_level = lambda level, fps, reason: logger.warn(
+            "unhandled on_level")
+
+        self.reset()
+
+    def reset(self):
+        self.level = 0
+        self.reason = None
+        self.encoder_load = None
+        self.last = None
+        self.last_degrade = None
+        self.last_overload = None
+
+    def fps(self):
+        """Returns the frame rate of the current level."""
+
+        return max(self.min_fps, int(round(self.max_fps * LEVELS[self.level])))
+
+    def set_max_fps(self, fps):
+        """Sets the frame rate of level 0, e.g. when the user selects one in the client.
+
+        Arguments:
+            fps {integer} -- selected frame rate.
+        """
+
+        self.max_fps = fps
+
+    def set_encoder_load(self, load):
+        """Feeds the NVENC utilization of the GPU the session encodes on.
+
+        Arguments:
+            load {float} -- utilization between 0 and 1.
+        """
+
+        self.encoder_load = load
+
+    def update(self, timestamp, stats):
+        """Feeds one snapshot of the nvimagesrc stats to the controller.
+
+        Arguments:
+            timestamp {float} -- time of the snapshot in seconds.
+            stats {dict} -- the "stats" of nvimagesrc.
+        """
+
+        sample = (stats.get("frames", 0), stats.get("encode-time", 0), stats.get("late-frames", 0))
+        last, self.last = self.last, sample
+
+        # The counters start over with a new pipeline.
+        if last is None or any(s < l for s, l in zip(sample, last)):
+            return
+
+        frames, encode_time, late = [s - l for s, l in zip(sample, last)]
+        if frames + late == 0:
+            return
+
+        avg_encode_ms = encode_time / 1000.0 / frames if frames else 0.0
+        late_ratio = late / float(frames + late)
+
+        reason = None
+        if avg_encode_ms > self.latency_budget:
+            reason = "encode_time"
+        elif late_ratio > LATE_HIGH:
+            reason = "late_frames"
+        elif self.encoder_load is not None and self.encoder_load > ENCODER_LOAD_HIGH:
+            reason = "gpu_load"
+
+        relaxed = avg_encode_ms < self.latency_budget * RECOVER_MARGIN and late == 0 and \
+            (self.encoder_load is None or self.encoder_load < ENCODER_LOAD_LOW)
+
+        level = self.level
+        if reason:
+            self.last_overload = timestamp
+            if level < len(LEVELS) - 1 and self.fps() > self.min_fps and \
+                    (self.last_degrade is None or timestamp - self.last_degrade >= DEGRADE_HOLDOFF):
+                level += 1
+                self.last_degrade = timestamp
+        elif not relaxed:
+            self.last_overload = timestamp
+        elif level > 0 and timestamp - max(self.last_overload or 0, self.last_degrade or 0) >= RECOVER_HOLD:
+            level -= 1
+            # The next step up needs another quiet period.
+            self.last_overload = timestamp
+            reason = None
+
+        if level != self.level:
+            logger.info("video load level %d -> %d, encode %.1f ms of %d ms, %.1f%% late, encoder load %s" % (
+                self.level, level, avg_encode_ms, self.latency_budget, late_ratio * 100, self.encoder_load))
+            self.level = level
+            self.reason = reason
+            self.on_fps(self.fps())
+            self.on_level(self.level, self.fps(), self.reason)
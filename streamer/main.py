@@ -14,6 +14,7 @@
 
 import argparse
 import asyncio
+import concurrent.futures
 import http.client
 import json
 import logging
@@ -28,8 +29,12 @@ from watchdog.events import FileClosedEvent, FileSystemEventHandler
 from webrtc_input import WebRTCInput
 from webrtc_signalling import WebRTCSignalling, WebRTCSignallingErrorNoPeer
 from gstwebrtc_app import GSTWebRTCApp
-from gpu_monitor import GPUMonitor
+from gpu_monitor import GPUMonitor, get_shared_sampler, least_loaded_gpu
 from system_monitor import SystemMonitor
+from xserver_watchdog import XServerWatchdog
+from webrtc_stats import WebRTCStatsMonitor
+from congestion_control import CongestionController, FECController
+from load_control import LoadController
 from metrics import Metrics
 from resize import resize_display, get_new_res
 from signalling_web import WebRTCSimpleServer, generate_rtc_config
@@ -368,12 +373,78 @@ def main():
     parser.add_argument('--encoder',
                         default=os.environ.get('WEBRTC_ENCODER', 'nvh264enc'),
                         help='gstreamer encoder plugin to use')
+    parser.add_argument('--enable_video_pacing',
+                        default=os.environ.get('WEBRTC_ENABLE_VIDEO_PACING', 'false'),
+                        help='Spread the RTP packets of large video frames over the frame interval')
+    parser.add_argument('--enable_congestion_control',
+                        default=os.environ.get('WEBRTC_ENABLE_CONGESTION_CONTROL', 'false'),
+                        help='Adapt the video bitrate to the congestion feedback of the peer, video_bitrate is used as the maximum')
+    parser.add_argument('--enable_adaptive_fec',
+                        default=os.environ.get('WEBRTC_ENABLE_ADAPTIVE_FEC', 'false'),
+                        help='Protect video with ULPFEC/RED scaled by the measured loss and RTT')
+    parser.add_argument('--video_bitrate_min',
+                        default=os.environ.get('WEBRTC_VIDEO_BITRATE_MIN', '500'),
+                        help='lowest video bitrate the congestion control goes to')
+    parser.add_argument('--video_queue_latency',
+                        default=os.environ.get('WEBRTC_VIDEO_QUEUE_LATENCY', '50'),
+                        help='milliseconds of video a stage queue holds before it drops the oldest raw frames, or encoded frames up to the next keyframe')
     parser.add_argument('--enable_resize',
                         default=os.environ.get('WEBRTC_ENABLE_RESIZE', 'true'),
                         help='Enable dynamic resizing to match browser size')
     parser.add_argument('--enable_cursors',
                         default=os.environ.get('WEBRTC_ENABLE_CURSORS', 'true'),
                         help='Enable passing remote cursors to client')
+    parser.add_argument('--gpu',
+                        default=os.environ.get('WEBRTC_GPU', 'auto'),
+                        help='GPU index to capture and encode on, "auto" picks the one with the least busy NVENC. nvimagesrc can only choose in gl capture mode on a display with an X screen per GPU')
+    parser.add_argument('--capture_mode',
+                        default=os.environ.get('WEBRTC_CAPTURE_MODE', 'auto'),
+                        help='how nvimagesrc captures, "gl" or "cuda" with NvFBC, "xshm" on hosts without a GPU or "auto" for gl that falls back to xshm when NvFBC cannot start')
+    parser.add_argument('--enable_raw_capture',
+                        default=os.environ.get('WEBRTC_ENABLE_RAW_CAPTURE', 'false'),
+                        help='capture with NvFBC instead of ximagesrc for the software encoders')
+    parser.add_argument('--unchanged_frame_interval',
+                        default=os.environ.get('WEBRTC_UNCHANGED_FRAME_INTERVAL', '0'),
+                        help='with raw capture, skip frames without screen changes but send one every this many milliseconds, 0 sends every frame')
+    parser.add_argument('--enable_yuv444',
+                        default=os.environ.get('WEBRTC_ENABLE_YUV444', 'false'),
+                        help='encode H.264 4:4:4 with nvfbch264enc for sharper text if the GPU and the client support it')
+    parser.add_argument('--refine_qp',
+                        default=os.environ.get('WEBRTC_REFINE_QP', '0'),
+                        help='with nvfbch264enc/nvfbchevcenc, re-encode a still screen in steps down to this QP with the idle bandwidth, 0 disables')
+    parser.add_argument('--enable_content_adaptive',
+                        default=os.environ.get('WEBRTC_ENABLE_CONTENT_ADAPTIVE', 'false'),
+                        help='with nvfbch264enc/nvfbchevcenc, switch the encoder between a text and a motion profile by the screen content')
+    parser.add_argument('--text_fps',
+                        default=os.environ.get('WEBRTC_TEXT_FPS', '0'),
+                        help='frame rate of the text profile of --enable_content_adaptive, 0 keeps the framerate')
+    parser.add_argument('--idle_timeout',
+                        default=os.environ.get('WEBRTC_IDLE_TIMEOUT', '0'),
+                        help='with nvimagesrc, seconds without user input until a static screen is captured at --idle_fps, 0 disables')
+    parser.add_argument('--idle_fps',
+                        default=os.environ.get('WEBRTC_IDLE_FPS', '1'),
+                        help='keep-alive frame rate of --idle_timeout')
+    parser.add_argument('--enable_high_refresh',
+                        default=os.environ.get('WEBRTC_ENABLE_HIGH_REFRESH', 'false'),
+                        help='with nvimagesrc, capture frames as applications present them instead of at 60 Hz and overlap capture and encode, for framerates of 90 and more')
+    parser.add_argument('--sched_policy',
+                        default=os.environ.get('WEBRTC_SCHED_POLICY', 'other'),
+                        help='with nvimagesrc, scheduling policy of the capture threads, "other", or "fifo" and "rr" which need CAP_SYS_NICE')
+    parser.add_argument('--sched_priority',
+                        default=os.environ.get('WEBRTC_SCHED_PRIORITY', '10'),
+                        help='real-time priority of the "fifo" and "rr" --sched_policy, 1-99')
+    parser.add_argument('--cpu_affinity',
+                        default=os.environ.get('WEBRTC_CPU_AFFINITY', ''),
+                        help='with nvimagesrc, CPUs the capture threads run on, e.g. "2-5,8", empty for all')
+    parser.add_argument('--enable_numa_local',
+                        default=os.environ.get('WEBRTC_ENABLE_NUMA_LOCAL', 'false'),
+                        help='with nvimagesrc, keep the capture threads on the CPUs of the NUMA node of the GPU')
+    parser.add_argument('--latency_budget',
+                        default=os.environ.get('WEBRTC_LATENCY_BUDGET', '0'),
+                        help='with nvfbch264enc/nvfbchevcenc, lower the framerate when capturing and encoding a frame takes longer than this many milliseconds or the GPU is saturated, 0 disables')
+    parser.add_argument('--gpu_stats_file',
+                        default=os.environ.get('WEBRTC_GPU_STATS_FILE', ''),
+                        help='read GPU stats from this JSON file instead of NVML, for testing')
     parser.add_argument('--metrics_port',
                         default=os.environ.get('METRICS_PORT', '8000'),
                         help='port to start metrics server on')
@@ -485,9 +556,29 @@ def main():
     curr_video_bitrate = int(args.video_bitrate)
     curr_audio_bitrate = int(args.audio_bitrate)
     enable_cursors = args.enable_cursors.lower() == "true"
+    enable_video_pacing = args.enable_video_pacing.lower() == "true"
+    enable_congestion_control = args.enable_congestion_control.lower() == "true"
+    enable_adaptive_fec = args.enable_adaptive_fec.lower() == "true"
+    enable_raw_capture = args.enable_raw_capture.lower() == "true" and not args.encoder.startswith("nv")
+    enable_yuv444 = args.enable_yuv444.lower() == "true"
+    enable_content_adaptive = args.enable_content_adaptive.lower() == "true"
+    enable_high_refresh = args.enable_high_refresh.lower() == "true"
+    enable_numa_local = args.enable_numa_local.lower() == "true"
+
+    # nvimagesrc places itself on the GPU with the least busy NVENC, for
+    # nvh264enc the same is picked here.
+    gpu = -1
+    if args.gpu != "auto":
+        gpu = int(args.gpu)
+    elif args.encoder == "nvh264enc":
+        try:
+            gpu = least_loaded_gpu(get_shared_sampler(args.gpu_stats_file))
+            logger.info("placing video on GPU %d" % gpu)
+        except Exception as e:
+            logger.warning("failed to select GPU, using the default one: %s" % e)
 
     # Create instance of app
-    app = GSTWebRTCApp(stun_servers, turn_servers, enable_audio, curr_fps, args.encoder, curr_video_bitrate, curr_audio_bitrate)
+    app = GSTWebRTCApp(stun_servers, turn_servers, enable_audio, curr_fps, args.encoder, curr_video_bitrate, curr_audio_bitrate, enable_video_pacing, enable_adaptive_fec, int(args.video_queue_latency), gpu, args.capture_mode, enable_raw_capture, int(args.unchanged_frame_interval), enable_yuv444, int(args.refine_qp), enable_content_adaptive, int(args.text_fps), int(args.idle_fps), enable_high_refresh, args.sched_policy, int(args.sched_priority), args.cpu_affinity, enable_numa_local)
 
     # [END main_setup]
 
@@ -503,8 +594,46 @@ def main():
     # Set ICE candidates received from signalling server.
     signalling.on_ice = app.set_ice
 
+    # Closed loop video bitrate and FEC control from the webrtcbin stats,
+    # the stats are also exported to the metrics server.
+    webrtc_stats_mon = WebRTCStatsMonitor(period=0.25)
+    webrtc_stats_mon.get_stats = lambda: app.get_webrtc_stats()
+    congestion_control = CongestionController(curr_video_bitrate, min_bitrate=int(args.video_bitrate_min))
+    congestion_control.on_bitrate = lambda bitrate: app.set_video_target_bitrate(bitrate)
+    fec_control = FECController()
+
+    def on_fec_percentage(percentage):
+        app.set_video_fec_percentage(percentage)
+        congestion_control.set_protection_overhead(percentage / 100.0)
+    fec_control.on_percentage = on_fec_percentage
+
+    def on_webrtc_stats(stats):
+        metrics.set_webrtc_stats(stats)
+        metrics.set_encoder_stats(app.get_video_encoder_stats())
+        if enable_adaptive_fec:
+            fec_control.update(stats)
+        if enable_congestion_control:
+            congestion_control.update(stats)
+    webrtc_stats_mon.on_stats = on_webrtc_stats
+
+    # Lower the framerate of the session while its GPU cannot keep up.
+    enable_load_control = int(args.latency_budget) > 0 and args.encoder.startswith("nvfbc")
+    load_control = LoadController(curr_fps, int(args.latency_budget))
+
+    def on_load_fps(fps):
+        if app.set_video_framerate(float(fps)):
+            logger.info("video framerate set to %d by load control" % fps)
+    load_control.on_fps = on_load_fps
+    load_control.on_level = lambda level, fps, reason: app.send_video_degradation(level, fps, reason)
+
     # Start the pipeline once the session is established.
-    signalling.on_session = app.start_pipeline
+    def on_session():
+        webrtc_stats_mon.reset()
+        congestion_control.reset()
+        fec_control.reset()
+        load_control.reset()
+        app.start_pipeline()
+    signalling.on_session = on_session
 
     # Initialize the Xinput instance
     webrtc_input = WebRTCInput(args.uinput_mouse_socket, args.uinput_js_socket, args.enable_clipboard.lower(), enable_cursors)
@@ -524,6 +653,8 @@ def main():
         app.send_resize_enabled(enable_resize)
         app.send_encoder(app.encoder)
         app.send_cursor_data(app.last_cursor_sent)
+        if enable_load_control:
+            app.send_video_degradation(load_control.level, load_control.fps(), load_control.reason)
 
     app.on_data_open = lambda: data_channel_ready()
 
@@ -531,7 +662,12 @@ def main():
     app.on_data_message = webrtc_input.on_message
 
     # Send video bitrate messages to app
-    webrtc_input.on_video_encoder_bit_rate = lambda bitrate: set_json_app_argument(args.json_config, "video_bitrate", bitrate) and (app.set_video_bitrate(int(bitrate)))
+    def set_video_bitrate_handler(bitrate):
+        set_json_app_argument(args.json_config, "video_bitrate", bitrate)
+        # With congestion control the selected bitrate becomes the ceiling.
+        congestion_control.set_max_bitrate(int(bitrate))
+        app.set_video_bitrate(int(bitrate))
+    webrtc_input.on_video_encoder_bit_rate = lambda bitrate: set_video_bitrate_handler(bitrate)
 
     # Send audio bitrate messages to app
     webrtc_input.on_audio_encoder_bit_rate = lambda bitrate: set_json_app_argument(args.json_config, "audio_bitrate", bitrate) and app.set_audio_bitrate(int(bitrate))
@@ -548,7 +684,11 @@ def main():
         set_json_app_argument(args.json_config, "framerate", fps)
         curr_fps = app.framerate
         app.set_framerate(fps)
-        if fps != curr_fps:
+        load_control.set_max_fps(int(fps))
+        if enable_load_control and load_control.level > 0:
+            # The selection applies on top of the current degradation.
+            app.set_video_framerate(float(load_control.fps()))
+        elif fps != curr_fps:
             if not app.set_video_framerate(float(fps)):
                 logger.warning("sending window reload to restart pipeline with new framerate")
                 app.send_reload_window()
@@ -606,12 +746,23 @@ def main():
     webrtc_input.on_client_latency = lambda latency_ms: metrics.set_latency(latency_ms)
 
     # Initialize GPU monitor
-    gpu_mon = GPUMonitor(enabled=args.encoder.startswith("nv"))
+    gpu_mon = GPUMonitor(enabled=args.encoder.startswith("nv") or bool(args.gpu_stats_file))
+    if gpu_mon.enabled:
+        try:
+            gpu_mon.sampler = get_shared_sampler(args.gpu_stats_file)
+        except Exception as e:
+            logger.error("failed to initialize GPU sampler: %s" % e)
+            gpu_mon.enabled = False
 
     # Send the GPU stats when available.
-    def on_gpu_stats(load, memory_total, memory_used):
-        app.send_gpu_stats(load, memory_total, memory_used)
-        metrics.set_gpu_utilization(load * 100)
+    def on_gpu_stats(stats):
+        app.send_gpu_stats(stats.load, stats.memory_total, stats.memory_used,
+                           encoder_load=stats.encoder_load, decoder_load=stats.decoder_load,
+                           encoder_sessions=stats.encoder_sessions,
+                           encoder_fps=stats.encoder_fps, encoder_latency=stats.encoder_latency,
+                           gpu=stats.index)
+        metrics.set_gpu_stats(stats)
+        load_control.set_encoder_load(stats.encoder_load)
 
     gpu_mon.on_stats = on_gpu_stats
 
@@ -622,9 +773,34 @@ def main():
         webrtc_input.ping_start = t
         app.send_system_stats(system_mon.cpu_percent, system_mon.mem_total, system_mon.mem_used)
         app.send_ping(t)
+        metrics.set_video_queue_stats(app.get_video_queue_stats())
+
+        if enable_load_control or enable_high_refresh:
+            stats = app.get_nvimagesrc_stats()
+            if stats and enable_load_control:
+                load_control.update(t, stats)
+            if stats and enable_high_refresh:
+                app.send_video_fps(stats.get("target-fps", 0.0), stats.get("achieved-fps", 0.0))
+
+        # Follow the GPU the video ended up on.
+        video_gpu = app.get_video_gpu()
+        if video_gpu is not None:
+            gpu_mon.gpu_index = video_gpu
 
     system_mon.on_timer = on_sysmon_timer
 
+    # Drop the video to the keep-alive rate while the user is idle, the
+    # first input event brings back the full rate.
+    idle_watchdog = None
+    if int(args.idle_timeout) > 0 and (args.encoder.startswith("nvfbc") or enable_raw_capture):
+        try:
+            idle_watchdog = XServerWatchdog(idle=int(args.idle_timeout), timeout=0)
+            idle_watchdog.on_idle = lambda: app.set_idle(True)
+            idle_watchdog.on_active = lambda: app.set_idle(False)
+        except Exception as e:
+            logger.error("failed to initialize idle watchdog: %s" % e)
+            idle_watchdog = None
+
     # [START main_start]
     # Connect to the signalling server and process messages.
     loop = asyncio.get_event_loop()
@@ -684,13 +860,27 @@ def main():
         server.run()
         metrics.start()
         loop.run_until_complete(webrtc_input.connect())
-        loop.run_in_executor(None, lambda: webrtc_input.start_clipboard())
-        loop.run_in_executor(None, lambda: webrtc_input.start_cursor_monitor())
-        loop.run_in_executor(None, lambda: gpu_mon.start())
-        loop.run_in_executor(None, lambda: hmac_turn_mon.start())
-        loop.run_in_executor(None, lambda: coturn_mon.start())
-        loop.run_in_executor(None, lambda: rtc_file_mon.start())
-        loop.run_in_executor(None, lambda: system_mon.start())
+        monitors = [
+            webrtc_input.start_clipboard,
+            webrtc_input.start_cursor_monitor,
+            gpu_mon.start,
+            hmac_turn_mon.start,
+            coturn_mon.start,
+            rtc_file_mon.start,
+            system_mon.start,
+            webrtc_stats_mon.start,
+        ]
+        if idle_watchdog:
+            monitors += [idle_watchdog.start, idle_watchdog.monitor]
+
+        # Each monitor blocks its thread for the lifetime of the process, a
+        # pool with a thread for each keeps them off the default executor,
+        # which is sized by the CPU count and would leave the last ones
+        # waiting on small hosts.
+        monitor_executor = concurrent.futures.ThreadPoolExecutor(
+            max_workers=len(monitors), thread_name_prefix="monitor")
+        for monitor in monitors:
+            loop.run_in_executor(monitor_executor, monitor)
 
         while True:
             loop.run_until_complete(signalling.connect())
@@ -707,6 +897,9 @@ def main():
         coturn_mon.stop()
         rtc_file_mon.stop()
         system_mon.stop()
+        webrtc_stats_mon.stop()
+        if idle_watchdog:
+            idle_watchdog.stop()
         server.server.close()
         sys.exit(0)
     # [END main_start]
@@ -20,7 +20,11 @@ import time
 
 logger = logging.getLogger("metrics")
 
-FPS_HIST_BUCKETS = (0, 20, 40, 60)
+FPS_HIST_BUCKETS = (0, 5, 10, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 75, 90, 120, 144)
+
+# Milliseconds, dense around the interactive range.
+LATENCY_HIST_BUCKETS = (5, 10, 15, 20, 25, 30, 40, 50, 60, 80, 100, 125, 150, 200, 250, 300, 400, 500, 750, 1000, 2000)
+JITTER_HIST_BUCKETS = (1, 2, 3, 5, 7.5, 10, 15, 20, 30, 50, 75, 100, 200)
 
 class Metrics:
     def __init__(self, port=8000):
@@ -29,7 +33,36 @@ class Metrics:
         self.fps = Gauge('fps', 'Frames per second observed by client')
         self.fps_hist = Histogram('fps_hist', 'Histogram of FPS observed by client', buckets=FPS_HIST_BUCKETS)
         self.gpu_utilization = Gauge('gpu_utilization', 'Utilization percentage reported by GPU')
+        self.gpu_device = Gauge('gpu_device', 'Index of the GPU the video is captured and encoded on')
+        self.gpu_memory_utilization = Gauge('gpu_memory_utilization', 'Memory controller utilization percentage reported by GPU')
+        self.gpu_memory_used = Gauge('gpu_memory_used', 'GPU memory used in MB')
+        self.gpu_encoder_utilization = Gauge('gpu_encoder_utilization', 'NVENC utilization percentage reported by GPU')
+        self.gpu_decoder_utilization = Gauge('gpu_decoder_utilization', 'NVDEC utilization percentage reported by GPU')
+        self.gpu_encoder_sessions = Gauge('gpu_encoder_sessions', 'NVENC sessions on the GPU')
+        self.gpu_encoder_fps = Gauge('gpu_encoder_fps', 'Average fps of the NVENC sessions on the GPU')
+        self.gpu_encoder_latency = Gauge('gpu_encoder_latency', 'Average NVENC encode latency in microseconds')
         self.latency = Gauge('latency', 'Latency observed by client')
+        self.latency_hist = Histogram('latency_hist', 'Histogram of latency observed by client', buckets=LATENCY_HIST_BUCKETS)
+
+        # Server side view of the video stream from the webrtcbin stats, the
+        # counters start from 0 with every session.
+        self.rtt = Gauge('webrtc_rtt', 'Video round trip time in milliseconds from RTCP receiver reports')
+        self.rtt_hist = Histogram('webrtc_rtt_hist', 'Histogram of video round trip time in milliseconds', buckets=LATENCY_HIST_BUCKETS)
+        self.jitter = Gauge('webrtc_jitter', 'Video interarrival jitter in milliseconds reported by the receiver')
+        self.jitter_hist = Histogram('webrtc_jitter_hist', 'Histogram of video interarrival jitter in milliseconds', buckets=JITTER_HIST_BUCKETS)
+        self.fraction_lost = Gauge('webrtc_fraction_lost', 'Fraction of video packets lost in the last receiver report')
+        self.packets_lost = Gauge('webrtc_packets_lost', 'Video packets lost in the session')
+        self.packets_sent = Gauge('webrtc_packets_sent', 'Video RTP packets sent in the session')
+        self.nack_count = Gauge('webrtc_nack_count', 'NACKs received in the session')
+        self.pli_count = Gauge('webrtc_pli_count', 'PLIs received in the session')
+        self.fir_count = Gauge('webrtc_fir_count', 'FIRs received in the session')
+        self.bitrate_sent = Gauge('webrtc_bitrate_sent', 'Video RTP bitrate sent in kbps')
+        self.frames_encoded = Gauge('webrtc_frames_encoded', 'Video frames encoded in the session')
+        self.keyframes_encoded = Gauge('webrtc_keyframes_encoded', 'Video keyframes encoded in the session')
+
+        self.video_queue_level_time = Gauge('video_queue_level_time', 'Milliseconds of video held by a stage queue', ['stage'])
+        self.video_queue_level_buffers = Gauge('video_queue_level_buffers', 'Buffers held by a stage queue', ['stage'])
+        self.video_queue_dropped = Gauge('video_queue_dropped', 'Buffers dropped by a stage queue since the pipeline started', ['stage'])
 
     def set_fps(self, fps):
         self.fps.set(fps)
@@ -37,9 +70,56 @@ class Metrics:
 
     def set_gpu_utilization(self, utilization):
         self.gpu_utilization.set(utilization)
+
+    def set_gpu_stats(self, stats):
+        self.gpu_device.set(stats.index)
+        self.set_gpu_utilization(stats.load * 100)
+        self.gpu_memory_utilization.set(stats.memory_load * 100)
+        self.gpu_memory_used.set(stats.memory_used)
+        self.gpu_encoder_utilization.set(stats.encoder_load * 100)
+        self.gpu_decoder_utilization.set(stats.decoder_load * 100)
+        self.gpu_encoder_sessions.set(stats.encoder_sessions)
+        self.gpu_encoder_fps.set(stats.encoder_fps)
+        self.gpu_encoder_latency.set(stats.encoder_latency)
     
     def set_latency(self, latency_ms):
         self.latency.set(latency_ms)
+        self.latency_hist.observe(latency_ms)
+
+    def set_webrtc_stats(self, stats):
+        """Exports one snapshot of the video sender stats.
+
+        Arguments:
+            stats {VideoTransportStats} -- video stats from WebRTCStatsMonitor.
+        """
+
+        # The stats repeat the last receiver report until the next one
+        # arrives, only observe each one once.
+        if stats.rr_fresh:
+            if stats.rtt is not None:
+                self.rtt.set(stats.rtt * 1000)
+                self.rtt_hist.observe(stats.rtt * 1000)
+            self.jitter.set(stats.jitter * 1000)
+            self.jitter_hist.observe(stats.jitter * 1000)
+            self.fraction_lost.set(stats.fraction_lost)
+            self.packets_lost.set(stats.packets_lost)
+
+        self.packets_sent.set(stats.packets_sent)
+        self.nack_count.set(stats.nack_count)
+        self.pli_count.set(stats.pli_count)
+        self.fir_count.set(stats.fir_count)
+        if stats.bitrate_sent is not None:
+            self.bitrate_sent.set(stats.bitrate_sent)
+
+    def set_encoder_stats(self, stats):
+        self.frames_encoded.set(stats["frames"])
+        self.keyframes_encoded.set(stats["keyframes"])
+
+    def set_video_queue_stats(self, stats):
+        for stage, s in stats.items():
+            self.video_queue_level_time.labels(stage).set(s["level_time"])
+            self.video_queue_level_buffers.labels(stage).set(s["level_buffers"])
+            self.video_queue_dropped.labels(stage).set(s["dropped"])
     
     def start(self):
         start_http_server(self.port)
@@ -0,0 +1,141 @@
+# Copyright 2021 The Selkies Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import time
+
+import logging
+logger = logging.getLogger("webrtc_stats")
+
+VIDEO_CLOCK_RATE = 90000
+
+
+class VideoTransportStats:
+    """Video sender statistics extracted from one webrtcbin stats snapshot.
+
+    Attributes:
+        timestamp {float} -- time of the snapshot in seconds.
+        rr_fresh {bool} -- True if a new RTCP receiver report arrived since the previous snapshot.
+        fraction_lost {float} -- fraction of packets lost reported by the last receiver report, 0-1.
+        packets_lost {int} -- cumulative number of lost packets reported by the receiver.
+        rtt {float} -- round trip time in seconds from the last receiver report, None if unknown.
+        jitter {float} -- interarrival jitter in seconds reported by the receiver.
+        bytes_sent {int} -- cumulative video RTP bytes sent.
+        packets_sent {int} -- cumulative video RTP packets sent.
+        nack_count {int} -- NACKs received from the peer.
+        pli_count {int} -- PLIs received from the peer.
+        fir_count {int} -- FIRs received from the peer.
+        bitrate_sent {float} -- video RTP bitrate since the previous snapshot in kbps, None for the first snapshot.
+        twcc {dict} -- transport-wide congestion control stats of the video session, None if not negotiated.
+    """
+
+    def __init__(self):
+        self.timestamp = time.time()
+        self.rr_fresh = False
+        self.fraction_lost = 0.0
+        self.packets_lost = 0
+        self.rtt = None
+        self.jitter = 0.0
+        self.bytes_sent = 0
+        self.packets_sent = 0
+        self.nack_count = 0
+        self.pli_count = 0
+        self.fir_count = 0
+        self.bitrate_sent = None
+        self.twcc = None
+
+
+class WebRTCStatsMonitor:
+    def __init__(self, period=0.25, enabled=True):
+        self.period = period
+        self.enabled = enabled
+        self.running = False
+
+        self.last_rr = None
+        self.last_sent = None
+
+        self.get_stats = lambda: {}
+
+        self.on_stats = lambda stats: logger.warn(
+            "unhandled on_stats")
+
+    def start(self):
+        self.running = True
+        while self.running:
+            if self.enabled:
+                try:
+                    stats = self.parse_video_stats(self.get_stats())
+                    if stats:
+                        self.on_stats(stats)
+                except Exception as e:
+                    logger.warning("failed to read webrtc stats: %s" % e)
+            time.sleep(self.period)
+
+    def stop(self):
+        self.running = False
+
+    def reset(self):
+        self.last_rr = None
+        self.last_sent = None
+
+    def parse_video_stats(self, stats):
+        """Picks the video sender stats from a webrtcbin stats snapshot.
+
+        Arguments:
+            stats {dict} -- stats as returned by GSTWebRTCApp.get_webrtc_stats()
+
+        Returns:
+            [VideoTransportStats] -- video stats or None if the video stream is not sending yet.
+        """
+
+        outbound = self.__find_video_stats(stats, "outbound-rtp")
+        if outbound is None:
+            return None
+
+        res = VideoTransportStats()
+        res.bytes_sent = outbound.get("bytes-sent", 0)
+        res.packets_sent = outbound.get("packets-sent", 0)
+        res.nack_count = outbound.get("nack-count", 0)
+        res.pli_count = outbound.get("pli-count", 0)
+        res.fir_count = outbound.get("fir-count", 0)
+        res.twcc = stats.get("twcc")
+
+        if self.last_sent is not None:
+            last_timestamp, last_bytes = self.last_sent
+            if res.timestamp > last_timestamp and res.bytes_sent >= last_bytes:
+                res.bitrate_sent = (res.bytes_sent - last_bytes) * 8 / 1000.0 / (res.timestamp - last_timestamp)
+        self.last_sent = (res.timestamp, res.bytes_sent)
+
+        remote = self.__find_video_stats(stats, "remote-inbound-rtp")
+        if remote is not None:
+            res.fraction_lost = remote.get("fraction-lost", 0.0)
+            res.packets_lost = remote.get("packets-lost", 0)
+            res.rtt = remote.get("round-trip-time")
+            res.jitter = remote.get("jitter", 0.0)
+
+            # Receiver reports arrive about once a second, the stats repeat the
+            # last one in between.
+            rr = (res.fraction_lost, res.packets_lost, res.rtt, res.jitter)
+            res.rr_fresh = rr != self.last_rr
+            self.last_rr = rr
+
+        return res
+
+    def __find_video_stats(self, stats, stats_type):
+        for s in stats.values():
+            if not isinstance(s, dict) or s.get("type") != stats_type:
+                continue
+            codec = stats.get(s.get("codec-id"), {})
+            if codec.get("clock-rate", VIDEO_CLOCK_RATE) == VIDEO_CLOCK_RATE:
+                return s
+        return None
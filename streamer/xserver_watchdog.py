@@ -15,6 +15,7 @@
 import asyncio
 import math
 import sys
+import threading
 import time
 import os
 
@@ -30,6 +31,7 @@ logger = logging.getLogger("xserver_watchdog")
 Events:
 
     on_idle: called when idle is detected
+    on_active: called on the first input event after idle
     on_timeout: called whn watchdog expires.
 """
 
@@ -44,7 +46,7 @@ class XServerWatchdog:
 
         Keyword Arguments:
             idle {int} -- idle detection time in seconds (default: {10})
-            timeout {int} -- timeout in seconds (default: {600})
+            timeout {int} -- timeout in seconds, 0 never expires (default: {600})
         """
 
         self.__local_dpy = display.Display()
@@ -56,7 +58,9 @@ class XServerWatchdog:
         self.last_event_time = time.time()
         self.running = False
         self.is_idle = False
+        self.__lock = threading.Lock()
         self.on_idle = lambda: logger.warning("unhandled on_idle")
+        self.on_active = lambda: None
         self.on_timeout = lambda: logger.warning("unhandled on_timeout")
 
     def stroke(self):
@@ -69,7 +73,14 @@ class XServerWatchdog:
 
         t = time.time()
         logger.debug("saw event at %f" % t)
-        self.last_event_time = t
+        with self.__lock:
+            self.last_event_time = t
+            if self.is_idle:
+                # Leave idle on the event itself rather than on the next
+                # monitor tick, consumers snap back to full rate with it.
+                logger.info("watchdog reset")
+                self.is_idle = False
+                self.on_active()
 
     def __record_callback(self, reply):
         """Handler for Xlib event recorder
@@ -170,34 +181,26 @@ class XServerWatchdog:
         """
 
         self.running = True
-        idle_ttl, timeout_ttl = self.ttl()
-        last_idle_ttl = idle_ttl
 
         while self.running:
-            # Change detection
-            if self.is_idle and idle_ttl == self.idle and idle_ttl != last_idle_ttl:
-                logger.info("watchdog reset")
-                self.is_idle = False
-
-            # Detect idle state
-            if idle_ttl <= 0 and idle_ttl != last_idle_ttl:
-                logger.info(
-                    "idle detected, watchdog expires in %d seconds" % timeout_ttl)
-                self.is_idle = True
-                self.on_idle()
+            # Detect idle state, under the lock so that an event arriving
+            # meanwhile is not lost behind on_idle.
+            with self.__lock:
+                idle_ttl, timeout_ttl = self.ttl()
+                if not self.is_idle and idle_ttl <= 0:
+                    logger.info(
+                        "idle detected, watchdog expires in %d seconds" % timeout_ttl)
+                    self.is_idle = True
+                    self.on_idle()
 
             # Detect watchdog expiration
-            if timeout_ttl <= 0:
+            if self.timeout > 0 and timeout_ttl <= 0:
                 logger.info("watchdog expired")
                 self.on_timeout()
                 self.stop()
 
             time.sleep(0.5)
 
-            last_idle_ttl = idle_ttl
-
-            idle_ttl, timeout_ttl = self.ttl()
-
         logger.debug("monitor loop completed")
 
 